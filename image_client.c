@@ -0,0 +1,125 @@
+// Small client for the local image service (T1 --server).
+// Usage: image_client <socket_path> <operations> <input.ppm> <output.ppm> [--shm]
+// With --shm the P6 payload is handed over through a named file mapping instead of the socket.
+
+#include "image_service.h"
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Function to read a whole file into memory
+unsigned char *read_file(const char *file_name, size_t *size) {
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        printf("Error opening the file %s\n", file_name);
+        return NULL;
+    }
+
+    _fseeki64(file, 0, SEEK_END);
+    *size = (size_t)_ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+
+    unsigned char *data = malloc(*size);
+    if (!data || fread(data, 1, *size, file) != *size) {
+        printf("Error reading the file %s\n", file_name);
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    return data;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 5) {
+        printf("Usage: %s <socket_path> <operations> <input.ppm> <output.ppm> [--shm]\n", argv[0]);
+        return 1;
+    }
+    const char *operations = argv[2];
+    int use_shm = argc > 5 && strcmp(argv[5], "--shm") == 0;
+
+    size_t payload_length;
+    unsigned char *payload = read_file(argv[3], &payload_length);
+    if (!payload) {
+        return 1;
+    }
+
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        printf("Failed to initialize Winsock.\n");
+        return 1;
+    }
+
+    SOCKET server = service_connect(argv[1]);
+    if (server == INVALID_SOCKET) {
+        printf("Could not connect to the image service at %s\n", argv[1]);
+        return 1;
+    }
+
+    // Place the payload in a named mapping the server opens by name
+    char shm_name[SERVICE_MAX_SHM_NAME_LENGTH];
+    HANDLE mapping = NULL;
+    if (use_shm) {
+        snprintf(shm_name, sizeof(shm_name), "Local\\image_client_%lu", GetCurrentProcessId());
+        mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                    (DWORD)((uint64_t)payload_length >> 32), (DWORD)payload_length, shm_name);
+        void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, payload_length) : NULL;
+        if (!view) {
+            printf("Failed to create shared memory %s\n", shm_name);
+            return 1;
+        }
+        memcpy(view, payload, payload_length);
+        UnmapViewOfFile(view);
+    }
+
+    ServiceRequest request = {0};
+    request.magic = SERVICE_MAGIC;
+    request.ops_length = (uint32_t)strlen(operations);
+    request.shm_name_length = use_shm ? (uint32_t)strlen(shm_name) : 0;
+    request.payload_length = payload_length;
+
+    if (service_send_all(server, &request, sizeof(request)) != 0 ||
+        service_send_all(server, operations, request.ops_length) != 0 ||
+        (use_shm && service_send_all(server, shm_name, request.shm_name_length) != 0) ||
+        (!use_shm && service_send_all(server, payload, payload_length) != 0)) {
+        printf("Failed to send the request.\n");
+        return 1;
+    }
+
+    ServiceResponse response;
+    if (service_recv_all(server, &response, sizeof(response)) != 0 || response.magic != SERVICE_MAGIC) {
+        printf("Failed to read the service response.\n");
+        return 1;
+    }
+    if (response.status != SERVICE_STATUS_OK) {
+        printf("Service returned error status %d\n", response.status);
+        return 1;
+    }
+
+    unsigned char *result = malloc(response.payload_length);
+    if (!result || service_recv_all(server, result, response.payload_length) != 0) {
+        printf("Failed to read the result payload.\n");
+        return 1;
+    }
+
+    FILE *output = fopen(argv[4], "wb");
+    if (!output) {
+        printf("Error opening file %s for writing.\n", argv[4]);
+        return 1;
+    }
+    fwrite(result, 1, response.payload_length, output);
+    fclose(output);
+
+    printf("Result saved as %s (%s)\n", argv[4], response.cached ? "cached" : "computed");
+
+    if (mapping) {
+        CloseHandle(mapping);
+    }
+    closesocket(server);
+    WSACleanup();
+    free(result);
+    free(payload);
+    return 0;
+}
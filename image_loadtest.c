@@ -0,0 +1,207 @@
+// Load-test tool for the local image service (T1 --server).
+// Usage: image_loadtest <socket_path> <operations> <input.ppm> <threads> <requests_per_thread> [--unique]
+// Each thread keeps one connection open and sends its requests back to back. With --unique every
+// request carries a slightly different payload so the service cache is bypassed.
+
+#include "image_service.h"
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Structure holding the shared parameters and per-thread results
+typedef struct {
+    const char *socket_path;
+    const char *operations;
+    const unsigned char *payload;
+    size_t payload_length;
+    int requests;
+    int unique;
+    int thread_index;
+    double *latencies;   // Milliseconds, one per request
+    int completed;
+    int cache_hits;
+} LoadTestWorker;
+
+LARGE_INTEGER counter_frequency;
+
+// Function to read a whole file into memory
+unsigned char *read_file(const char *file_name, size_t *size) {
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        printf("Error opening the file %s\n", file_name);
+        return NULL;
+    }
+
+    _fseeki64(file, 0, SEEK_END);
+    *size = (size_t)_ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+
+    unsigned char *data = malloc(*size);
+    if (!data || fread(data, 1, *size, file) != *size) {
+        printf("Error reading the file %s\n", file_name);
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    return data;
+}
+
+// Function to return the current time in milliseconds
+double now_ms(void) {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart * 1000.0 / counter_frequency.QuadPart;
+}
+
+// Function run by each load-test thread
+DWORD WINAPI load_test_thread(LPVOID parameter) {
+    LoadTestWorker *worker = (LoadTestWorker *)parameter;
+
+    SOCKET server = service_connect(worker->socket_path);
+    if (server == INVALID_SOCKET) {
+        printf("Thread %d could not connect to %s\n", worker->thread_index, worker->socket_path);
+        return 1;
+    }
+
+    unsigned char *payload = malloc(worker->payload_length);
+    unsigned char *result = NULL;
+    uint64_t result_capacity = 0;
+    if (!payload) {
+        closesocket(server);
+        return 1;
+    }
+    memcpy(payload, worker->payload, worker->payload_length);
+
+    ServiceRequest request = {0};
+    request.magic = SERVICE_MAGIC;
+    request.ops_length = (uint32_t)strlen(worker->operations);
+    request.payload_length = worker->payload_length;
+
+    for (int k = 0; k < worker->requests; k++) {
+        if (worker->unique) {
+            // Stamp the request number into the last pixel bytes so every payload hashes differently
+            uint32_t stamp = (uint32_t)(worker->thread_index * worker->requests + k);
+            memcpy(payload + worker->payload_length - sizeof(stamp), &stamp, sizeof(stamp));
+        }
+
+        double start = now_ms();
+        ServiceResponse response;
+        if (service_send_all(server, &request, sizeof(request)) != 0 ||
+            service_send_all(server, worker->operations, request.ops_length) != 0 ||
+            service_send_all(server, payload, worker->payload_length) != 0 ||
+            service_recv_all(server, &response, sizeof(response)) != 0 ||
+            response.status != SERVICE_STATUS_OK) {
+            printf("Thread %d: request %d failed.\n", worker->thread_index, k);
+            break;
+        }
+        if (response.payload_length > result_capacity) {
+            free(result);
+            result = malloc(response.payload_length);
+            result_capacity = result ? response.payload_length : 0;
+        }
+        if (!result || service_recv_all(server, result, response.payload_length) != 0) {
+            printf("Thread %d: reading result %d failed.\n", worker->thread_index, k);
+            break;
+        }
+
+        worker->latencies[worker->completed++] = now_ms() - start;
+        worker->cache_hits += response.cached != 0;
+    }
+
+    free(result);
+    free(payload);
+    closesocket(server);
+    return 0;
+}
+
+// Function to compare two latencies for qsort
+int compare_latency(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 6) {
+        printf("Usage: %s <socket_path> <operations> <input.ppm> <threads> <requests_per_thread> [--unique]\n", argv[0]);
+        return 1;
+    }
+
+    int threads = atoi(argv[4]);
+    int requests = atoi(argv[5]);
+    int unique = argc > 6 && strcmp(argv[6], "--unique") == 0;
+    if (threads <= 0 || requests <= 0) {
+        printf("Threads and requests must be positive.\n");
+        return 1;
+    }
+
+    size_t payload_length;
+    unsigned char *payload = read_file(argv[3], &payload_length);
+    if (!payload) {
+        return 1;
+    }
+
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        printf("Failed to initialize Winsock.\n");
+        return 1;
+    }
+    QueryPerformanceFrequency(&counter_frequency);
+
+    LoadTestWorker *workers = calloc(threads, sizeof(LoadTestWorker));
+    HANDLE *handles = calloc(threads, sizeof(HANDLE));
+    double *latencies = malloc((size_t)threads * requests * sizeof(double));
+    if (!workers || !handles || !latencies) {
+        printf("Memory allocation failed.\n");
+        return 1;
+    }
+
+    double start = now_ms();
+    for (int t = 0; t < threads; t++) {
+        workers[t].socket_path = argv[1];
+        workers[t].operations = argv[2];
+        workers[t].payload = payload;
+        workers[t].payload_length = payload_length;
+        workers[t].requests = requests;
+        workers[t].unique = unique;
+        workers[t].thread_index = t;
+        workers[t].latencies = latencies + (size_t)t * requests;
+        handles[t] = CreateThread(NULL, 0, load_test_thread, &workers[t], 0, NULL);
+    }
+    for (int t = 0; t < threads; t++) {
+        if (handles[t]) {
+            WaitForSingleObject(handles[t], INFINITE);
+            CloseHandle(handles[t]);
+        }
+    }
+    double elapsed = now_ms() - start;
+
+    // Gather the completed latencies into one contiguous array for the percentiles
+    int completed = 0, cache_hits = 0;
+    for (int t = 0; t < threads; t++) {
+        memmove(latencies + completed, workers[t].latencies, workers[t].completed * sizeof(double));
+        completed += workers[t].completed;
+        cache_hits += workers[t].cache_hits;
+    }
+    if (completed == 0) {
+        printf("No request completed.\n");
+        return 1;
+    }
+    qsort(latencies, completed, sizeof(double), compare_latency);
+
+    printf("Requests:    %d (%d cache hits)\n", completed, cache_hits);
+    printf("Elapsed:     %.1f ms\n", elapsed);
+    printf("Throughput:  %.1f requests/s\n", completed * 1000.0 / elapsed);
+    printf("Latency p50: %.2f ms\n", latencies[completed / 2]);
+    printf("Latency p99: %.2f ms\n", latencies[(int)((completed - 1) * 0.99)]);
+    printf("Latency max: %.2f ms\n", latencies[completed - 1]);
+
+    WSACleanup();
+    free(latencies);
+    free(handles);
+    free(workers);
+    free(payload);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#ifndef IMAGE_SERVICE_H
+#define IMAGE_SERVICE_H
+
+// Wire protocol shared by the image service (main.c --server), image_client and image_loadtest.
+// Every request is a ServiceRequest header, followed by the operation chain text
+// (e.g. "grayscale,rotate"), followed by either the shared-memory name or the raw P6 payload.
+// Every reply is a ServiceResponse header followed by the resulting P6 payload.
+
+#include <winsock2.h>
+#include <afunix.h> // AF_UNIX sockets (Windows 10 1803 and later)
+#include <stdint.h>
+#include <string.h>
+
+#define SERVICE_MAGIC 0x31505349u // "ISP1"
+#define SERVICE_DEFAULT_SOCKET "image_service.sock"
+#define SERVICE_MAX_OPS_LENGTH 1024
+#define SERVICE_MAX_SHM_NAME_LENGTH 128
+
+// Status codes returned in ServiceResponse.status
+#define SERVICE_STATUS_OK 0
+#define SERVICE_STATUS_BAD_REQUEST 1
+#define SERVICE_STATUS_BAD_IMAGE 2
+#define SERVICE_STATUS_BAD_OPERATIONS 3
+#define SERVICE_STATUS_FAILED 4
+
+// Structure sent by the client at the start of every request
+typedef struct {
+    uint32_t magic;
+    uint32_t ops_length;      // Bytes of operation chain text following the header
+    uint32_t shm_name_length; // When non-zero, the payload lives in this named file mapping instead of the socket
+    uint32_t reserved;
+    uint64_t payload_length;  // Bytes of P6 data (in the socket or in the mapping)
+} ServiceRequest;
+
+// Structure sent by the server at the start of every reply
+typedef struct {
+    uint32_t magic;
+    int32_t status;           // One of the SERVICE_STATUS_* values
+    uint32_t cached;          // 1 when the result came from the in-memory cache
+    uint32_t reserved;
+    uint64_t payload_length;  // Bytes of P6 data following the header
+} ServiceResponse;
+
+// Function to send a whole buffer over a socket, looping over partial sends
+static inline int service_send_all(SOCKET socket_fd, const void *buffer, uint64_t length) {
+    const char *data = (const char *)buffer;
+    while (length > 0) {
+        int chunk = length > (1u << 30) ? (1 << 30) : (int)length;
+        int sent = send(socket_fd, data, chunk, 0);
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        length -= (uint64_t)sent;
+    }
+    return 0;
+}
+
+// Function to receive exactly length bytes from a socket, looping over partial reads
+static inline int service_recv_all(SOCKET socket_fd, void *buffer, uint64_t length) {
+    char *data = (char *)buffer;
+    while (length > 0) {
+        int chunk = length > (1u << 30) ? (1 << 30) : (int)length;
+        int received = recv(socket_fd, data, chunk, 0);
+        if (received <= 0) {
+            return -1;
+        }
+        data += received;
+        length -= (uint64_t)received;
+    }
+    return 0;
+}
+
+// Function to connect to the image service listening on the given socket path
+static inline SOCKET service_connect(const char *socket_path) {
+    SOCKET socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) == SOCKET_ERROR) {
+        closesocket(socket_fd);
+        return INVALID_SOCKET;
+    }
+    return socket_fd;
+}
+
+#endif // IMAGE_SERVICE_H
@@ -1,3 +1,4 @@
+#include "image_service.h" // Must come before windows.h so winsock2.h wins over winsock.h
 #include <windows.h>
 #include <commdlg.h> // For common dialogs like file open
 #include <ctype.h>
@@ -7,6 +8,11 @@
 #include <math.h>
 #include <omp.h> // OpenMP for parallelization
 #include <io.h> // For access function
+#include <fcntl.h> // For _O_BINARY
+#include <stdint.h>
+#include <limits.h>
+#include <malloc.h> // For _aligned_malloc
+#include <stddef.h> // For offsetof
 
 // Constants
 #define MIN_IMAGE_SIZE 400
@@ -17,7 +23,7 @@
 
 // Dimensions for the window and button sizes
 #define WINDOW_WIDTH 600
-#define WINDOW_HEIGHT 500
+#define WINDOW_HEIGHT 600
 #define BUTTON_WIDTH 200
 #define BUTTON_HEIGHT 40
 #define BUTTON_MARGIN 10
@@ -32,11 +38,330 @@ void ShowWelcomeWindow();
 #define MAX_WINDOW_WIDTH 1200
 #define MAX_WINDOW_HEIGHT 800
 
+// Limits for operation chains and the image service result cache
+#define MAX_OPERATIONS 32
+#define SERVICE_CACHE_CAPACITY (256ull * 1024 * 1024) // Bytes of cached results kept in memory
+
+// QOI (Quite OK Image) lossless format
+#define QOI_MAGIC "qoif"
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+#define QOI_MAX_PIXELS 400000000
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+#define QOI_HASH(c) (((c).r * 3 + (c).g * 5 + (c).b * 7 + (c).a * 11) % 64)
+
+// Large P6 payloads are read and written by all threads, each with positional I/O on its own chunk
+#define PARALLEL_IO_MIN_BYTES (64ull * 1024 * 1024)
+#define PARALLEL_IO_CHUNK (8u * 1024 * 1024)
+
+// ASCII (P3) output: lines are kept within the PPM line length limit, rows are formatted in chunks of this many
+#define P3_MAX_LINE 70
+#define P3_CHUNK_ROWS 32
+
+// Batch mode: files are read and written with overlapped I/O on a completion port, this many at a time
+#define BATCH_QUEUE_DEPTH 64
+#define BATCH_MAX_FILE_SIZE (1u << 30)
+
+// Batch result cache: results are kept under outputs/cache, named by a hash of the input file, the operation
+// chain (with its masks, kernels and overlays) and RESULT_CACHE_VERSION. The index remembers each input's size,
+// modification time and hash, so unchanged inputs are not even read.
+#define RESULT_CACHE_DIRECTORY "outputs/cache"
+#define RESULT_CACHE_INDEX "outputs/cache/index.txt"
+#define RESULT_CACHE_VERSION 1 // Raise whenever an operation's output changes
+
+// Decode-time downscaling: images are read row by row and box-averaged by 1/2, 1/4 or 1/8 while parsing
+#define SCALED_MAX_FACTOR 8
+#define ROW_READER_BUFFER_SIZE (64 * 1024)
+
+// Stream mode: PPM/PGM frames pass from stdin to stdout through a reader thread, the chain and a writer thread,
+// with this many frames in flight. Frame buffers are reused while the frame size stays the same.
+#define STREAM_FRAME_SLOTS 4
+#define STREAM_IO_BUFFER_SIZE (1u << 20)
+
+// Tiled container: header, tile index (offset and length per tile, row-major) and tile data, little-endian
+#define TILED_MAGIC "ITIL"
+#define TILED_VERSION 1
+#define TILED_HEADER_SIZE 36
+#define TILED_INDEX_ENTRY_SIZE 16
+#define TILED_DEFAULT_TILE_SIZE 256
+#define TILED_COMPRESSION_NONE 0
+#define TILED_COMPRESSION_QOI 1
+
+// Deep-zoom export: a DZI manifest plus one directory of PNG tiles per pyramid level
+#define DEEP_ZOOM_DEFAULT_TILE_SIZE 256
+#define PNG_MAX_STORED_BLOCK 65535
+
+// Color matrices run in fixed point with this many fractional bits. Weights and offsets are bounded so the
+// fixed-point sums of the kernels stay within an int.
+#define COLOR_MATRIX_SHIFT 12
+#define COLOR_MATRIX_MAX_WEIGHT 64
+#define COLOR_MATRIX_MAX_OFFSET 4096
+
+// Color spaces: luminance uses 16-bit fixed point, HSV hue has 256 steps per 60 degree sector
+#define YCBCR_SHIFT 16
+#define HUE_SECTOR 256
+#define HUE_RANGE (6 * HUE_SECTOR)
+#define HUE_MAX_SATURATION_FACTOR 64 // Keeps the 8-bit fixed-point saturation scale far from int overflow
+
+// Planar layout: channel rows are padded to this many bytes so kernels run at full vector width
+#define PLANAR_ALIGNMENT 64
+#define PLANAR_MIN_RUN 2 // Shortest run of operations worth unpacking to planes
+
+// Median filter: radius limits and the narrowest column strip given to one thread
+#define MEDIAN_MAX_RADIUS 50
+#define MEDIAN_MIN_STRIP 64
+
+// Edge detection: 3x3 gradient kernels, computed tile by tile
+#define EDGE_SOBEL 0
+#define EDGE_SCHARR 1
+#define EDGE_TILE_SIZE 128
+
+// Morphology with rectangular structuring elements of (2 * rx + 1) x (2 * ry + 1) pixels
+#define MORPH_ERODE 0
+#define MORPH_DILATE 1
+#define MORPH_OPEN 2
+#define MORPH_CLOSE 3
+#define MORPH_GRADIENT 4
+#define MORPH_STRIP_WIDTH 256 // Columns handled together by the vertical pass
+
+// Convolution: kernel size limit, FFT tile sizes, and how much faster per tap the direct loop runs
+// than the flop count suggests (it vectorizes well); used to choose between the two paths
+#define CONVOLVE_MAX_KERNEL 1024
+#define CONVOLVE_MIN_FFT 32
+#define CONVOLVE_MAX_FFT 4096
+#define CONVOLVE_DIRECT_SPEEDUP 4.0
+
+// Dithering: error diffusion runs rows as a wavefront, each row trailing the one above by DITHER_LAG
+// pixels, in chunks of DITHER_CHUNK; errors are kept in 1/16 units in a ring of DITHER_ERROR_ROWS rows
+#define DITHER_FLOYD 0
+#define DITHER_ATKINSON 1
+#define DITHER_BAYER 2
+#define DITHER_LAG 2
+#define DITHER_CHUNK 64
+#define DITHER_ERROR_ROWS 4
+
+// Orientation tags for chain images: the stored pixels are shown with the axes swapped first (transpose),
+// then mirrored left-right and/or upside down. The 8 combinations are the rotations and flips of the image.
+#define ORIENT_MIRROR_X 1
+#define ORIENT_MIRROR_Y 2
+#define ORIENT_TRANSPOSE 4
+#define ORIENT_ROTATE (ORIENT_TRANSPOSE | ORIENT_MIRROR_Y) // The quarter turn of rotate_image
+#define ORIENT_TILE_SIZE 64
+
+// Lazy evaluation: operation chains are recorded and computed per tile on demand
+#define LAZY_TILE_SIZE 128
+
 // Structure to represent an RGB pixel
 typedef struct {
     unsigned char r, g, b; // Red, Green, Blue components of a pixel
 } Pixel;
 
+// Single-channel 8-bit pixel used once an operation has produced gray data
+typedef unsigned char Gray8;
+
+// Structure to carry an image through an operation chain, either as RGB or as single-channel gray
+typedef struct {
+    int width, height;
+    Pixel **rgb;  // Set while the image has three channels
+    Gray8 **gray; // Set instead of rgb once the image is gray
+    void *parent; // Image that rgb or gray is a view into after a crop, freed once the rows are replaced
+    int orientation; // Pending ORIENT_* tag: width x height pixels are stored unrotated until a consumer needs the layout
+} ChainImage;
+
+// Structure to describe pixels in place: rows of width pixels of channels bytes, stride bytes apart.
+// Crops and tiles are views into their parent's buffer, so making one copies no pixels.
+typedef struct {
+    unsigned char *base; // First byte of the top-left pixel
+    int width, height;
+    int channels;        // 3 for Pixel data, 1 for Gray8
+    size_t stride;       // Bytes from the start of one row to the next
+} ImageView;
+
+// Structure to represent a rectangle in image coordinates
+typedef struct {
+    int x, y, width, height;
+} Rect;
+
+// Structure restricting an operation to part of the image
+typedef struct {
+    Rect rect;                    // Only pixels inside the rectangle are processed
+    Gray8 **mask;                 // Optional image-sized mask; pixels where it is 0 are skipped
+    int mask_width, mask_height;
+} Region;
+
+// True when a pixel inside the region rectangle is excluded by the region mask
+#define REGION_SKIPS(region, i, j) ((region) && (region)->mask && !(region)->mask[i][j])
+
+// Structure to represent an RGBA color as used by the QOI index
+typedef struct {
+    unsigned char r, g, b, a;
+} QoiColor;
+
+// Structure reading an image file one decoded row at a time (P6, P5, P3, QOI or a tiled container), for loaders
+// that never hold the whole image; P3 text and QOI chunks are parsed from a small read buffer
+typedef struct {
+    FILE *file;
+    const char *file_name;
+    char format[3];   // "P6", "P5", "P3", "QO" for QOI or "IT" for a tiled container
+    int width, height;
+    int channels;     // 1 for P5, 3 otherwise
+    int max_color;
+    QoiColor index[64], pixel; // QOI decoder state carried from row to row
+    int run;
+    Pixel **band;     // Tiled containers: the band of tiles holding the next row, tile_size rows high
+    int tile_size, next_row;
+    size_t length, position;
+    unsigned char buffer[ROW_READER_BUFFER_SIZE];
+} RowReader;
+
+// Structure tracking one file of a batch through its read, processing and write
+typedef struct {
+    OVERLAPPED overlapped; // First member, so a completed OVERLAPPED leads back to its file
+    HANDLE file;
+    const char *input_name;
+    char output_name[MAX_PATH];
+    unsigned char *data;   // File contents, then the encoded result
+    size_t size;
+    int writing;
+    uint64_t file_size, modified; // Input size and last write time, for the result cache index
+    uint64_t content_hash;        // Hash of the input file, valid when hashed is set
+    int hashed;
+} BatchFile;
+
+// Structure holding one line of the result cache index
+typedef struct {
+    char *path;
+    uint64_t size, modified;
+    uint64_t content_hash;
+    int replaced; // Set when the current batch has a newer entry for the path
+} ResultCacheEntry;
+
+// Structure holding the result cache index of a batch, sorted by path
+typedef struct {
+    ResultCacheEntry *entries;
+    int count;
+    uint64_t chain_hash;
+} ResultCache;
+
+// Structure holding one frame of a stream on its way from stdin to stdout
+typedef struct {
+    ChainImage image;                       // Frame as read, then the chain result
+    void *buffer;                           // Pixel or gray image the frame is read into, kept for the next frame
+    int buffer_width, buffer_height, buffer_gray;
+    int skip;                               // Set when the chain failed on this frame or an earlier one
+    int end;                                // Set on the slot following the last frame
+} StreamFrame;
+
+// Structure shared by the threads of stream mode; each slot goes reader -> chain -> writer -> reader
+typedef struct {
+    StreamFrame frames[STREAM_FRAME_SLOTS];
+    HANDLE free_slots, read_slots, processed_slots; // Semaphores counting the slots waiting for each stage
+    FILE *input, *output;
+    volatile int failed;                            // Set by any stage; the reader then ends the stream
+    int frames_written;
+} FrameStream;
+
+// File formats that save_image can write
+typedef enum {
+    FORMAT_PPM,
+    FORMAT_QOI,
+    FORMAT_P3 // ASCII PPM, for consumers that cannot read binary P6
+} OutputFormat;
+
+// Structure describing an opened tiled container
+typedef struct {
+    int width, height;
+    int tile_size;
+    int compression;           // TILED_COMPRESSION_NONE or TILED_COMPRESSION_QOI
+    int tiles_x, tiles_y;
+    uint64_t *tile_offsets;    // File offset of each tile, row-major
+    uint64_t *tile_lengths;    // Stored bytes of each tile
+} TiledHeader;
+
+// Structure holding the lookup tables shared by the per-pixel point operations
+typedef struct {
+    unsigned char xray[256];
+    unsigned char aged_red[256], aged_green[256], aged_blue[256];
+} PointCurves;
+
+// Operations that can be chained outside the GUI (service mode)
+typedef enum {
+    OP_GRAYSCALE,
+    OP_NEGATIVE,
+    OP_XRAY,
+    OP_ROTATE,
+    OP_AGED,
+    OP_COLOR_MATRIX,
+    OP_LUMA_CURVE,
+    OP_HUE_SATURATION,
+    OP_MEDIAN,
+    OP_EDGES,
+    OP_MORPHOLOGY,
+    OP_CONVOLVE,
+    OP_DITHER,
+    OP_OVERLAY,
+    OP_CROP,
+    OP_ORIENT
+} OperationType;
+
+// Structure to represent a 3x4 color matrix: each output channel is a weighted sum of r, g, b plus an offset
+typedef struct {
+    double m[3][4];  // Rows produce r, g, b; the fourth column is an offset in 0-255 units
+    int fixed[3][4]; // Same matrix in COLOR_MATRIX_SHIFT fixed point, rounding bias folded into the offset
+} ColorMatrix;
+
+// Structure to represent one step of an operation chain
+typedef struct {
+    OperationType type;
+    int has_region;     // When set the operation only touches region, e.g. "negative@10:20:300:200"
+    Region region;
+    ColorMatrix matrix; // Used by OP_COLOR_MATRIX
+    unsigned char curve[256]; // Used by OP_LUMA_CURVE: applied to Y only
+    int hue_shift;            // Used by OP_HUE_SATURATION: added to the hue, in 1/HUE_RANGE turns
+    int saturation_scale;     // Used by OP_HUE_SATURATION: HSV saturation multiplier in 8-bit fixed point
+    int radius;               // Used by OP_MEDIAN: window is (2 * radius + 1) squared
+    int edge_kernel;          // Used by OP_EDGES: EDGE_SOBEL or EDGE_SCHARR
+    int edge_orientation;     // Used by OP_EDGES: color edges by gradient direction instead of gray magnitude
+    int morphology;           // Used by OP_MORPHOLOGY: one of the MORPH_* values
+    int radius_y;             // Used by OP_MORPHOLOGY: vertical radius, radius being the horizontal one
+    float *kernel;            // Used by OP_CONVOLVE: kernel_height rows of kernel_width weights, freed with the chain
+    int kernel_width, kernel_height;
+    int dither_method;        // Used by OP_DITHER: one of the DITHER_* values
+    int levels;               // Used by OP_DITHER: output levels per channel (2 to 256)
+    Pixel **overlay;          // Used by OP_OVERLAY: colors covering region.rect, freed with the chain
+    Gray8 **overlay_alpha;    // Used by OP_OVERLAY: opacity of each overlay pixel (0 transparent, 255 opaque)
+    Rect crop;                // Used by OP_CROP: kept rectangle, clipped to the image when applied
+    int orientation;          // Used by OP_ORIENT: ORIENT_* tag composed into the image (OP_ROTATE is ORIENT_ROTATE)
+} Operation;
+
+// Structure to represent an RGB image as three separate channel planes (structure of arrays)
+typedef struct {
+    int width, height;
+    int stride;        // Bytes per plane row, a multiple of PLANAR_ALIGNMENT
+    Gray8 *planes[3];  // Red, green and blue planes, each stride * height bytes and aligned
+} PlanarImage;
+
+// Structure to represent a recorded operation chain whose result is computed tile by tile on demand
+typedef struct {
+    Pixel **source;                       // Private copy of the input image, so later edits of it cannot reach the chain
+    int source_width, source_height;
+    int width, height;                    // Size of the result after the recorded rotations
+    Operation operations[MAX_OPERATIONS];
+    int stage_rotations[MAX_OPERATIONS];  // Rotations recorded before each operation
+    int count;
+    int rotations;                        // Total recorded rotations
+    int tiles_x, tiles_y;
+    Pixel **tiles;                        // Computed tiles (LAZY_TILE_SIZE squared), NULL until requested
+    int tiles_computed;
+    PointCurves curves;
+} LazyImage;
+
 // Function prototypes
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 LRESULT CALLBACK ComparisonWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
@@ -44,15 +369,121 @@ void create_directory(const char *directory_name);
 Pixel **allocate_image(int width, int height);
 void free_image(Pixel **image);
 Pixel **load_image(const char *file_name, int *width, int *height);
+int read_file_parallel(const char *file_name, uint64_t offset, void *data, uint64_t size);
+int write_file_parallel(const char *file_name, const void *header, size_t header_size, const void *data, uint64_t size);
+Pixel **load_image_scaled(const char *file_name, int scale, int *width, int *height);
+static uint32_t read_u32_be(const unsigned char *buffer);
+static uint64_t hash_operation_chain(const char *operations, const Operation *chain, int count);
 void save_image(const char *file_name, Pixel **image, int width, int height);
 void convert_to_grayscale(Pixel **image, int width, int height);
 void generate_negative_image(Pixel **image, int width, int height);
 void generate_xray_image(Pixel **image, int width, int height);
 Pixel **rotate_image(Pixel **image, int width, int height);
+Pixel **rotate_image_in_place(Pixel **image, int width, int height);
+void orient_image_in_place(void *image, int element, int *width, int *height, int orientation);
 void generate_aged_image(Pixel **image, int width, int height);
+Rect clip_region(const Region *region, int width, int height);
+void convert_to_grayscale_region(Pixel **image, int width, int height, const Region *region);
+void generate_negative_image_region(Pixel **image, int width, int height, const Region *region);
+void generate_xray_image_region(Pixel **image, int width, int height, const Region *region);
+void generate_aged_image_region(Pixel **image, int width, int height, const Region *region);
 void process_image(HWND hwnd, int operation);
 void apply_all_transformations(HWND hwnd);
 void show_comparison_window(Pixel **original, Pixel **modified, int width, int height);
+int parse_operation_chain(const char *chain, Operation *operations, int max_operations);
+int apply_operation_chain(ChainImage *image, const Operation *operations, int count);
+void free_chain_image(ChainImage *image);
+void replace_chain_pixels(ChainImage *image, Pixel **rgb, Gray8 **gray);
+ImageView chain_image_view(const ChainImage *image);
+int compose_orientation(int first, int second);
+void orient_view(const ImageView *source, int orientation, const ImageView *target);
+int orient_operation(const Operation *operation, const ChainImage *image, Operation *oriented);
+int resolve_chain_orientation(ChainImage *image);
+int promote_chain_image(ChainImage *image);
+int decode_chain_image(const unsigned char *data, size_t size, ChainImage *image);
+unsigned char *encode_chain_image(const ChainImage *image, size_t *size);
+Pixel **decode_ppm_buffer(const unsigned char *data, size_t size, int *width, int *height);
+unsigned char *encode_ppm_buffer(Pixel **image, int width, int height, size_t *size);
+Gray8 **decode_pgm_buffer(const unsigned char *data, size_t size, int *width, int *height);
+unsigned char *encode_pgm_buffer(Gray8 **image, int width, int height, size_t *size);
+Gray8 **allocate_gray_image(int width, int height);
+void free_gray_image(Gray8 **image);
+ImageView view_of_image(Pixel **image, int width, int height);
+ImageView view_of_gray_image(Gray8 **image, int width, int height);
+ImageView crop_view(ImageView view, Rect rect);
+Pixel **image_from_view(const ImageView *view);
+Gray8 **gray_image_from_view(const ImageView *view);
+int crop_chain_image(ChainImage *image, Rect rect);
+void save_gray_image(const char *file_name, Gray8 **image, int width, int height);
+Gray8 **convert_to_gray8(Pixel **image, int width, int height);
+void expand_gray_image(Gray8 **gray, Pixel **image, int width, int height);
+void generate_negative_gray(Gray8 **image, int width, int height);
+void generate_xray_gray(Gray8 **image, int width, int height);
+Gray8 **rotate_gray_image(Gray8 **image, int width, int height);
+void apply_gray_curve(Gray8 **image, int width, int height, const unsigned char curve[256]);
+void apply_gray_curve_region(Gray8 **image, int width, int height, const unsigned char curve[256], const Region *region);
+void generate_negative_gray_region(Gray8 **image, int width, int height, const Region *region);
+void generate_xray_gray_region(Gray8 **image, int width, int height, const Region *region);
+Gray8 **load_gray_image(const char *file_name, int *width, int *height);
+void free_operation_chain(Operation *operations, int count);
+void build_aged_curves(unsigned char red[256], unsigned char green[256], unsigned char blue[256]);
+Pixel **generate_aged_from_gray(Gray8 **image, int width, int height);
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed);
+unsigned char *encode_qoi_buffer(Pixel **image, int width, int height, size_t *size);
+unsigned char *encode_p3_buffer(Pixel **image, int width, int height, size_t *size);
+Pixel **decode_qoi_buffer(const unsigned char *data, size_t size, int *width, int *height);
+Pixel **decode_qoi_with_alpha(const unsigned char *data, size_t size, int *width, int *height, Gray8 ***alpha);
+Pixel **load_overlay_image(const char *file_name, int *width, int *height, Gray8 ***alpha);
+void build_output_name(char *buffer, size_t size, const char *base_name, int is_gray);
+int read_pnm_header(FILE *file, char format[3], int *width, int *height, int *max_color);
+int convert_to_tiled(const char *input_name, const char *output_name, int tile_size, int compression);
+int read_tiled_header(FILE *file, TiledHeader *header);
+Pixel **load_tiled_region(const char *file_name, int x, int y, int *region_width, int *region_height);
+unsigned char *encode_png_buffer(const unsigned char *pixels, int channels, size_t row_step, int width, int height, size_t *size);
+int export_deep_zoom(ChainImage *image, const char *output_name, int tile_size);
+int run_command_line(int argc, char **argv);
+int run_batch(const char *operations, char **inputs, int count);
+int run_stream(const char *operations);
+void build_name_from_input(char *output_name, size_t size, const char *input_name, const char *suffix);
+void build_xray_curve(unsigned char curve[256]);
+void build_point_curves(PointCurves *curves);
+Pixel apply_point_operation(const Operation *operation, Pixel pixel, int *is_gray, const PointCurves *curves);
+void prepare_color_matrix(ColorMatrix *matrix);
+int color_matrix_in_range(const ColorMatrix *matrix);
+void build_gray_matrix(ColorMatrix *matrix);
+int fuse_color_matrices(Operation *into, const Operation *next);
+int plan_operation_chain(Operation *operations, int count);
+void apply_color_matrix_region(Pixel **image, int width, int height, const ColorMatrix *matrix, const Region *region);
+int fuse_operations(Operation *into, const Operation *next);
+PlanarImage *allocate_planar_image(int width, int height);
+void free_planar_image(PlanarImage *planar);
+PlanarImage *unpack_to_planar(Pixel **image, int width, int height);
+void pack_from_planar(const PlanarImage *planar, Pixel **image);
+int apply_planar_run(ChainImage *image, const Operation *operations, int start, int count);
+int median_filter_image_region(Pixel **image, int width, int height, int radius, const Region *region);
+int median_filter_gray_region(Gray8 **image, int width, int height, int radius, const Region *region);
+int operation_is_pointwise(OperationType type);
+int apply_edge_operation(ChainImage *image, const Operation *operation, const Region *region);
+int morphology_image_region(Pixel **image, int width, int height, int kind, int radius_x, int radius_y, const Region *region);
+int morphology_gray_region(Gray8 **image, int width, int height, int kind, int radius_x, int radius_y, const Region *region);
+float *load_convolution_kernel(const char *file_name, int *kernel_width, int *kernel_height);
+int dither_region(const ImageView *view, int method, int levels, const Region *region);
+void overlay_region(Pixel **image, int width, int height, Pixel **overlay, Gray8 **alpha, Rect rect);
+int convolve_region(const ImageView *view, const float *kernel, int kernel_width, int kernel_height, const Region *region);
+void rgb_to_hsv_planes(Pixel **image, Rect area, unsigned short *hue, Gray8 **saturation, Gray8 **value);
+void hsv_planes_to_rgb(const unsigned short *hue, Gray8 **saturation, Gray8 **value, Pixel **image, Rect area, Gray8 **mask);
+int apply_luma_curve_region(Pixel **image, int width, int height, const unsigned char curve[256], const Region *region);
+int apply_hue_saturation_region(Pixel **image, int width, int height, int hue_shift, int saturation_scale, const Region *region);
+LazyImage *create_lazy_image(Pixel **source, int width, int height);
+void free_lazy_image(LazyImage *lazy);
+int lazy_record_operation(LazyImage *lazy, const Operation *operation);
+Pixel lazy_sample_pixel(const LazyImage *lazy, int x, int y);
+void lazy_request_tiles(LazyImage *lazy, Rect area);
+Pixel lazy_get_pixel(LazyImage *lazy, int x, int y);
+Pixel **lazy_export_region(LazyImage *lazy, int x, int y, int *region_width, int *region_height);
+int lazy_save_image(const char *file_name, LazyImage *lazy);
+void record_lazy_operation(HWND hwnd, int operation);
+int run_image_service(const char *socket_path);
 
 
 // Global variables
@@ -60,9 +491,19 @@ char file_name[MAX_PATH];
 int width, height;
 Pixel **image = NULL;
 Pixel **original_image = NULL;
+OutputFormat output_format = FORMAT_PPM; // Format used for files written from the GUI
+int lazy_mode = 0;                        // When set, GUI operations are recorded instead of executed
+int low_memory_mode = 0;                  // When set, rotations reorder the pixels in place instead of copying them
+int operation_files_allowed = 1;          // Cleared by the image service: its clients may not make it open files
+LazyImage *lazy_image = NULL;             // Recorded chain shown by the comparison window in lazy mode
 
 // Main function
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
+    // Command-line modes (service, tiled conversion, ...) run without the GUI
+    if (__argc > 1) {
+        return run_command_line(__argc, __argv);
+    }
+
     const char CLASS_NAME[] = "ImageProcessingWindow";
     WNDCLASS wc = {0};
 
@@ -131,6 +572,18 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             CreateWindow("BUTTON", "Aged Effect", WS_TABSTOP | WS_VISIBLE | WS_CHILD | BS_DEFPUSHBUTTON,
                          startX, startY, BUTTON_WIDTH, BUTTON_HEIGHT, hwnd, (HMENU) 6, GetModuleHandle(NULL), NULL);
 
+            startY += BUTTON_HEIGHT + BUTTON_MARGIN;
+            CreateWindow("BUTTON", "Output: PPM", WS_TABSTOP | WS_VISIBLE | WS_CHILD | BS_DEFPUSHBUTTON,
+                         startX, startY, BUTTON_WIDTH, BUTTON_HEIGHT, hwnd, (HMENU) 9, GetModuleHandle(NULL), NULL);
+
+            startY += BUTTON_HEIGHT + BUTTON_MARGIN;
+            CreateWindow("BUTTON", "Mode: Eager", WS_TABSTOP | WS_VISIBLE | WS_CHILD | BS_DEFPUSHBUTTON,
+                         startX, startY, BUTTON_WIDTH, BUTTON_HEIGHT, hwnd, (HMENU) 10, GetModuleHandle(NULL), NULL);
+
+            startY += BUTTON_HEIGHT + BUTTON_MARGIN;
+            CreateWindow("BUTTON", "Save Result", WS_TABSTOP | WS_VISIBLE | WS_CHILD | BS_DEFPUSHBUTTON,
+                         startX, startY, BUTTON_WIDTH, BUTTON_HEIGHT, hwnd, (HMENU) 11, GetModuleHandle(NULL), NULL);
+
             startY += BUTTON_HEIGHT + BUTTON_MARGIN;
             CreateWindow("BUTTON", "Exit", WS_TABSTOP | WS_VISIBLE | WS_CHILD | BS_DEFPUSHBUTTON,
                          startX, startY, BUTTON_WIDTH, BUTTON_HEIGHT, hwnd, (HMENU) 8, GetModuleHandle(NULL), NULL);
@@ -149,7 +602,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                     ofn.lpstrFile = file_name;
                     ofn.lpstrFile[0] = '\0';
                     ofn.nMaxFile = sizeof(file_name);
-                    ofn.lpstrFilter = "PPM Files\0*.ppm\0All Files\0*.*\0";
+                    ofn.lpstrFilter = "Image Files\0*.ppm;*.qoi\0PPM Files\0*.ppm\0QOI Files\0*.qoi\0All Files\0*.*\0";
                     ofn.nFilterIndex = 1;
                     ofn.lpstrFileTitle = NULL;
                     ofn.nMaxFileTitle = 0;
@@ -165,6 +618,9 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                             // Save a copy of the original image
                             original_image = allocate_image(width, height);
                             memcpy(original_image[0], image[0], width * height * sizeof(Pixel));
+                            // A recorded chain belongs to the previous image
+                            free_lazy_image(lazy_image);
+                            lazy_image = NULL;
                         }
                     }
                     break;
@@ -175,7 +631,10 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                 case 4: // X-ray
                 case 5: // Rotate
                 case 6: // Aged Effect
-                    if (image) {
+                    if (image && lazy_mode) {
+                        record_lazy_operation(hwnd, wmId);
+                        show_comparison_window(original_image, image, width, height);
+                    } else if (image) {
                         process_image(hwnd, wmId);
                         show_comparison_window(original_image, image, width, height);
                     } else {
@@ -187,6 +646,37 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                     PostQuitMessage(0);
                     break;
 
+                case 9: // Cycle the output format through PPM, QOI and ASCII PPM
+                    output_format = output_format == FORMAT_PPM ? FORMAT_QOI : output_format == FORMAT_QOI ? FORMAT_P3 : FORMAT_PPM;
+                    SetWindowText((HWND)lParam, output_format == FORMAT_QOI ? "Output: QOI" :
+                                                output_format == FORMAT_P3 ? "Output: P3 (ASCII)" : "Output: PPM");
+                    break;
+
+                case 10: // Toggle between eager execution and lazy (recorded, on-demand) evaluation
+                    lazy_mode = !lazy_mode;
+                    SetWindowText((HWND)lParam, lazy_mode ? "Mode: Lazy" : "Mode: Eager");
+                    break;
+
+                case 11: { // Save the current result; in lazy mode this is what computes the tiles
+                    char output_name[64];
+                    create_directory("outputs");
+                    if (lazy_mode && lazy_image) {
+                        build_output_name(output_name, sizeof(output_name), "lazy_result", 0);
+                        if (lazy_save_image(output_name, lazy_image) != 0) {
+                            MessageBox(hwnd, "Failed to save the lazy result.", "Error", MB_OK | MB_ICONERROR);
+                            break;
+                        }
+                    } else if (image) {
+                        build_output_name(output_name, sizeof(output_name), "result_image", 0);
+                        save_image(output_name, image, width, height);
+                    } else {
+                        MessageBox(hwnd, "No image loaded. Please load an image first.", "Error", MB_OK | MB_ICONERROR);
+                        break;
+                    }
+                    MessageBox(hwnd, "Result saved.", "Success", MB_OK | MB_ICONINFORMATION);
+                    break;
+                }
+
                 default:
                     break;
             }
@@ -208,30 +698,47 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 void process_image(HWND hwnd, int operation) {
     // Ensure the "outputs" directory exists
     create_directory("outputs");
+    char output_name[64];
 
     switch (operation) {
         case 2: {
-            convert_to_grayscale(image, width, height);
-            save_image("grayscale_image.ppm", image, width, height);
+            // Grayscale results are kept single-channel for saving and expanded only for the comparison view
+            Gray8 **gray_image = convert_to_gray8(image, width, height);
+            if (!gray_image) {
+                break;
+            }
+            build_output_name(output_name, sizeof(output_name), "grayscale_image", 1);
+            save_gray_image(output_name, gray_image, width, height);
+            expand_gray_image(gray_image, image, width, height);
+            free_gray_image(gray_image);
             MessageBox(hwnd, "Grayscale transformation completed.", "Success", MB_OK | MB_ICONINFORMATION);
             break;
         }
         case 3: {
             generate_negative_image(image, width, height);
-            save_image("negative_image.ppm", image, width, height);
+            build_output_name(output_name, sizeof(output_name), "negative_image", 0);
+            save_image(output_name, image, width, height);
             MessageBox(hwnd, "Negative transformation completed.", "Success", MB_OK | MB_ICONINFORMATION);
             break;
         }
         case 4: {
-            generate_xray_image(image, width, height);
-            save_image("xray_image.ppm", image, width, height);
+            Gray8 **gray_image = convert_to_gray8(image, width, height);
+            if (!gray_image) {
+                break;
+            }
+            generate_xray_gray(gray_image, width, height);
+            build_output_name(output_name, sizeof(output_name), "xray_image", 1);
+            save_gray_image(output_name, gray_image, width, height);
+            expand_gray_image(gray_image, image, width, height);
+            free_gray_image(gray_image);
             MessageBox(hwnd, "X-ray transformation completed.", "Success", MB_OK | MB_ICONINFORMATION);
             break;
         }
         case 5: {
             Pixel **rotated_image = rotate_image(image, width, height);
             if (rotated_image) {
-                save_image("rotated_image.ppm", rotated_image, height, width);
+                build_output_name(output_name, sizeof(output_name), "rotated_image", 0);
+                save_image(output_name, rotated_image, height, width);
                 free_image(rotated_image);
                 MessageBox(hwnd, "Rotation transformation completed.", "Success", MB_OK | MB_ICONINFORMATION);
             }
@@ -239,7 +746,8 @@ void process_image(HWND hwnd, int operation) {
         }
         case 6: {
             generate_aged_image(image, width, height);
-            save_image("aged_image.ppm", image, width, height);
+            build_output_name(output_name, sizeof(output_name), "aged_image", 0);
+            save_image(output_name, image, width, height);
             MessageBox(hwnd, "Aged effect applied successfully.", "Success", MB_OK | MB_ICONINFORMATION);
             break;
         }
@@ -260,37 +768,108 @@ void create_directory(const char *directory_name) {
     }
 }
 
-// Function to allocate memory for an image
+// Function to allocate memory for an image.
+// The row pointers and the pixels share one allocation, so row arrays made by image_from_view free the same way.
+// There is room for max(width, height) row pointers, so orient_image_in_place can transpose without moving the pixels.
 Pixel **allocate_image(int width, int height) {
-    Pixel **image = malloc(height * sizeof(Pixel *));
+    size_t rows_size = (size_t)max(width, height) * sizeof(Pixel *);
+    Pixel **image = malloc(rows_size + (size_t)width * height * sizeof(Pixel));
     if (!image) {
-        printf("Memory allocation failed for image rows.\n");
-        return NULL;
-    }
-
-    image[0] = (Pixel *)malloc(width * height * sizeof(Pixel));
-    if (!image[0]) {
         printf("Memory allocation failed for image data.\n");
-        free(image);
         return NULL;
     }
 
+    image[0] = (Pixel *)((unsigned char *)image + rows_size);
     for (int i = 1; i < height; i++) {
-        image[i] = image[0] + i * width;
+        image[i] = image[0] + (size_t)i * width;
     }
 
     return image;
 }
 
-// Function to free allocated memory for an image
+// Function to free allocated memory for an image (or the row array of a view)
 void free_image(Pixel **image) {
+    free(image);
+}
+
+// Function to allocate memory for a single-channel gray image, rows and pixels in one allocation
+// (with room for max(width, height) row pointers, as in allocate_image)
+Gray8 **allocate_gray_image(int width, int height) {
+    size_t rows_size = (size_t)max(width, height) * sizeof(Gray8 *);
+    Gray8 **image = malloc(rows_size + (size_t)width * height * sizeof(Gray8));
     if (!image) {
-        return;
+        printf("Memory allocation failed for gray image data.\n");
+        return NULL;
+    }
+
+    image[0] = (Gray8 *)((unsigned char *)image + rows_size);
+    for (int i = 1; i < height; i++) {
+        image[i] = image[0] + (size_t)i * width;
     }
-    free(image[0]);
+
+    return image;
+}
+
+// Function to free allocated memory for a gray image (or the row array of a view)
+void free_gray_image(Gray8 **image) {
     free(image);
 }
 
+// Function to describe an image as a view. Rows are evenly spaced (packed images and crops alike),
+// so the stride is the distance between the first two rows.
+ImageView view_of_image(Pixel **image, int width, int height) {
+    ImageView view = {(unsigned char *)image[0], width, height, 3, (size_t)width * sizeof(Pixel)};
+    if (height > 1) {
+        view.stride = (size_t)((unsigned char *)image[1] - (unsigned char *)image[0]);
+    }
+    return view;
+}
+
+// Function to describe a gray image as a view
+ImageView view_of_gray_image(Gray8 **image, int width, int height) {
+    ImageView view = {image[0], width, height, 1, (size_t)width};
+    if (height > 1) {
+        view.stride = (size_t)(image[1] - image[0]);
+    }
+    return view;
+}
+
+// Function to narrow a view to a rectangle, clipped to the view; no pixels are touched
+ImageView crop_view(ImageView view, Rect rect) {
+    Region region = {rect, NULL, 0, 0};
+    Rect area = clip_region(&region, view.width, view.height);
+    view.base += (size_t)area.y * view.stride + (size_t)area.x * view.channels;
+    view.width = area.width;
+    view.height = area.height;
+    return view;
+}
+
+// Function to build row pointers into a view so the Pixel ** kernels can work on it in place
+Pixel **image_from_view(const ImageView *view) {
+    Pixel **rows = malloc(max(view->height, 1) * sizeof(Pixel *));
+    if (!rows) {
+        printf("Memory allocation failed for image rows.\n");
+        return NULL;
+    }
+    for (int i = 0; i < view->height; i++) {
+        rows[i] = (Pixel *)(view->base + (size_t)i * view->stride);
+    }
+    return rows;
+}
+
+// Function to build row pointers into a gray view
+Gray8 **gray_image_from_view(const ImageView *view) {
+    Gray8 **rows = malloc(max(view->height, 1) * sizeof(Gray8 *));
+    if (!rows) {
+        printf("Memory allocation failed for gray image rows.\n");
+        return NULL;
+    }
+    for (int i = 0; i < view->height; i++) {
+        rows[i] = view->base + (size_t)i * view->stride;
+    }
+    return rows;
+}
+
 // Function to load a PPM image from file
 Pixel **load_image(const char *file_name, int *width, int *height) {
     char full_path[200];
@@ -305,39 +884,59 @@ Pixel **load_image(const char *file_name, int *width, int *height) {
 
     printf("File %s opened successfully.\n", full_path);
 
-    char format[3];
-    fscanf(file, "%2s", format);
-    if (strcmp(format, "P3") != 0 && strcmp(format, "P6") != 0) {
-        printf("Invalid format. Only PPM images (P3 and P6) are supported.\n");
-        fclose(file);
-        return NULL;
-    }
+    // QOI files are recognized by their magic bytes and decoded from memory
+    char magic[4];
+    size_t magic_length = fread(magic, 1, sizeof(magic), file);
+    if (magic_length == sizeof(magic) && memcmp(magic, QOI_MAGIC, sizeof(magic)) == 0) {
+        _fseeki64(file, 0, SEEK_END);
+        size_t size = (size_t)_ftelli64(file);
+        _fseeki64(file, 0, SEEK_SET);
 
-    printf("PPM format (%s) confirmed.\n", format);
+        unsigned char *data = malloc(size);
+        if (!data || fread(data, 1, size, file) != size) {
+            printf("Error reading QOI data.\n");
+            free(data);
+            fclose(file);
+            return NULL;
+        }
+        fclose(file);
 
-    int c;
-    while ((c = fgetc(file)) != EOF) {
-        if (c == '#') {
-            while (fgetc(file) != '\n' && !feof(file));
-        } else if (!isspace(c)) {
-            ungetc(c, file);
-            break;
+        Pixel **image = decode_qoi_buffer(data, size, width, height);
+        free(data);
+        if (image) {
+            printf("QOI image with dimensions: %d x %d\n", *width, *height);
+        }
+        if (image && (*width < MIN_IMAGE_SIZE || *height < MIN_IMAGE_SIZE)) {
+            printf("The image must be at least 400x400 pixels.\n");
+            free_image(image);
+            return NULL;
+        }
+        if (image) {
+            printf("Image %s loaded successfully.\n", full_path);
         }
+        return image;
     }
 
-    if (fscanf(file, "%d %d", width, height) != 2) {
-        printf("Error reading image dimensions.\n");
+    // Tiled containers are loaded as one region covering the whole image
+    if (magic_length == sizeof(magic) && memcmp(magic, TILED_MAGIC, sizeof(magic)) == 0) {
         fclose(file);
-        return NULL;
+        *width = *height = INT_MAX;
+        Pixel **image = load_tiled_region(full_path, 0, 0, width, height);
+        if (image && (*width < MIN_IMAGE_SIZE || *height < MIN_IMAGE_SIZE)) {
+            printf("The image must be at least 400x400 pixels.\n");
+            free_image(image);
+            return NULL;
+        }
+        return image;
     }
+    rewind(file);
 
+    char format[3];
     int max_color;
-    if (fscanf(file, "%d", &max_color) != 1) {
-        printf("Error reading max color value.\n");
+    if (read_pnm_header(file, format, width, height, &max_color) != 0) {
         fclose(file);
         return NULL;
     }
-    fgetc(file);
 
     printf("Image loaded with dimensions: %d x %d and max color: %d\n", *width, *height, max_color);
 
@@ -369,8 +968,22 @@ Pixel **load_image(const char *file_name, int *width, int *height) {
             }
         }
     } else if (strcmp(format, "P6") == 0) {
+        // The pixels follow the header as one block, so large files are read by all threads at their offsets
+        uint64_t pixels_size = (uint64_t)*width * *height * sizeof(Pixel);
+        if (pixels_size < PARALLEL_IO_MIN_BYTES ||
+            read_file_parallel(full_path, (uint64_t)_ftelli64(file), image[0], pixels_size) != 0) {
+            for (int i = 0; i < *height; i++) {
+                fread(image[i], sizeof(Pixel), *width, file);
+            }
+        }
+    } else if (strcmp(format, "P5") == 0) {
+        // Gray rows are read into the start of each RGB row and expanded from the end backwards
         for (int i = 0; i < *height; i++) {
-            fread(image[i], sizeof(Pixel), *width, file);
+            unsigned char *row = (unsigned char *)image[i];
+            fread(row, 1, *width, file);
+            for (int j = *width - 1; j >= 0; j--) {
+                image[i][j].r = image[i][j].g = image[i][j].b = row[j];
+            }
         }
     }
 
@@ -379,157 +992,5955 @@ Pixel **load_image(const char *file_name, int *width, int *height) {
     return image;
 }
 
-// Function to save a PPM image to file
-void save_image(const char *file_name, Pixel **image, int width, int height) {
-    char full_path[200];
-    snprintf(full_path, sizeof(full_path), "outputs/%s", file_name);
+// Function to read a PNM header (format, dimensions and max color) leaving the file at the pixel data
+int read_pnm_header(FILE *file, char format[3], int *width, int *height, int *max_color) {
+    if (fscanf(file, "%2s", format) != 1 ||
+        (strcmp(format, "P3") != 0 && strcmp(format, "P5") != 0 && strcmp(format, "P6") != 0)) {
+        printf("Invalid format. Only PPM (P3 and P6) and PGM (P5) images are supported.\n");
+        return -1;
+    }
 
-    printf("Trying to save the image to: %s\n", full_path);
+    printf("PPM format (%s) confirmed.\n", format);
 
-    // Check if the directory exists
-    if (access("outputs", 0) != 0) {
-        printf("Directory 'outputs' does not exist or cannot be accessed.\n");
-        create_directory("outputs");  // Ensure the "outputs" directory exists
-        return;
-    } else {
-        printf("Directory 'outputs' exists and is accessible.\n");
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        if (c == '#') {
+            while (fgetc(file) != '\n' && !feof(file));
+        } else if (!isspace(c)) {
+            ungetc(c, file);
+            break;
+        }
     }
 
-    FILE *file = fopen(full_path, "wb");
-    if (!file) {
-        printf("Error opening file %s for writing.\n", full_path);
-        perror("fopen error"); // Print the specific error message
-        return;
+    if (fscanf(file, "%d %d", width, height) != 2) {
+        printf("Error reading image dimensions.\n");
+        return -1;
     }
 
-    fprintf(file, "P6\n%d %d\n%d\n", width, height, MAX_COLOR_VALUE);
-    for (int i = 0; i < height; i++) {
-        fwrite(image[i], sizeof(Pixel), width, file);
+    if (fscanf(file, "%d", max_color) != 1) {
+        printf("Error reading max color value.\n");
+        return -1;
     }
-
-    fclose(file);
-    printf("Image saved as %s\n", full_path);
+    fgetc(file);
+    return 0;
 }
 
-// Function to convert the image to grayscale
- // Function to convert the image to grayscale
-void convert_to_grayscale(Pixel **image, int width, int height) {
-    printf("Converting image to grayscale...\n");
-
-    // Apply parallel processing for the grayscale transformation
-    #pragma omp parallel for collapse(2)
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            // Calculate the grayscale value using the weighted sum method
-            unsigned char gray = (unsigned char)(image[i][j].r * GRAYSCALE_RED_WEIGHT +
-                                                image[i][j].g * GRAYSCALE_GREEN_WEIGHT +
-                                                image[i][j].b * GRAYSCALE_BLUE_WEIGHT);
-            // Set each color channel to the grayscale value
-            image[i][j].r = image[i][j].g = image[i][j].b = gray;
+// Function to take the next byte from the read buffer of a row reader, refilling it from the file
+static inline int row_reader_byte(RowReader *reader) {
+    if (reader->position == reader->length) {
+        reader->length = fread(reader->buffer, 1, sizeof(reader->buffer), reader->file);
+        reader->position = 0;
+        if (reader->length == 0) {
+            return EOF;
         }
     }
-    printf("Grayscale conversion completed.\n");
+    return reader->buffer[reader->position++];
 }
 
-// Function to generate a negative of the image
-void generate_negative_image(Pixel **image, int width, int height) {
-    printf("Generating negative image...\n");
-
-    // Use parallel processing to invert each pixel's color channels
-    #pragma omp parallel for collapse(2)
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            // Invert each color channel to achieve the negative effect
-            image[i][j].r = MAX_COLOR_VALUE - image[i][j].r;
-            image[i][j].g = MAX_COLOR_VALUE - image[i][j].g;
-            image[i][j].b = MAX_COLOR_VALUE - image[i][j].b;
+// Function to parse the next decimal value of a P3 file; returns -1 at the end of the data
+static int row_reader_text_value(RowReader *reader) {
+    int c = row_reader_byte(reader);
+    while (c != EOF && !isdigit(c)) {
+        if (c == '#') {
+            while (c != EOF && c != '\n') {
+                c = row_reader_byte(reader);
+            }
         }
+        c = row_reader_byte(reader);
     }
-    printf("Negative image generated successfully.\n");
-}
-
-// Function to generate an X-ray effect on the image
-void generate_xray_image(Pixel **image, int width, int height) {
-    printf("Generating X-ray image...\n");
-
-    // Convert to grayscale
-    convert_to_grayscale(image, width, height);
-    float factor = 1.5;
-
-    // Apply transformation with inversion and enhanced contrast
-#pragma omp parallel for collapse(2)
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            unsigned char gray = image[i][j].r;  // Grayscale value (already converted)
-
-            // Enhance contrast using a power transformation
-            float enhanced_gray = pow(gray / (float)MAX_COLOR_VALUE, factor) * MAX_COLOR_VALUE;
-
-            // Optionally invert the image to simulate X-ray appearance
-            unsigned char xray_intensity = MAX_COLOR_VALUE - (unsigned char)fmin(fmax(enhanced_gray, 0), MAX_COLOR_VALUE);
-
-            // Set each color channel to the calculated X-ray intensity
-            image[i][j].r = image[i][j].g = image[i][j].b = xray_intensity;
+    if (c == EOF) {
+        return -1;
+    }
+    int value = 0;
+    while (c != EOF && isdigit(c)) {
+        if (value > (INT_MAX - 9) / 10) {
+            return -1; // No sample value is this long; the file is malformed
         }
+        value = value * 10 + (c - '0');
+        c = row_reader_byte(reader);
     }
-    printf("X-ray image generated successfully.\n");
+    return value;
 }
 
-// Function to rotate the image by 90 degrees
-Pixel **rotate_image(Pixel **image, int width, int height) {
-    printf("Rotating the image by 90 degrees...\n");
+// Function to open an image file for row-by-row reading
+static int open_row_reader(RowReader *reader, const char *file_name) {
+    reader->file = fopen(file_name, "rb");
+    if (!reader->file) {
+        printf("Error opening the file %s\n", file_name);
+        return -1;
+    }
+    reader->file_name = file_name;
+    reader->length = reader->position = 0;
+    reader->band = NULL;
 
-    // Allocate memory for the rotated image with swapped dimensions
-    Pixel **rotated_image = allocate_image(height, width); // Swap width and height for 90-degree rotation
-    if (!rotated_image) {
-        return NULL; // Return NULL if memory allocation fails
+    unsigned char header[QOI_HEADER_SIZE];
+    size_t header_length = fread(header, 1, sizeof(header), reader->file);
+    if (header_length == sizeof(header) && memcmp(header, QOI_MAGIC, 4) == 0) {
+        uint32_t qoi_width = read_u32_be(header + 4);
+        uint32_t qoi_height = read_u32_be(header + 8);
+        if (qoi_width == 0 || qoi_height == 0 || qoi_width > INT_MAX || qoi_height > INT_MAX ||
+            (header[12] != 3 && header[12] != 4)) {
+            printf("Invalid QOI dimensions or channel count.\n");
+            fclose(reader->file);
+            return -1;
+        }
+        strcpy(reader->format, "QO");
+        reader->width = (int)qoi_width;
+        reader->height = (int)qoi_height;
+        reader->channels = 3;
+        reader->max_color = MAX_COLOR_VALUE;
+        memset(reader->index, 0, sizeof(reader->index));
+        reader->pixel = (QoiColor){0, 0, 0, 255};
+        reader->run = 0;
+        return 0;
     }
 
-    // Rotate the image by copying pixels to new positions
-    #pragma omp parallel for collapse(2)
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            // Rotate each pixel by 90 degrees counterclockwise
-            rotated_image[j][height - i - 1] = image[i][j];
+    // Tiled containers are decoded band by band through load_tiled_region
+    if (header_length >= 4 && memcmp(header, TILED_MAGIC, 4) == 0) {
+        rewind(reader->file);
+        TiledHeader tiled;
+        if (read_tiled_header(reader->file, &tiled) != 0) {
+            fclose(reader->file);
+            return -1;
         }
+        free(tiled.tile_offsets);
+        free(tiled.tile_lengths);
+        strcpy(reader->format, "IT");
+        reader->width = tiled.width;
+        reader->height = tiled.height;
+        reader->channels = 3;
+        reader->max_color = MAX_COLOR_VALUE;
+        reader->tile_size = tiled.tile_size;
+        reader->next_row = 0;
+        return 0;
     }
 
-    printf("Rotation completed.\n");
+    rewind(reader->file);
+    if (read_pnm_header(reader->file, reader->format, &reader->width, &reader->height, &reader->max_color) != 0 ||
+        reader->width <= 0 || reader->height <= 0 || reader->max_color <= 0) {
+        fclose(reader->file);
+        return -1;
+    }
+    reader->channels = strcmp(reader->format, "P5") == 0 ? 1 : 3;
+    return 0;
+}
 
-    // Free original image memory if it won't be reused
-    free_image(image);
-    return rotated_image;
+// Function to close a row reader and release it
+static void close_row_reader(RowReader *reader) {
+    fclose(reader->file);
+    free_image(reader->band);
+    free(reader);
 }
 
-// Function to generate an aged effect on the image
-void generate_aged_image(Pixel **image, int width, int height) {
+// Function to decode the next row of an image into width * channels bytes
+static int read_image_row(RowReader *reader, unsigned char *row) {
+    size_t count = (size_t)reader->width * reader->channels;
+    if (strcmp(reader->format, "IT") == 0) {
+        int band_row = reader->next_row % reader->tile_size;
+        if (band_row == 0) {
+            // The tiles of a band are read and decoded in parallel; only one band is held at a time
+            free_image(reader->band);
+            int band_width = reader->width, band_height = reader->tile_size;
+            reader->band = load_tiled_region(reader->file_name, 0, reader->next_row, &band_width, &band_height);
+            if (!reader->band) {
+                return -1;
+            }
+        }
+        memcpy(row, reader->band[band_row], count);
+        reader->next_row++;
+        return 0;
+    }
+    if (strcmp(reader->format, "P3") == 0) {
+        for (size_t k = 0; k < count; k++) {
+            int value = row_reader_text_value(reader);
+            if (value < 0) {
+                printf("Error reading pixel data.\n");
+                return -1;
+            }
+            row[k] = (unsigned char)(MAX_COLOR_VALUE * min(value, reader->max_color) / reader->max_color);
+        }
+        return 0;
+    }
+
+    if (strcmp(reader->format, "QO") == 0) {
+        QoiColor pixel = reader->pixel;
+        for (int j = 0; j < reader->width; j++) {
+            if (reader->run > 0) {
+                reader->run--;
+            } else {
+                // Every byte of a chunk is checked, since the data can end inside a chunk as well as before one
+                int b1 = row_reader_byte(reader);
+                int truncated = b1 == EOF;
+                if (b1 == QOI_OP_RGB || b1 == QOI_OP_RGBA) {
+                    int r = row_reader_byte(reader), g = row_reader_byte(reader), b = row_reader_byte(reader);
+                    int a = b1 == QOI_OP_RGBA ? row_reader_byte(reader) : pixel.a;
+                    truncated = r == EOF || g == EOF || b == EOF || a == EOF;
+                    pixel = (QoiColor){(unsigned char)r, (unsigned char)g, (unsigned char)b, (unsigned char)a};
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                    pixel = reader->index[b1];
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                    pixel.r += ((b1 >> 4) & 0x03) - 2;
+                    pixel.g += ((b1 >> 2) & 0x03) - 2;
+                    pixel.b += (b1 & 0x03) - 2;
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                    int b2 = row_reader_byte(reader);
+                    truncated = b2 == EOF;
+                    int vg = (b1 & 0x3f) - 32;
+                    pixel.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                    pixel.g += vg;
+                    pixel.b += vg - 8 + (b2 & 0x0f);
+                } else if (!truncated) { // QOI_OP_RUN
+                    reader->run = b1 & 0x3f;
+                }
+                if (truncated) {
+                    printf("QOI data is truncated.\n");
+                    return -1;
+                }
+                reader->index[QOI_HASH(pixel)] = pixel;
+            }
+            row[j * 3] = pixel.r;
+            row[j * 3 + 1] = pixel.g;
+            row[j * 3 + 2] = pixel.b;
+        }
+        reader->pixel = pixel;
+        return 0;
+    }
+
+    // P6 and P5 rows are read straight from the file
+    if (fread(row, 1, count, reader->file) != count) {
+        printf("Error reading pixel data.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to load an image scaled down by 1/2, 1/4 or 1/8 (scale 2, 4 or 8) for thumbnails and previews.
+// Rows are decoded one at a time and added into per-box sums, so only one source row and one row of sums
+// are ever held (plus one band of tiles for a tiled container); boxes at the right and bottom edges average
+// the pixels they have. P5 images come back as RGB.
+Pixel **load_image_scaled(const char *file_name, int scale, int *width, int *height) {
+    if (scale == 1) {
+        return load_image(file_name, width, height);
+    }
+    if (scale != 2 && scale != 4 && scale != SCALED_MAX_FACTOR) {
+        printf("The scale must be 1, 2, 4 or %d.\n", SCALED_MAX_FACTOR);
+        return NULL;
+    }
+
+    RowReader *reader = malloc(sizeof(RowReader));
+    if (!reader || open_row_reader(reader, file_name) != 0) {
+        free(reader);
+        return NULL;
+    }
+    int channels = reader->channels;
+    int scaled_width = (reader->width + scale - 1) / scale;
+    int scaled_height = (reader->height + scale - 1) / scale;
+    printf("Loading %s at 1/%d: %d x %d -> %d x %d\n", file_name, scale, reader->width, reader->height,
+           scaled_width, scaled_height);
+
+    unsigned char *row = malloc((size_t)reader->width * channels);
+    uint32_t *sums = malloc((size_t)scaled_width * channels * sizeof(uint32_t));
+    Pixel **image = row && sums ? allocate_image(scaled_width, scaled_height) : NULL;
+    if (!image) {
+        free(row);
+        free(sums);
+        close_row_reader(reader);
+        return NULL;
+    }
+
+    int shift = scale == 2 ? 1 : scale == 4 ? 2 : 3;
+    for (int i = 0; i < scaled_height; i++) {
+        memset(sums, 0, (size_t)scaled_width * channels * sizeof(uint32_t));
+        int band = min(scale, reader->height - i * scale);
+        for (int r = 0; r < band; r++) {
+            if (read_image_row(reader, row) != 0) {
+                free(row);
+                free(sums);
+                free_image(image);
+                close_row_reader(reader);
+                return NULL;
+            }
+            if (channels == 3) {
+                for (int j = 0; j < reader->width; j++) {
+                    uint32_t *sum = sums + (size_t)(j >> shift) * 3;
+                    sum[0] += row[j * 3];
+                    sum[1] += row[j * 3 + 1];
+                    sum[2] += row[j * 3 + 2];
+                }
+            } else {
+                for (int j = 0; j < reader->width; j++) {
+                    sums[j >> shift] += row[j];
+                }
+            }
+        }
+
+        for (int j = 0; j < scaled_width; j++) {
+            uint32_t count = (uint32_t)band * min(scale, reader->width - j * scale);
+            const uint32_t *sum = sums + (size_t)j * channels;
+            image[i][j].r = (unsigned char)((sum[0] + count / 2) / count);
+            image[i][j].g = (unsigned char)((sum[channels == 3 ? 1 : 0] + count / 2) / count);
+            image[i][j].b = (unsigned char)((sum[channels == 3 ? 2 : 0] + count / 2) / count);
+        }
+    }
+
+    free(row);
+    free(sums);
+    close_row_reader(reader);
+    *width = scaled_width;
+    *height = scaled_height;
+    return image;
+}
+
+// Function to load a binary PGM (P5) file as a single-channel gray image
+Gray8 **load_gray_image(const char *file_name, int *width, int *height) {
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        printf("Error opening the file %s\n", file_name);
+        return NULL;
+    }
+
+    _fseeki64(file, 0, SEEK_END);
+    size_t size = (size_t)_ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+
+    unsigned char *data = malloc(size);
+    Gray8 **image = NULL;
+    if (data && fread(data, 1, size, file) == size) {
+        image = decode_pgm_buffer(data, size, width, height);
+    } else {
+        printf("Error reading the file %s\n", file_name);
+    }
+
+    free(data);
+    fclose(file);
+    return image;
+}
+
+// Function to load an overlay of any size: a QOI file keeps its alpha channel, a P6 file is fully opaque
+Pixel **load_overlay_image(const char *file_name, int *width, int *height, Gray8 ***alpha) {
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        printf("Error opening the file %s\n", file_name);
+        return NULL;
+    }
+
+    _fseeki64(file, 0, SEEK_END);
+    size_t size = (size_t)_ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+
+    unsigned char *data = malloc(size);
+    Pixel **image = NULL;
+    *alpha = NULL;
+    if (data && fread(data, 1, size, file) == size) {
+        if (size >= 4 && memcmp(data, QOI_MAGIC, 4) == 0) {
+            image = decode_qoi_with_alpha(data, size, width, height, alpha);
+        } else {
+            image = decode_ppm_buffer(data, size, width, height);
+            *alpha = image ? allocate_gray_image(*width, *height) : NULL;
+            if (*alpha) {
+                memset((*alpha)[0], MAX_COLOR_VALUE, (size_t)*width * *height);
+            } else {
+                free_image(image);
+                image = NULL;
+            }
+        }
+    } else {
+        printf("Error reading the file %s\n", file_name);
+    }
+
+    free(data);
+    fclose(file);
+    return image;
+}
+
+// Function to open a file under outputs/ for writing. A batch output may be a hard link to a result cache entry,
+// so an existing file is replaced rather than truncated, which would change the cached result through the link.
+static FILE *create_output_file(const char *full_path) {
+    DeleteFileA(full_path);
+    return fopen(full_path, "wb");
+}
+
+// Function to save a PPM image to file
+void save_image(const char *file_name, Pixel **image, int width, int height) {
+    char full_path[200];
+    snprintf(full_path, sizeof(full_path), "outputs/%s", file_name);
+
+    printf("Trying to save the image to: %s\n", full_path);
+
+    // Check if the directory exists
+    if (access("outputs", 0) != 0) {
+        printf("Directory 'outputs' does not exist or cannot be accessed.\n");
+        create_directory("outputs");  // Ensure the "outputs" directory exists
+        return;
+    } else {
+        printf("Directory 'outputs' exists and is accessible.\n");
+    }
+
+    FILE *file = create_output_file(full_path);
+    if (!file) {
+        printf("Error opening file %s for writing.\n", full_path);
+        perror("fopen error"); // Print the specific error message
+        return;
+    }
+
+    // The output format is chosen by the file extension
+    const char *extension = strrchr(file_name, '.');
+    if (extension && strcmp(extension, ".qoi") == 0) {
+        size_t size;
+        unsigned char *data = encode_qoi_buffer(image, width, height, &size);
+        if (!data) {
+            fclose(file);
+            return;
+        }
+        fwrite(data, 1, size, file);
+        free(data);
+    } else if (output_format == FORMAT_P3) {
+        // ASCII output is formatted in memory and written at once
+        size_t size;
+        unsigned char *data = encode_p3_buffer(image, width, height, &size);
+        if (!data) {
+            fclose(file);
+            return;
+        }
+        fwrite(data, 1, size, file);
+        free(data);
+    } else {
+        char header[64];
+        int header_length = snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", width, height, MAX_COLOR_VALUE);
+        uint64_t pixels_size = (uint64_t)width * height * sizeof(Pixel);
+        // Large packed images are written by all threads at their offsets (views with a row stride are not packed)
+        if (pixels_size >= PARALLEL_IO_MIN_BYTES && image[height - 1] == image[0] + (size_t)(height - 1) * width) {
+            fclose(file);
+            if (write_file_parallel(full_path, header, header_length, image[0], pixels_size) != 0) {
+                printf("Error writing the file %s\n", full_path);
+                return;
+            }
+            printf("Image saved as %s\n", full_path);
+            return;
+        }
+        fwrite(header, 1, header_length, file);
+        for (int i = 0; i < height; i++) {
+            fwrite(image[i], sizeof(Pixel), width, file);
+        }
+    }
+
+    fclose(file);
+    printf("Image saved as %s\n", full_path);
+}
+
+// Function to read or write a byte range of a file from all threads at once. The file is opened with
+// FILE_FLAG_OVERLAPPED, since Windows serializes the calls on a synchronous handle: each chunk carries its own
+// offset in an OVERLAPPED structure, and each thread waits for its chunk on an event of its own.
+static int transfer_file_range(HANDLE file, unsigned char *data, uint64_t offset, uint64_t size, int writing) {
+    int64_t chunks = (int64_t)((size + PARALLEL_IO_CHUNK - 1) / PARALLEL_IO_CHUNK);
+    int failed = 0;
+    #pragma omp parallel reduction(| : failed)
+    {
+        HANDLE completed = CreateEvent(NULL, TRUE, FALSE, NULL);
+        failed |= !completed;
+        #pragma omp for schedule(dynamic)
+        for (int64_t c = 0; c < chunks; c++) {
+            if (!completed) {
+                continue;
+            }
+            uint64_t start = (uint64_t)c * PARALLEL_IO_CHUNK;
+            DWORD length = (DWORD)min((uint64_t)PARALLEL_IO_CHUNK, size - start);
+            OVERLAPPED position = {0};
+            position.Offset = (DWORD)(offset + start);
+            position.OffsetHigh = (DWORD)((offset + start) >> 32);
+            position.hEvent = completed;
+            DWORD done = 0;
+            BOOL ok = writing ? WriteFile(file, data + start, length, NULL, &position)
+                              : ReadFile(file, data + start, length, NULL, &position);
+            if (ok || GetLastError() == ERROR_IO_PENDING) {
+                ok = GetOverlappedResult(file, &position, &done, TRUE);
+            }
+            failed |= !ok || done != length;
+        }
+        if (completed) {
+            CloseHandle(completed);
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+// Function to read size bytes at offset of a file into data, split between the threads
+int read_file_parallel(const char *file_name, uint64_t offset, void *data, uint64_t size) {
+    HANDLE file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    printf("Reading %llu bytes with %d threads...\n", (unsigned long long)size, omp_get_max_threads());
+    int status = transfer_file_range(file, data, offset, size, 0);
+    CloseHandle(file);
+    return status;
+}
+
+// Function to write a header followed by size bytes of data, the data split between the threads.
+// The file is extended to its final size first so the threads do not each grow it.
+int write_file_parallel(const char *file_name, const void *header, size_t header_size, const void *data, uint64_t size) {
+    HANDLE file = CreateFileA(file_name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    printf("Writing %llu bytes with %d threads...\n", (unsigned long long)size, omp_get_max_threads());
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)(header_size + size);
+    int status = SetFilePointerEx(file, end, NULL, FILE_BEGIN) && SetEndOfFile(file) ? 0 : -1;
+    if (status == 0) {
+        status = transfer_file_range(file, (unsigned char *)header, 0, header_size, 1) == 0 &&
+                 transfer_file_range(file, (unsigned char *)data, header_size, size, 1) == 0 ? 0 : -1;
+    }
+    CloseHandle(file);
+    return status;
+}
+
+// Function to save a gray image as PGM (P5), or as QOI when the name ends in .qoi (QOI has no gray mode);
+// in ASCII output mode it is written as P3 like color images
+void save_gray_image(const char *file_name, Gray8 **image, int width, int height) {
+    const char *extension = strrchr(file_name, '.');
+    if ((extension && strcmp(extension, ".qoi") == 0) || output_format == FORMAT_P3) {
+        Pixel **expanded = allocate_image(width, height);
+        if (expanded) {
+            expand_gray_image(image, expanded, width, height);
+            save_image(file_name, expanded, width, height);
+            free_image(expanded);
+        }
+        return;
+    }
+
+    char full_path[200];
+    snprintf(full_path, sizeof(full_path), "outputs/%s", file_name);
+    printf("Trying to save the gray image to: %s\n", full_path);
+
+    if (access("outputs", 0) != 0) {
+        printf("Directory 'outputs' does not exist or cannot be accessed.\n");
+        create_directory("outputs");  // Ensure the "outputs" directory exists
+        return;
+    }
+
+    FILE *file = create_output_file(full_path);
+    if (!file) {
+        printf("Error opening file %s for writing.\n", full_path);
+        perror("fopen error");
+        return;
+    }
+
+    fprintf(file, "P5\n%d %d\n%d\n", width, height, MAX_COLOR_VALUE);
+    for (int i = 0; i < height; i++) {
+        fwrite(image[i], sizeof(Gray8), width, file);
+    }
+
+    fclose(file);
+    printf("Image saved as %s\n", full_path);
+}
+
+// Function to convert the image to grayscale
+void convert_to_grayscale(Pixel **image, int width, int height) {
+    convert_to_grayscale_region(image, width, height, NULL);
+}
+
+// Function to convert the pixels of a region to grayscale (a NULL region covers the whole image)
+void convert_to_grayscale_region(Pixel **image, int width, int height, const Region *region) {
+    printf("Converting image to grayscale...\n");
+    Rect area = clip_region(region, width, height);
+
+    // Apply parallel processing for the grayscale transformation, splitting only the region rows
+    #pragma omp parallel for collapse(2)
+    for (int i = area.y; i < area.y + area.height; i++) {
+        for (int j = area.x; j < area.x + area.width; j++) {
+            if (REGION_SKIPS(region, i, j)) {
+                continue;
+            }
+            // Calculate the grayscale value using the weighted sum method
+            unsigned char gray = (unsigned char)(image[i][j].r * GRAYSCALE_RED_WEIGHT +
+                                                image[i][j].g * GRAYSCALE_GREEN_WEIGHT +
+                                                image[i][j].b * GRAYSCALE_BLUE_WEIGHT);
+            // Set each color channel to the grayscale value
+            image[i][j].r = image[i][j].g = image[i][j].b = gray;
+        }
+    }
+    printf("Grayscale conversion completed.\n");
+}
+
+// Function to generate a negative of the image
+void generate_negative_image(Pixel **image, int width, int height) {
+    generate_negative_image_region(image, width, height, NULL);
+}
+
+// Function to generate a negative of the pixels of a region
+void generate_negative_image_region(Pixel **image, int width, int height, const Region *region) {
+    printf("Generating negative image...\n");
+    Rect area = clip_region(region, width, height);
+
+    // Use parallel processing to invert each pixel's color channels
+    #pragma omp parallel for collapse(2)
+    for (int i = area.y; i < area.y + area.height; i++) {
+        for (int j = area.x; j < area.x + area.width; j++) {
+            if (REGION_SKIPS(region, i, j)) {
+                continue;
+            }
+            // Invert each color channel to achieve the negative effect
+            image[i][j].r = MAX_COLOR_VALUE - image[i][j].r;
+            image[i][j].g = MAX_COLOR_VALUE - image[i][j].g;
+            image[i][j].b = MAX_COLOR_VALUE - image[i][j].b;
+        }
+    }
+    printf("Negative image generated successfully.\n");
+}
+
+// Function to generate an X-ray effect on the image
+void generate_xray_image(Pixel **image, int width, int height) {
+    generate_xray_image_region(image, width, height, NULL);
+}
+
+// Function to generate an X-ray effect on the pixels of a region
+void generate_xray_image_region(Pixel **image, int width, int height, const Region *region) {
+    printf("Generating X-ray image...\n");
+    Rect area = clip_region(region, width, height);
+
+    // Convert to grayscale
+    convert_to_grayscale_region(image, width, height, region);
+    float factor = 1.5;
+
+    // Apply transformation with inversion and enhanced contrast
+#pragma omp parallel for collapse(2)
+    for (int i = area.y; i < area.y + area.height; i++) {
+        for (int j = area.x; j < area.x + area.width; j++) {
+            if (REGION_SKIPS(region, i, j)) {
+                continue;
+            }
+            unsigned char gray = image[i][j].r;  // Grayscale value (already converted)
+
+            // Enhance contrast using a power transformation
+            float enhanced_gray = pow(gray / (float)MAX_COLOR_VALUE, factor) * MAX_COLOR_VALUE;
+
+            // Optionally invert the image to simulate X-ray appearance
+            unsigned char xray_intensity = MAX_COLOR_VALUE - (unsigned char)fmin(fmax(enhanced_gray, 0), MAX_COLOR_VALUE);
+
+            // Set each color channel to the calculated X-ray intensity
+            image[i][j].r = image[i][j].g = image[i][j].b = xray_intensity;
+        }
+    }
+    printf("X-ray image generated successfully.\n");
+}
+
+// Function to rotate the image by 90 degrees
+Pixel **rotate_image(Pixel **image, int width, int height) {
+    if (low_memory_mode) {
+        return rotate_image_in_place(image, width, height);
+    }
+    printf("Rotating the image by 90 degrees...\n");
+
+    // Allocate memory for the rotated image with swapped dimensions
+    Pixel **rotated_image = allocate_image(height, width); // Swap width and height for 90-degree rotation
+    if (!rotated_image) {
+        // Not enough memory for a second image: reorder the pixels of this one instead
+        return rotate_image_in_place(image, width, height);
+    }
+
+    // Rotate the image by copying pixels to new positions
+    #pragma omp parallel for collapse(2)
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            // Rotate each pixel by 90 degrees counterclockwise
+            rotated_image[j][height - i - 1] = image[i][j];
+        }
+    }
+
+    printf("Rotation completed.\n");
+
+    // Free original image memory if it won't be reused
+    free_image(image);
+    return rotated_image;
+}
+
+// Function to swap two runs of bytes
+static inline void swap_bytes(unsigned char *a, unsigned char *b, size_t count) {
+    for (size_t k = 0; k < count; k++) {
+        unsigned char t = a[k];
+        a[k] = b[k];
+        b[k] = t;
+    }
+}
+
+// Function to transpose a square matrix of element-byte values in place, swapping tile pairs across the diagonal
+static void transpose_square_in_place(unsigned char *data, int element, int size) {
+    int tiles = (size + ORIENT_TILE_SIZE - 1) / ORIENT_TILE_SIZE;
+    size_t row_step = (size_t)size * element;
+    #pragma omp parallel for schedule(dynamic)
+    for (int ti = 0; ti < tiles; ti++) {
+        for (int tj = ti; tj < tiles; tj++) {
+            int bottom = min(size, (ti + 1) * ORIENT_TILE_SIZE);
+            int right = min(size, (tj + 1) * ORIENT_TILE_SIZE);
+            for (int i = ti * ORIENT_TILE_SIZE; i < bottom; i++) {
+                // On a diagonal tile only the part right of the diagonal is swapped
+                for (int j = ti == tj ? i + 1 : tj * ORIENT_TILE_SIZE; j < right; j++) {
+                    swap_bytes(data + i * row_step + (size_t)j * element, data + j * row_step + (size_t)i * element, element);
+                }
+            }
+        }
+    }
+}
+
+// Function to transpose a height x width matrix of element-byte values in place by following the permutation
+// cycles: the value at i * width + j moves to j * height + i. Each cycle is moved once, from its smallest
+// index (its leader), so no bookkeeping memory is needed and threads can take different starts: a start
+// is walked around its cycle in both directions first and skipped as soon as a walk passes a smaller index.
+static void transpose_cycles_in_place(unsigned char *data, int element, int width, int height) {
+    size_t last = (size_t)width * height - 1; // The first and last values stay where they are
+    #pragma omp parallel for schedule(dynamic, 4096)
+    for (size_t start = 1; start < last; start++) {
+        size_t forward = start, backward = start;
+        int leader = 1;
+        while (leader) {
+            forward = forward * height % last;
+            if (forward == backward) {
+                break; // The walks met, so the whole cycle has been seen
+            }
+            backward = backward * width % last;
+            leader = forward > start && backward > start;
+            if (forward == backward) {
+                break;
+            }
+        }
+        if (!leader) {
+            continue; // Moved with the cycle of a smaller index
+        }
+
+        unsigned char carry[sizeof(Pixel)], next_carry[sizeof(Pixel)];
+        memcpy(carry, data + start * element, element);
+        size_t index = start;
+        do {
+            index = index * height % last;
+            memcpy(next_carry, data + index * element, element);
+            memcpy(data + index * element, carry, element);
+            memcpy(carry, next_carry, element);
+        } while (index != start);
+    }
+}
+
+// Function to reorient an image in place. The image uses the allocate_image layout (row pointers, then the packed
+// pixels) with element bytes per pixel; the pixels stay in the same block, which already has room for the row
+// pointers of either layout, so no memory is needed.
+void orient_image_in_place(void *image, int element, int *width, int *height, int orientation) {
+    int transposed = orientation & ORIENT_TRANSPOSE;
+    int new_width = transposed ? *height : *width;
+    int new_height = transposed ? *width : *height;
+    unsigned char *data = *(unsigned char **)image; // The first row starts the pixels
+
+    // The mirrors act on the stored axes, so they come before the transpose
+    int old_width = *width, old_height = *height;
+    size_t row_step = (size_t)old_width * element;
+    if (orientation & ORIENT_MIRROR_X) {
+        #pragma omp parallel for
+        for (int i = 0; i < old_height; i++) {
+            unsigned char *row = data + i * row_step;
+            for (int j = 0; j < old_width / 2; j++) {
+                swap_bytes(row + (size_t)j * element, row + (size_t)(old_width - 1 - j) * element, element);
+            }
+        }
+    }
+    if (orientation & ORIENT_MIRROR_Y) {
+        #pragma omp parallel for
+        for (int i = 0; i < old_height / 2; i++) {
+            swap_bytes(data + i * row_step, data + (old_height - 1 - i) * row_step, row_step);
+        }
+    }
+
+    if (transposed && old_width != old_height) {
+        transpose_cycles_in_place(data, element, old_width, old_height);
+    } else if (transposed) {
+        transpose_square_in_place(data, element, old_width);
+    }
+    row_step = (size_t)new_width * element;
+
+    // Rebuild the row pointers for the new dimensions
+    for (int i = 0; i < new_height; i++) {
+        if (element == sizeof(Pixel)) {
+            ((Pixel **)image)[i] = (Pixel *)(data + i * row_step);
+        } else {
+            ((Gray8 **)image)[i] = (Gray8 *)(data + i * row_step);
+        }
+    }
+    *width = new_width;
+    *height = new_height;
+}
+
+// Function to rotate the image by 90 degrees without a second image, like rotate_image (the input is consumed)
+Pixel **rotate_image_in_place(Pixel **image, int width, int height) {
+    printf("Rotating the image by 90 degrees in place...\n");
+    orient_image_in_place(image, sizeof(Pixel), &width, &height, ORIENT_ROTATE);
+    printf("Rotation completed.\n");
+    return image;
+}
+
+// Function to generate an aged effect on the image
+void generate_aged_image(Pixel **image, int width, int height) {
+    generate_aged_image_region(image, width, height, NULL);
+}
+
+// Function to generate an aged effect on the pixels of a region
+void generate_aged_image_region(Pixel **image, int width, int height, const Region *region) {
     printf("Generating aged image...\n");
     float factor = 0.1; // Factor to adjust intensities for aging effect
+    Rect area = clip_region(region, width, height);
+
+    // Apply parallel processing to adjust each pixel for aging effect
+    #pragma omp parallel for collapse(2)
+    for (int i = area.y; i < area.y + area.height; i++) {
+        for (int j = area.x; j < area.x + area.width; j++) {
+            if (REGION_SKIPS(region, i, j)) {
+                continue;
+            }
+            // Calculate new intensities with weighted adjustments to mimic aging
+            float red_intensity = image[i][j].r * (1 + factor * (MAX_COLOR_VALUE - image[i][j].r) / (float)MAX_COLOR_VALUE);
+            float green_intensity = image[i][j].g * (1 + factor * (MAX_COLOR_VALUE - image[i][j].g) / (float)MAX_COLOR_VALUE);
+            float blue_intensity = image[i][j].b * (1 - factor * image[i][j].b / (float)MAX_COLOR_VALUE);
+
+            // Further refine intensities to add an aged look
+            red_intensity += 10 * (1 - image[i][j].r / (float)MAX_COLOR_VALUE);
+            green_intensity += 10 * (1 - image[i][j].g / (float)MAX_COLOR_VALUE);
+            blue_intensity -= 10 * (image[i][j].b / (float)MAX_COLOR_VALUE);
+
+            // Clamp intensities to the allowed color range and set new values
+            image[i][j].r = (unsigned char)fmin(fmax(red_intensity, 0), MAX_COLOR_VALUE);
+            image[i][j].g = (unsigned char)fmin(fmax(green_intensity, 0), MAX_COLOR_VALUE);
+            image[i][j].b = (unsigned char)fmin(fmax(blue_intensity, 0), MAX_COLOR_VALUE);
+        }
+    }
+
+    printf("Aged image generated successfully.\n");
+}
+
+// Function to clip a region to the image bounds; a NULL region covers the whole image
+Rect clip_region(const Region *region, int width, int height) {
+    Rect area = {0, 0, width, height};
+    if (region) {
+        int left = max(0, region->rect.x);
+        int top = max(0, region->rect.y);
+        int right = (int)min((long long)width, (long long)region->rect.x + region->rect.width);
+        int bottom = (int)min((long long)height, (long long)region->rect.y + region->rect.height);
+        area.x = left;
+        area.y = top;
+        area.width = max(0, right - left);
+        area.height = max(0, bottom - top);
+    }
+    return area;
+}
+
+// Function to convert an RGB image into a new single-channel gray image
+Gray8 **convert_to_gray8(Pixel **image, int width, int height) {
+    printf("Converting image to single-channel grayscale...\n");
+
+    Gray8 **gray = allocate_gray_image(width, height);
+    if (!gray) {
+        return NULL;
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            // Same weighted sum as convert_to_grayscale
+            gray[i][j] = (Gray8)(image[i][j].r * GRAYSCALE_RED_WEIGHT +
+                                 image[i][j].g * GRAYSCALE_GREEN_WEIGHT +
+                                 image[i][j].b * GRAYSCALE_BLUE_WEIGHT);
+        }
+    }
+    return gray;
+}
+
+// Function to copy a gray image into an RGB image of the same size (r = g = b)
+void expand_gray_image(Gray8 **gray, Pixel **image, int width, int height) {
+    #pragma omp parallel for
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            image[i][j].r = image[i][j].g = image[i][j].b = gray[i][j];
+        }
+    }
+}
+
+// Function to apply a 256-entry tone curve to every pixel of a gray image
+void apply_gray_curve(Gray8 **image, int width, int height, const unsigned char curve[256]) {
+    apply_gray_curve_region(image, width, height, curve, NULL);
+}
+
+// Function to apply a 256-entry tone curve to the pixels of a region of a gray image
+void apply_gray_curve_region(Gray8 **image, int width, int height, const unsigned char curve[256], const Region *region) {
+    Rect area = clip_region(region, width, height);
+
+    #pragma omp parallel for
+    for (int i = area.y; i < area.y + area.height; i++) {
+        Gray8 *row = image[i];
+        for (int j = area.x; j < area.x + area.width; j++) {
+            if (REGION_SKIPS(region, i, j)) {
+                continue;
+            }
+            row[j] = curve[row[j]];
+        }
+    }
+}
+
+// Function to generate a negative of a gray image
+void generate_negative_gray(Gray8 **image, int width, int height) {
+    generate_negative_gray_region(image, width, height, NULL);
+}
+
+// Function to generate a negative of the pixels of a region of a gray image
+void generate_negative_gray_region(Gray8 **image, int width, int height, const Region *region) {
+    printf("Generating negative gray image...\n");
+    Rect area = clip_region(region, width, height);
+
+    #pragma omp parallel for
+    for (int i = area.y; i < area.y + area.height; i++) {
+        Gray8 *row = image[i];
+        for (int j = area.x; j < area.x + area.width; j++) {
+            if (REGION_SKIPS(region, i, j)) {
+                continue;
+            }
+            row[j] = MAX_COLOR_VALUE - row[j];
+        }
+    }
+}
+
+// Function to apply the X-ray contrast curve to a gray image
+void generate_xray_gray(Gray8 **image, int width, int height) {
+    generate_xray_gray_region(image, width, height, NULL);
+}
+
+// Function to apply the X-ray contrast curve to the pixels of a region of a gray image
+void generate_xray_gray_region(Gray8 **image, int width, int height, const Region *region) {
+    printf("Generating X-ray gray image...\n");
+
+    // The power transformation only depends on the gray level, so it is tabulated once
+    unsigned char curve[256];
+    build_xray_curve(curve);
+    apply_gray_curve_region(image, width, height, curve, region);
+}
+
+// Function to tabulate the X-ray contrast curve used by generate_xray_image
+void build_xray_curve(unsigned char curve[256]) {
+    float factor = 1.5;
+    for (int v = 0; v < 256; v++) {
+        float enhanced_gray = pow(v / (float)MAX_COLOR_VALUE, factor) * MAX_COLOR_VALUE;
+        curve[v] = MAX_COLOR_VALUE - (unsigned char)fmin(fmax(enhanced_gray, 0), MAX_COLOR_VALUE);
+    }
+}
+
+// Function to rotate a gray image by 90 degrees (frees the input like rotate_image)
+Gray8 **rotate_gray_image(Gray8 **image, int width, int height) {
+    printf("Rotating the gray image by 90 degrees...\n");
+
+    Gray8 **rotated_image = allocate_gray_image(height, width);
+    if (!rotated_image) {
+        return NULL;
+    }
+
+    #pragma omp parallel for collapse(2)
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            rotated_image[j][height - i - 1] = image[i][j];
+        }
+    }
+
+    free_gray_image(image);
+    return rotated_image;
+}
+
+// Function to tabulate the per-channel aged curves used by generate_aged_image
+void build_aged_curves(unsigned char red[256], unsigned char green[256], unsigned char blue[256]) {
+    float factor = 0.1;
+    for (int v = 0; v < 256; v++) {
+        float red_intensity = v * (1 + factor * (MAX_COLOR_VALUE - v) / (float)MAX_COLOR_VALUE);
+        float green_intensity = red_intensity;
+        float blue_intensity = v * (1 - factor * v / (float)MAX_COLOR_VALUE);
+
+        red_intensity += 10 * (1 - v / (float)MAX_COLOR_VALUE);
+        green_intensity += 10 * (1 - v / (float)MAX_COLOR_VALUE);
+        blue_intensity -= 10 * (v / (float)MAX_COLOR_VALUE);
+
+        red[v] = (unsigned char)fmin(fmax(red_intensity, 0), MAX_COLOR_VALUE);
+        green[v] = (unsigned char)fmin(fmax(green_intensity, 0), MAX_COLOR_VALUE);
+        blue[v] = (unsigned char)fmin(fmax(blue_intensity, 0), MAX_COLOR_VALUE);
+    }
+}
+
+// Function to apply the aged effect to a gray image, producing the tinted RGB result in one pass
+Pixel **generate_aged_from_gray(Gray8 **image, int width, int height) {
+    printf("Generating aged image from gray data...\n");
+
+    unsigned char red[256], green[256], blue[256];
+    build_aged_curves(red, green, blue);
+
+    Pixel **aged = allocate_image(width, height);
+    if (!aged) {
+        return NULL;
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            Gray8 v = image[i][j];
+            aged[i][j].r = red[v];
+            aged[i][j].g = green[v];
+            aged[i][j].b = blue[v];
+        }
+    }
+    return aged;
+}
+
+
+// Names accepted in operation chains, e.g. "grayscale,rotate,aged,saturation=1.4"
+static const struct {
+    const char *name;
+    OperationType type;
+} operation_names[] = {
+    {"grayscale", OP_GRAYSCALE},
+    {"negative", OP_NEGATIVE},
+    {"xray", OP_XRAY},
+    {"rotate", OP_ROTATE},
+    {"mirror", OP_ORIENT},           // Left-right
+    {"flip", OP_ORIENT},             // Upside down
+    {"transpose", OP_ORIENT},        // Swap rows and columns
+    {"aged", OP_AGED},
+    {"mixer", OP_COLOR_MATRIX},      // mixer=rr:rg:rb:gr:gg:gb:br:bg:bb[:or:og:ob] (9 weights, optional offsets)
+    {"saturation", OP_COLOR_MATRIX}, // saturation=factor (0 = gray, 1 = unchanged)
+    {"sepia", OP_COLOR_MATRIX},
+    {"swap", OP_COLOR_MATRIX},       // swap=bgr (source channel for each output channel)
+    {"brightness", OP_LUMA_CURVE},   // brightness=offset, added to luminance only
+    {"contrast", OP_LUMA_CURVE},     // contrast=factor, luminance stretched around 128
+    {"hue", OP_HUE_SATURATION},      // hue=degrees[:saturation_factor]
+    {"median", OP_MEDIAN},           // median=radius (1 to MEDIAN_MAX_RADIUS)
+    {"sobel", OP_EDGES},             // sobel[=orientation]
+    {"scharr", OP_EDGES},            // scharr[=orientation]
+    {"erode", OP_MORPHOLOGY},        // erode=rx[:ry], rectangle of (2 * rx + 1) x (2 * ry + 1)
+    {"dilate", OP_MORPHOLOGY},
+    {"open", OP_MORPHOLOGY},
+    {"close", OP_MORPHOLOGY},
+    {"gradient", OP_MORPHOLOGY},     // dilation minus erosion
+    {"convolve", OP_CONVOLVE},       // convolve=kernel.txt (width height, then the weights row by row)
+    {"floyd", OP_DITHER},            // floyd[=levels], Floyd-Steinberg error diffusion (2 levels by default)
+    {"atkinson", OP_DITHER},         // atkinson[=levels]
+    {"bayer", OP_DITHER},            // bayer[=levels], ordered dithering with an 8x8 Bayer matrix
+    {"overlay", OP_OVERLAY},         // overlay=x:y:logo.qoi, RGBA QOI (or opaque PPM) composited at (x, y)
+    {"fill", OP_OVERLAY},            // fill=x:y:rrggbb:mask.pgm, solid color using the mask as alpha
+    {"crop", OP_CROP},               // crop=x:y:width:height, a view into the image rather than a copy
+};
+
+// Function to tell whether a color matrix fits the fixed-point kernels (this also rejects NaN and infinities)
+int color_matrix_in_range(const ColorMatrix *matrix) {
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < 3; k++) {
+            if (!(fabs(matrix->m[c][k]) <= COLOR_MATRIX_MAX_WEIGHT)) {
+                return 0;
+            }
+        }
+        if (!(fabs(matrix->m[c][3]) <= COLOR_MATRIX_MAX_OFFSET)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to check that an operation may load the file it names; the image service does not let its clients
+// open files (masks, kernels, overlays) on the server
+static int operation_file_allowed(const char *file_name) {
+    if (!operation_files_allowed) {
+        printf("Operations that load files (%s) are not accepted here.\n", file_name);
+    }
+    return operation_files_allowed;
+}
+
+// Function to parse the "=value" part of an operation; value is NULL when the operation has none
+int parse_operation_parameters(Operation *operation, const char *name, const char *value, size_t length) {
+    char text[256];
+    if (value) {
+        if (length == 0 || length >= sizeof(text)) {
+            return -1;
+        }
+        memcpy(text, value, length);
+        text[length] = '\0';
+    }
+
+    if (operation->type == OP_LUMA_CURVE) {
+        char *end;
+        double amount = value ? strtod(text, &end) : 0;
+        if (!value || *end != '\0') {
+            return -1;
+        }
+        int is_brightness = strcmp(name, "brightness") == 0;
+        for (int v = 0; v < 256; v++) {
+            double mapped = is_brightness ? v + amount : (v - 128) * amount + 128;
+            operation->curve[v] = (unsigned char)fmin(fmax(lround(mapped), 0), MAX_COLOR_VALUE);
+        }
+        return 0;
+    }
+
+    if (operation->type == OP_EDGES) {
+        if (value && strcmp(text, "orientation") != 0) {
+            return -1;
+        }
+        operation->edge_kernel = strcmp(name, "scharr") == 0 ? EDGE_SCHARR : EDGE_SOBEL;
+        operation->edge_orientation = value != NULL;
+        return 0;
+    }
+
+    if (operation->type == OP_ORIENT) {
+        if (value) {
+            return -1;
+        }
+        operation->orientation = strcmp(name, "mirror") == 0 ? ORIENT_MIRROR_X :
+                                 strcmp(name, "flip") == 0 ? ORIENT_MIRROR_Y : ORIENT_TRANSPOSE;
+        return 0;
+    }
+
+    if (operation->type == OP_CROP) {
+        Rect *rect = &operation->crop;
+        char extra;
+        if (!value || sscanf(text, "%d:%d:%d:%d%c", &rect->x, &rect->y, &rect->width, &rect->height, &extra) != 4 ||
+            rect->width <= 0 || rect->height <= 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    if (operation->type == OP_OVERLAY) {
+        // The overlay rectangle doubles as the region, so kernels only visit the pixels it covers
+        int x, y, offset = 0;
+        if (!value || sscanf(text, "%d:%d:%n", &x, &y, &offset) != 2 || offset == 0) {
+            return -1;
+        }
+        const char *rest = text + offset;
+        int overlay_width = 0, overlay_height = 0;
+        if (!operation_file_allowed(rest)) {
+            return -1;
+        }
+        if (strcmp(name, "fill") == 0) {
+            unsigned int color;
+            int color_length = 0;
+            if (sscanf(rest, "%6x%n", &color, &color_length) != 1 || color_length != 6 || rest[6] != ':') {
+                return -1;
+            }
+            operation->overlay_alpha = load_gray_image(rest + 7, &overlay_width, &overlay_height);
+            operation->overlay = operation->overlay_alpha ? allocate_image(overlay_width, overlay_height) : NULL;
+            if (operation->overlay) {
+                Pixel fill = {(color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff};
+                for (size_t k = 0; k < (size_t)overlay_width * overlay_height; k++) {
+                    operation->overlay[0][k] = fill;
+                }
+            }
+        } else {
+            operation->overlay = load_overlay_image(rest, &overlay_width, &overlay_height, &operation->overlay_alpha);
+        }
+        if (!operation->overlay) {
+            free_gray_image(operation->overlay_alpha);
+            operation->overlay_alpha = NULL;
+            return -1;
+        }
+        operation->has_region = 1;
+        operation->region.rect = (Rect){x, y, overlay_width, overlay_height};
+        return 0;
+    }
+
+    if (operation->type == OP_DITHER) {
+        char *end;
+        long levels = value ? strtol(text, &end, 10) : 2;
+        if (value && (*end != '\0' || levels < 2 || levels > 256)) {
+            return -1;
+        }
+        operation->dither_method = strcmp(name, "bayer") == 0 ? DITHER_BAYER :
+                                   strcmp(name, "atkinson") == 0 ? DITHER_ATKINSON : DITHER_FLOYD;
+        operation->levels = (int)levels;
+        return 0;
+    }
+
+    if (operation->type == OP_CONVOLVE) {
+        if (!value || !operation_file_allowed(text)) {
+            return -1;
+        }
+        operation->kernel = load_convolution_kernel(text, &operation->kernel_width, &operation->kernel_height);
+        return operation->kernel ? 0 : -1;
+    }
+
+    if (operation->type == OP_MORPHOLOGY) {
+        static const char *kinds[] = {"erode", "dilate", "open", "close", "gradient"};
+        char *end;
+        long radius_x = value ? strtol(text, &end, 10) : 0;
+        long radius_y = radius_x;
+        if (value && *end == ':') {
+            char *next = end + 1;
+            radius_y = strtol(next, &end, 10);
+            if (end == next) {
+                return -1;
+            }
+        }
+        if (!value || *end != '\0' || radius_x < 0 || radius_y < 0 || radius_x > INT_MAX / 4 || radius_y > INT_MAX / 4) {
+            return -1;
+        }
+        for (int k = 0; k < 5; k++) {
+            if (strcmp(name, kinds[k]) == 0) {
+                operation->morphology = k;
+            }
+        }
+        operation->radius = (int)radius_x;
+        operation->radius_y = (int)radius_y;
+        return 0;
+    }
+
+    if (operation->type == OP_MEDIAN) {
+        char *end;
+        long radius = value ? strtol(text, &end, 10) : 0;
+        if (!value || *end != '\0' || radius < 1 || radius > MEDIAN_MAX_RADIUS) {
+            return -1;
+        }
+        operation->radius = (int)radius;
+        return 0;
+    }
+
+    if (operation->type == OP_HUE_SATURATION) {
+        char *end;
+        double degrees = value ? strtod(text, &end) : 0;
+        double factor = 1;
+        if (value && *end == ':') {
+            char *factor_text = end + 1;
+            factor = strtod(factor_text, &end);
+            if (end == factor_text || !(factor >= 0 && factor <= HUE_MAX_SATURATION_FACTOR)) {
+                return -1;
+            }
+        }
+        if (!value || *end != '\0' || !isfinite(degrees)) {
+            return -1;
+        }
+        int shift = (int)lround(fmod(degrees, 360) / 360 * HUE_RANGE);
+        operation->hue_shift = (shift + HUE_RANGE) % HUE_RANGE;
+        operation->saturation_scale = (int)lround(factor * 256);
+        return 0;
+    }
+
+    if (operation->type != OP_COLOR_MATRIX) {
+        return value ? -1 : 0; // The original operations take no parameters
+    }
+
+    ColorMatrix *matrix = &operation->matrix;
+    memset(matrix, 0, sizeof(*matrix));
+
+    if (strcmp(name, "sepia") == 0) {
+        static const double sepia[3][3] = {{0.393, 0.769, 0.189}, {0.349, 0.686, 0.168}, {0.272, 0.534, 0.131}};
+        if (value) {
+            return -1;
+        }
+        for (int c = 0; c < 3; c++) {
+            memcpy(matrix->m[c], sepia[c], sizeof(sepia[c]));
+        }
+    } else if (strcmp(name, "saturation") == 0) {
+        // Blend between the luma matrix (factor 0) and the identity (factor 1)
+        char *end;
+        double factor = value ? strtod(text, &end) : 0;
+        if (!value || *end != '\0') {
+            return -1;
+        }
+        const double weights[3] = {GRAYSCALE_RED_WEIGHT, GRAYSCALE_GREEN_WEIGHT, GRAYSCALE_BLUE_WEIGHT};
+        for (int c = 0; c < 3; c++) {
+            for (int k = 0; k < 3; k++) {
+                matrix->m[c][k] = (1 - factor) * weights[k] + (c == k ? factor : 0);
+            }
+        }
+    } else if (strcmp(name, "swap") == 0) {
+        if (!value || length != 3) {
+            return -1;
+        }
+        for (int c = 0; c < 3; c++) {
+            const char *channel = strchr("rgb", text[c]);
+            if (!channel || !text[c]) {
+                return -1;
+            }
+            matrix->m[c][channel - "rgb"] = 1;
+        }
+    } else { // mixer
+        double values[12] = {0};
+        int read = 0;
+        char *cursor = value ? text : NULL;
+        while (cursor && read < 12) {
+            char *end;
+            values[read++] = strtod(cursor, &end);
+            if (end == cursor || (*end != ':' && *end != '\0')) {
+                return -1;
+            }
+            cursor = *end == ':' ? end + 1 : NULL;
+        }
+        if (cursor || (read != 9 && read != 12)) {
+            return -1;
+        }
+        for (int c = 0; c < 3; c++) {
+            for (int k = 0; k < 3; k++) {
+                matrix->m[c][k] = values[c * 3 + k];
+            }
+            matrix->m[c][3] = read == 12 ? values[9 + c] : 0;
+        }
+    }
+
+    if (!color_matrix_in_range(matrix)) {
+        printf("Color matrix weights must lie within +-%d and offsets within +-%d.\n",
+               COLOR_MATRIX_MAX_WEIGHT, COLOR_MATRIX_MAX_OFFSET);
+        return -1;
+    }
+    prepare_color_matrix(matrix);
+    return 0;
+}
+
+// Function to parse a region specification: "x:y:width:height" or "mask:file.pgm"
+int parse_region(const char *spec, size_t length, Region *region) {
+    char text[MAX_PATH];
+    if (length >= sizeof(text)) {
+        return -1;
+    }
+    memcpy(text, spec, length);
+    text[length] = '\0';
+
+    memset(region, 0, sizeof(*region));
+    if (strncmp(text, "mask:", 5) == 0) {
+        if (!operation_file_allowed(text + 5)) {
+            return -1;
+        }
+        region->mask = load_gray_image(text + 5, &region->mask_width, &region->mask_height);
+        if (!region->mask) {
+            return -1;
+        }
+        region->rect.width = region->mask_width;
+        region->rect.height = region->mask_height;
+        return 0;
+    }
+
+    Rect *rect = &region->rect;
+    if (sscanf(text, "%d:%d:%d:%d", &rect->x, &rect->y, &rect->width, &rect->height) != 4 ||
+        rect->width <= 0 || rect->height <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to parse a comma-separated operation chain; returns the number of operations or -1 on error.
+// Each operation may be restricted to a region with "@", e.g. "grayscale,negative@0:0:200:100".
+int parse_operation_chain(const char *chain, Operation *operations, int max_operations) {
+    int count = 0;
+    const char *cursor = chain;
+
+    while (*cursor) {
+        const char *end = strchr(cursor, ',');
+        size_t length = end ? (size_t)(end - cursor) : strlen(cursor);
+        const char *at = memchr(cursor, '@', length);
+        size_t spec_length = at ? (size_t)(at - cursor) : length;
+        const char *equals = memchr(cursor, '=', spec_length);
+        size_t name_length = equals ? (size_t)(equals - cursor) : spec_length;
+
+        if (length > 0) {
+            int found = 0;
+            for (size_t k = 0; k < sizeof(operation_names) / sizeof(operation_names[0]); k++) {
+                if (strlen(operation_names[k].name) == name_length && strncmp(operation_names[k].name, cursor, name_length) == 0) {
+                    if (count == max_operations) {
+                        printf("Too many operations in chain (maximum %d).\n", max_operations);
+                        free_operation_chain(operations, count);
+                        return -1;
+                    }
+                    memset(&operations[count], 0, sizeof(Operation));
+                    operations[count].type = operation_names[k].type;
+                    found = 1;
+                    break;
+                }
+            }
+            if (!found) {
+                printf("Unknown operation '%.*s' in chain.\n", (int)name_length, cursor);
+                free_operation_chain(operations, count);
+                return -1;
+            }
+
+            char name[32];
+            snprintf(name, sizeof(name), "%.*s", (int)name_length, cursor);
+            if (parse_operation_parameters(&operations[count], name, equals ? equals + 1 : NULL,
+                                           equals ? spec_length - name_length - 1 : 0) != 0) {
+                printf("Invalid parameters for '%.*s' in chain.\n", (int)spec_length, cursor);
+                free_operation_chain(operations, count);
+                return -1;
+            }
+
+            if (at) {
+                // Geometric operations move every pixel, so they cannot be limited to a region,
+                // and an overlay's region is its own rectangle
+                if (operations[count].type == OP_ROTATE || operations[count].type == OP_ORIENT || operations[count].type == OP_CROP ||
+                    operations[count].type == OP_OVERLAY ||
+                    parse_region(at + 1, length - spec_length - 1, &operations[count].region) != 0) {
+                    printf("Invalid region '%.*s' in chain.\n", (int)length, cursor);
+                    free_operation_chain(operations, count + 1);
+                    return -1;
+                }
+                operations[count].has_region = 1;
+            }
+            count++;
+        }
+
+        if (!end) {
+            break;
+        }
+        cursor = end + 1;
+    }
+
+    return count;
+}
+
+// Function to release the masks, kernels and overlays owned by the operations of a chain
+void free_operation_chain(Operation *operations, int count) {
+    for (int k = 0; k < count; k++) {
+        free_gray_image(operations[k].region.mask);
+        operations[k].region.mask = NULL;
+        free(operations[k].kernel);
+        operations[k].kernel = NULL;
+        free_image(operations[k].overlay);
+        operations[k].overlay = NULL;
+        free_gray_image(operations[k].overlay_alpha);
+        operations[k].overlay_alpha = NULL;
+    }
+}
+
+// Function to convert a color matrix to fixed point for the kernels
+void prepare_color_matrix(ColorMatrix *matrix) {
+    double scale = 1 << COLOR_MATRIX_SHIFT;
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < 3; k++) {
+            matrix->fixed[c][k] = (int)lround(matrix->m[c][k] * scale);
+        }
+        matrix->fixed[c][3] = (int)lround(matrix->m[c][3] * scale) + (1 << (COLOR_MATRIX_SHIFT - 1));
+    }
+}
+
+// Function to build the matrix equivalent of convert_to_grayscale
+void build_gray_matrix(ColorMatrix *matrix) {
+    memset(matrix, 0, sizeof(*matrix));
+    for (int c = 0; c < 3; c++) {
+        matrix->m[c][0] = GRAYSCALE_RED_WEIGHT;
+        matrix->m[c][1] = GRAYSCALE_GREEN_WEIGHT;
+        matrix->m[c][2] = GRAYSCALE_BLUE_WEIGHT;
+    }
+    prepare_color_matrix(matrix);
+}
+
+// Function to fold the color matrix of next into into (into runs first); returns 1 when fused.
+// Only matrices covering the same rectangle without masks, whose product stays in range, can be fused. Grayscale counts as a
+// matrix when it meets an explicit one, since it is then no longer the start of a Gray8 image.
+int fuse_color_matrices(Operation *into, const Operation *next) {
+    int into_matrix = into->type == OP_COLOR_MATRIX || into->type == OP_GRAYSCALE;
+    int next_matrix = next->type == OP_COLOR_MATRIX || next->type == OP_GRAYSCALE;
+    if (!into_matrix || !next_matrix || (into->type != OP_COLOR_MATRIX && next->type != OP_COLOR_MATRIX) ||
+        into->has_region != next->has_region || into->region.mask || next->region.mask ||
+        (into->has_region && memcmp(&into->region.rect, &next->region.rect, sizeof(Rect)) != 0)) {
+        return 0;
+    }
+
+    ColorMatrix first = into->matrix, second = next->matrix;
+    if (into->type == OP_GRAYSCALE) {
+        build_gray_matrix(&first);
+    }
+    if (next->type == OP_GRAYSCALE) {
+        build_gray_matrix(&second);
+    }
+
+    // (second o first)(x) = A2 (A1 x + o1) + o2
+    ColorMatrix fused;
+    memset(&fused, 0, sizeof(fused));
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < 4; k++) {
+            double sum = k == 3 ? second.m[c][3] : 0;
+            for (int n = 0; n < 3; n++) {
+                sum += second.m[c][n] * first.m[n][k];
+            }
+            fused.m[c][k] = sum;
+        }
+    }
+    if (!color_matrix_in_range(&fused)) {
+        return 0; // Each matrix is in range on its own; run them one after the other
+    }
+    prepare_color_matrix(&fused);
+
+    into->type = OP_COLOR_MATRIX;
+    into->matrix = fused;
+    return 1;
+}
+
+// Function to plan a chain before running it: consecutive color matrices and luminance curves are fused in place.
+// Returns the new number of operations.
+int plan_operation_chain(Operation *operations, int count) {
+    int planned = 0;
+    for (int k = 0; k < count; k++) {
+        if (planned > 0 && fuse_operations(&operations[planned - 1], &operations[k])) {
+            continue;
+        }
+        operations[planned++] = operations[k];
+    }
+    if (planned < count) {
+        printf("Fused %d operations into the previous ones.\n", count - planned);
+    }
+    return planned;
+}
+
+// Function to apply a color matrix to the pixels of a region in fixed point, one pass for any matrix
+void apply_color_matrix_region(Pixel **image, int width, int height, const ColorMatrix *matrix, const Region *region) {
+    printf("Applying color matrix...\n");
+    Rect area = clip_region(region, width, height);
+    const int m00 = matrix->fixed[0][0], m01 = matrix->fixed[0][1], m02 = matrix->fixed[0][2], m03 = matrix->fixed[0][3];
+    const int m10 = matrix->fixed[1][0], m11 = matrix->fixed[1][1], m12 = matrix->fixed[1][2], m13 = matrix->fixed[1][3];
+    const int m20 = matrix->fixed[2][0], m21 = matrix->fixed[2][1], m22 = matrix->fixed[2][2], m23 = matrix->fixed[2][3];
+    Gray8 **mask = region ? region->mask : NULL;
+
+    #pragma omp parallel for
+    for (int i = area.y; i < area.y + area.height; i++) {
+        Pixel *row = image[i];
+        const Gray8 *mask_row = mask ? mask[i] : NULL;
+
+        // Branch-free integer body so the compiler can vectorize across pixels
+        #pragma omp simd
+        for (int j = area.x; j < area.x + area.width; j++) {
+            int r = row[j].r, g = row[j].g, b = row[j].b;
+            int new_r = (m00 * r + m01 * g + m02 * b + m03) >> COLOR_MATRIX_SHIFT;
+            int new_g = (m10 * r + m11 * g + m12 * b + m13) >> COLOR_MATRIX_SHIFT;
+            int new_b = (m20 * r + m21 * g + m22 * b + m23) >> COLOR_MATRIX_SHIFT;
+            new_r = new_r < 0 ? 0 : new_r > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : new_r;
+            new_g = new_g < 0 ? 0 : new_g > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : new_g;
+            new_b = new_b < 0 ? 0 : new_b > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : new_b;
+
+            int keep = mask_row && !mask_row[j];
+            row[j].r = (unsigned char)(keep ? r : new_r);
+            row[j].g = (unsigned char)(keep ? g : new_g);
+            row[j].b = (unsigned char)(keep ? b : new_b);
+        }
+    }
+    printf("Color matrix applied successfully.\n");
+}
+
+// Function to blend an overlay channel over a base channel, rounding (base * (255 - alpha) + over * alpha) / 255
+// exactly with shifts so the loops vectorize
+static inline int blend_channel(int base, int over, int alpha) {
+    int value = base * (MAX_COLOR_VALUE - alpha) + over * alpha + 128;
+    return (value + (value >> 8)) >> 8;
+}
+
+// Function to compute the full-range YCbCr luminance (JPEG coefficients) of one pixel in fixed point
+static inline int luma_from_rgb(int r, int g, int b) {
+    return (19595 * r + 38470 * g + 7471 * b + (1 << (YCBCR_SHIFT - 1))) >> YCBCR_SHIFT;
+}
+
+// Function to move the luminance of one pixel to a new value, keeping Cb and Cr.
+// In full-range YCbCr a change of Y shifts r, g and b by the same amount.
+static inline void set_pixel_luma(Pixel *pixel, int luma, int new_luma) {
+    int delta = new_luma - luma;
+    int r = pixel->r + delta, g = pixel->g + delta, b = pixel->b + delta;
+    pixel->r = (unsigned char)(r < 0 ? 0 : r > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : r);
+    pixel->g = (unsigned char)(g < 0 ? 0 : g > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : g);
+    pixel->b = (unsigned char)(b < 0 ? 0 : b > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : b);
+}
+
+// Function to tell whether a luminance curve keeps every channel of every pixel in range. A channel of a pixel
+// of luma Y lies between the bounds found below: blue, with the smallest weight, reaches furthest.
+static int luma_curve_never_clamps(const unsigned char curve[256]) {
+    for (int luma = 0; luma <= MAX_COLOR_VALUE; luma++) {
+        int delta = curve[luma] - luma;
+        int highest = 0, lowest = MAX_COLOR_VALUE;
+        for (int v = 0; v <= MAX_COLOR_VALUE && delta != 0; v++) {
+            if (luma_from_rgb(0, 0, v) <= luma) {
+                highest = v;
+            }
+            if (luma_from_rgb(MAX_COLOR_VALUE, MAX_COLOR_VALUE, v) >= luma) {
+                lowest = min(lowest, v);
+            }
+        }
+        if (delta != 0 && (highest + delta > MAX_COLOR_VALUE || lowest + delta < 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to fold a luminance curve or color matrix into the previous operation; returns 1 when fused.
+// Luminance curves are merged only when the first never clamps a channel: the second then sees exactly the
+// luma the first produced, so the merged table gives the same pixels as running both.
+int fuse_operations(Operation *into, const Operation *next) {
+    if (into->type == OP_LUMA_CURVE && next->type == OP_LUMA_CURVE) {
+        if (into->has_region != next->has_region || into->region.mask || next->region.mask ||
+            (into->has_region && memcmp(&into->region.rect, &next->region.rect, sizeof(Rect)) != 0) ||
+            !luma_curve_never_clamps(into->curve)) {
+            return 0;
+        }
+        for (int v = 0; v < 256; v++) {
+            into->curve[v] = next->curve[into->curve[v]];
+        }
+        return 1;
+    }
+    return fuse_color_matrices(into, next);
+}
+
+// Function to convert one pixel to HSV with the hue in 0..HUE_RANGE-1 and saturation/value in 0..255
+static inline void hsv_from_rgb(int r, int g, int b, int *h, int *s, int *v) {
+    int high = max(r, max(g, b));
+    int low = min(r, min(g, b));
+    int delta = high - low;
+    *v = high;
+    *s = high ? (delta * MAX_COLOR_VALUE + high / 2) / high : 0;
+    if (delta == 0) {
+        *h = 0;
+        return;
+    }
+    int hue;
+    if (high == r) {
+        hue = ((g - b) * HUE_SECTOR + delta / 2) / delta;
+    } else if (high == g) {
+        hue = 2 * HUE_SECTOR + ((b - r) * HUE_SECTOR + delta / 2) / delta;
+    } else {
+        hue = 4 * HUE_SECTOR + ((r - g) * HUE_SECTOR + delta / 2) / delta;
+    }
+    *h = (hue + HUE_RANGE) % HUE_RANGE;
+}
+
+// Function to convert one HSV pixel back to RGB
+static inline void rgb_from_hsv(int h, int s, int v, Pixel *pixel) {
+    int sector = h / HUE_SECTOR;
+    int fraction = h % HUE_SECTOR;
+    const int scale = MAX_COLOR_VALUE * HUE_SECTOR;
+    int p = (v * (MAX_COLOR_VALUE - s) + MAX_COLOR_VALUE / 2) / MAX_COLOR_VALUE;
+    int q = (v * (scale - s * fraction) + scale / 2) / scale;
+    int t = (v * (scale - s * (HUE_SECTOR - fraction)) + scale / 2) / scale;
+    int r, g, b;
+    switch (sector) {
+        case 0: r = v; g = t; b = p; break;
+        case 1: r = q; g = v; b = p; break;
+        case 2: r = p; g = v; b = t; break;
+        case 3: r = p; g = q; b = v; break;
+        case 4: r = t; g = p; b = v; break;
+        default: r = v; g = p; b = q; break;
+    }
+    pixel->r = (unsigned char)r;
+    pixel->g = (unsigned char)g;
+    pixel->b = (unsigned char)b;
+}
+
+// Function to rotate the hue and scale the saturation of one HSV pixel
+static inline void adjust_hue_saturation(int *h, int *s, int hue_shift, int saturation_scale) {
+    *h = (*h + hue_shift) % HUE_RANGE;
+    *s = min((*s * saturation_scale + 128) >> 8, MAX_COLOR_VALUE);
+}
+
+// Function to split the pixels of an area into hue, saturation and value planes of the area's size
+void rgb_to_hsv_planes(Pixel **image, Rect area, unsigned short *hue, Gray8 **saturation, Gray8 **value) {
+    #pragma omp parallel for
+    for (int i = 0; i < area.height; i++) {
+        const Pixel *row = image[area.y + i] + area.x;
+        unsigned short *hue_row = hue + (size_t)i * area.width;
+        for (int j = 0; j < area.width; j++) {
+            int h, s, v;
+            hsv_from_rgb(row[j].r, row[j].g, row[j].b, &h, &s, &v);
+            hue_row[j] = (unsigned short)h;
+            saturation[i][j] = (Gray8)s;
+            value[i][j] = (Gray8)v;
+        }
+    }
+}
+
+// Function to write hue, saturation and value planes back into an area; pixels outside the mask keep their value
+void hsv_planes_to_rgb(const unsigned short *hue, Gray8 **saturation, Gray8 **value, Pixel **image, Rect area, Gray8 **mask) {
+    #pragma omp parallel for
+    for (int i = 0; i < area.height; i++) {
+        Pixel *row = image[area.y + i] + area.x;
+        const Gray8 *mask_row = mask ? mask[area.y + i] + area.x : NULL;
+        const unsigned short *hue_row = hue + (size_t)i * area.width;
+        for (int j = 0; j < area.width; j++) {
+            if (mask_row && !mask_row[j]) {
+                continue;
+            }
+            rgb_from_hsv(hue_row[j], saturation[i][j], value[i][j], &row[j]);
+        }
+    }
+}
+
+// Function to apply a lookup curve to the luminance of a region, leaving the chroma untouched.
+// Only the Y plane changes, so it is computed per row and folded straight back without storing Cb and Cr.
+// Returns -1 when a thread cannot allocate its row of luminance.
+int apply_luma_curve_region(Pixel **image, int width, int height, const unsigned char curve[256], const Region *region) {
+    printf("Applying luminance curve...\n");
+    Rect area = clip_region(region, width, height);
+    Gray8 **mask = region ? region->mask : NULL;
+    int failed = 0;
+
+    #pragma omp parallel reduction(| : failed)
+    {
+        Gray8 *luma = malloc(area.width > 0 ? area.width : 1);
+        #pragma omp for
+        for (int i = area.y; i < area.y + area.height; i++) {
+            Pixel *row = image[i] + area.x;
+            const Gray8 *mask_row = mask ? mask[i] + area.x : NULL;
+            if (!luma) {
+                failed = 1;
+                continue;
+            }
+            #pragma omp simd
+            for (int j = 0; j < area.width; j++) {
+                luma[j] = (Gray8)luma_from_rgb(row[j].r, row[j].g, row[j].b);
+            }
+            for (int j = 0; j < area.width; j++) {
+                if (!mask_row || mask_row[j]) {
+                    set_pixel_luma(&row[j], luma[j], curve[luma[j]]);
+                }
+            }
+        }
+        free(luma);
+    }
+    if (failed) {
+        printf("Memory allocation failed for the luminance rows.\n");
+        return -1;
+    }
+    printf("Luminance curve applied successfully.\n");
+    return 0;
+}
+
+// Function to rotate the hue and scale the saturation of a region, leaving the value plane untouched;
+// returns -1 when the HSV planes cannot be allocated
+int apply_hue_saturation_region(Pixel **image, int width, int height, int hue_shift, int saturation_scale, const Region *region) {
+    printf("Adjusting hue and saturation...\n");
+    Rect area = clip_region(region, width, height);
+    if (area.width <= 0 || area.height <= 0) {
+        return 0;
+    }
+
+    unsigned short *hue = malloc((size_t)area.width * area.height * sizeof(unsigned short));
+    Gray8 **saturation = allocate_gray_image(area.width, area.height);
+    Gray8 **value = allocate_gray_image(area.width, area.height);
+    if (!hue || !saturation || !value) {
+        printf("Memory allocation failed for HSV planes.\n");
+        free(hue);
+        free_gray_image(saturation);
+        free_gray_image(value);
+        return -1;
+    }
+
+    rgb_to_hsv_planes(image, area, hue, saturation, value);
+
+    #pragma omp parallel for
+    for (int i = 0; i < area.height; i++) {
+        unsigned short *hue_row = hue + (size_t)i * area.width;
+        Gray8 *saturation_row = saturation[i];
+        #pragma omp simd
+        for (int j = 0; j < area.width; j++) {
+            hue_row[j] = (unsigned short)((hue_row[j] + hue_shift) % HUE_RANGE);
+            saturation_row[j] = (Gray8)min((saturation_row[j] * saturation_scale + 128) >> 8, MAX_COLOR_VALUE);
+        }
+    }
+
+    hsv_planes_to_rgb(hue, saturation, value, image, area, region ? region->mask : NULL);
+
+    free(hue);
+    free_gray_image(saturation);
+    free_gray_image(value);
+    printf("Hue and saturation adjusted successfully.\n");
+    return 0;
+}
+
+// Function to allocate a planar image with padded, aligned channel rows
+PlanarImage *allocate_planar_image(int width, int height) {
+    PlanarImage *planar = malloc(sizeof(PlanarImage));
+    if (!planar) {
+        printf("Memory allocation failed for planar image.\n");
+        return NULL;
+    }
+    planar->width = width;
+    planar->height = height;
+    planar->stride = (width + PLANAR_ALIGNMENT - 1) / PLANAR_ALIGNMENT * PLANAR_ALIGNMENT;
+
+    size_t plane_size = (size_t)planar->stride * height;
+    planar->planes[0] = _aligned_malloc(plane_size * 3, PLANAR_ALIGNMENT);
+    if (!planar->planes[0]) {
+        printf("Memory allocation failed for planar image channels.\n");
+        free(planar);
+        return NULL;
+    }
+    planar->planes[1] = planar->planes[0] + plane_size;
+    planar->planes[2] = planar->planes[1] + plane_size;
+    return planar;
+}
+
+// Function to free a planar image
+void free_planar_image(PlanarImage *planar) {
+    if (!planar) {
+        return;
+    }
+    _aligned_free(planar->planes[0]);
+    free(planar);
+}
+
+// Function to split packed pixels into channel planes
+PlanarImage *unpack_to_planar(Pixel **image, int width, int height) {
+    PlanarImage *planar = allocate_planar_image(width, height);
+    if (!planar) {
+        return NULL;
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < height; i++) {
+        const Pixel *row = image[i];
+        Gray8 *red = planar->planes[0] + (size_t)i * planar->stride;
+        Gray8 *green = planar->planes[1] + (size_t)i * planar->stride;
+        Gray8 *blue = planar->planes[2] + (size_t)i * planar->stride;
+        #pragma omp simd
+        for (int j = 0; j < width; j++) {
+            red[j] = row[j].r;
+            green[j] = row[j].g;
+            blue[j] = row[j].b;
+        }
+        // Keep the padding defined so whole-stride kernels never read garbage
+        memset(red + width, 0, planar->stride - width);
+        memset(green + width, 0, planar->stride - width);
+        memset(blue + width, 0, planar->stride - width);
+    }
+    return planar;
+}
+
+// Function to interleave channel planes back into packed pixels of the same size
+void pack_from_planar(const PlanarImage *planar, Pixel **image) {
+    #pragma omp parallel for
+    for (int i = 0; i < planar->height; i++) {
+        Pixel *row = image[i];
+        const Gray8 *red = planar->planes[0] + (size_t)i * planar->stride;
+        const Gray8 *green = planar->planes[1] + (size_t)i * planar->stride;
+        const Gray8 *blue = planar->planes[2] + (size_t)i * planar->stride;
+        #pragma omp simd
+        for (int j = 0; j < planar->width; j++) {
+            row[j].r = red[j];
+            row[j].g = green[j];
+            row[j].b = blue[j];
+        }
+    }
+}
+
+// Function to compute the Gray8 image of a planar image, as convert_to_gray8 does for packed pixels
+static Gray8 **gray_from_planar(const PlanarImage *planar) {
+    Gray8 **gray = allocate_gray_image(planar->width, planar->height);
+    if (!gray) {
+        return NULL;
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < planar->height; i++) {
+        const Gray8 *red = planar->planes[0] + (size_t)i * planar->stride;
+        const Gray8 *green = planar->planes[1] + (size_t)i * planar->stride;
+        const Gray8 *blue = planar->planes[2] + (size_t)i * planar->stride;
+        #pragma omp simd
+        for (int j = 0; j < planar->width; j++) {
+            gray[i][j] = (Gray8)(red[j] * GRAYSCALE_RED_WEIGHT + green[j] * GRAYSCALE_GREEN_WEIGHT + blue[j] * GRAYSCALE_BLUE_WEIGHT);
+        }
+    }
+    return gray;
+}
+
+// Function to tell whether an operation has a planar kernel
+static int planar_supports(const Operation *operation) {
+    switch (operation->type) {
+        case OP_NEGATIVE:
+        case OP_AGED:
+        case OP_COLOR_MATRIX:
+        case OP_LUMA_CURVE:
+        case OP_OVERLAY:
+            return 1;
+        case OP_GRAYSCALE:
+        case OP_XRAY:
+            return operation->has_region; // Unregioned ones switch the chain to Gray8
+        default:
+            return 0;
+    }
+}
+
+// Function to run one point operation over the planes of a region.
+// Every kernel computes whole rows branch-free and keeps masked-out pixels with a select.
+static void apply_planar_operation(PlanarImage *planar, const Operation *operation, const PointCurves *curves) {
+    const Region *region = operation->has_region ? &operation->region : NULL;
+    Rect area = clip_region(region, planar->width, planar->height);
+    Gray8 **mask = region ? region->mask : NULL;
+    const int (*fixed)[4] = operation->matrix.fixed;
+
+    #pragma omp parallel for
+    for (int i = area.y; i < area.y + area.height; i++) {
+        Gray8 *red = planar->planes[0] + (size_t)i * planar->stride + area.x;
+        Gray8 *green = planar->planes[1] + (size_t)i * planar->stride + area.x;
+        Gray8 *blue = planar->planes[2] + (size_t)i * planar->stride + area.x;
+        const Gray8 *mask_row = mask ? mask[i] + area.x : NULL;
+
+        switch (operation->type) {
+            case OP_NEGATIVE:
+                #pragma omp simd
+                for (int j = 0; j < area.width; j++) {
+                    int keep = mask_row && !mask_row[j];
+                    red[j] = keep ? red[j] : (Gray8)(MAX_COLOR_VALUE - red[j]);
+                    green[j] = keep ? green[j] : (Gray8)(MAX_COLOR_VALUE - green[j]);
+                    blue[j] = keep ? blue[j] : (Gray8)(MAX_COLOR_VALUE - blue[j]);
+                }
+                break;
+            case OP_AGED:
+                for (int j = 0; j < area.width; j++) {
+                    int keep = mask_row && !mask_row[j];
+                    red[j] = keep ? red[j] : curves->aged_red[red[j]];
+                    green[j] = keep ? green[j] : curves->aged_green[green[j]];
+                    blue[j] = keep ? blue[j] : curves->aged_blue[blue[j]];
+                }
+                break;
+            case OP_GRAYSCALE:
+            case OP_XRAY: {
+                int xray = operation->type == OP_XRAY;
+                for (int j = 0; j < area.width; j++) {
+                    Gray8 gray = (Gray8)(red[j] * GRAYSCALE_RED_WEIGHT + green[j] * GRAYSCALE_GREEN_WEIGHT + blue[j] * GRAYSCALE_BLUE_WEIGHT);
+                    gray = xray ? curves->xray[gray] : gray;
+                    int keep = mask_row && !mask_row[j];
+                    red[j] = keep ? red[j] : gray;
+                    green[j] = keep ? green[j] : gray;
+                    blue[j] = keep ? blue[j] : gray;
+                }
+                break;
+            }
+            case OP_COLOR_MATRIX:
+                #pragma omp simd
+                for (int j = 0; j < area.width; j++) {
+                    int r = red[j], g = green[j], b = blue[j];
+                    int new_r = (fixed[0][0] * r + fixed[0][1] * g + fixed[0][2] * b + fixed[0][3]) >> COLOR_MATRIX_SHIFT;
+                    int new_g = (fixed[1][0] * r + fixed[1][1] * g + fixed[1][2] * b + fixed[1][3]) >> COLOR_MATRIX_SHIFT;
+                    int new_b = (fixed[2][0] * r + fixed[2][1] * g + fixed[2][2] * b + fixed[2][3]) >> COLOR_MATRIX_SHIFT;
+                    new_r = new_r < 0 ? 0 : new_r > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : new_r;
+                    new_g = new_g < 0 ? 0 : new_g > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : new_g;
+                    new_b = new_b < 0 ? 0 : new_b > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : new_b;
+                    int keep = mask_row && !mask_row[j];
+                    red[j] = (Gray8)(keep ? r : new_r);
+                    green[j] = (Gray8)(keep ? g : new_g);
+                    blue[j] = (Gray8)(keep ? b : new_b);
+                }
+                break;
+            case OP_OVERLAY: {
+                const Pixel *over = operation->overlay[i - region->rect.y] + (area.x - region->rect.x);
+                const Gray8 *alpha = operation->overlay_alpha[i - region->rect.y] + (area.x - region->rect.x);
+                #pragma omp simd
+                for (int j = 0; j < area.width; j++) {
+                    red[j] = (Gray8)blend_channel(red[j], over[j].r, alpha[j]);
+                    green[j] = (Gray8)blend_channel(green[j], over[j].g, alpha[j]);
+                    blue[j] = (Gray8)blend_channel(blue[j], over[j].b, alpha[j]);
+                }
+                break;
+            }
+            case OP_LUMA_CURVE:
+                for (int j = 0; j < area.width; j++) {
+                    int luma = luma_from_rgb(red[j], green[j], blue[j]);
+                    int delta = mask_row && !mask_row[j] ? 0 : operation->curve[luma] - luma;
+                    int r = red[j] + delta, g = green[j] + delta, b = blue[j] + delta;
+                    red[j] = (Gray8)(r < 0 ? 0 : r > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : r);
+                    green[j] = (Gray8)(g < 0 ? 0 : g > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : g);
+                    blue[j] = (Gray8)(b < 0 ? 0 : b > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : b);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Function to run the operations starting at start on channel planes when at least PLANAR_MIN_RUN
+// of them in a row have planar kernels. The planes are packed back once at the end of the run,
+// or turned straight into the Gray8 image when the run stops at an unregioned grayscale or X-ray.
+// Returns the index of the first operation not applied (start when nothing ran), or -1 on error.
+int apply_planar_run(ChainImage *image, const Operation *operations, int start, int count) {
+    int end = start;
+    while (end < count && planar_supports(&operations[end])) {
+        end++;
+    }
+    if (end - start < PLANAR_MIN_RUN) {
+        return start;
+    }
+
+    printf("Running %d operations on planar channels...\n", end - start);
+    PlanarImage *planar = unpack_to_planar(image->rgb, image->width, image->height);
+    if (!planar) {
+        return -1;
+    }
+    PointCurves curves;
+    build_point_curves(&curves);
+
+    for (int k = start; k < end; k++) {
+        const Region *region = operations[k].has_region ? &operations[k].region : NULL;
+        if (region && region->mask && (region->mask_width != planar->width || region->mask_height != planar->height)) {
+            printf("Mask size %d x %d does not match the image size %d x %d.\n",
+                   region->mask_width, region->mask_height, planar->width, planar->height);
+            free_planar_image(planar);
+            return -1;
+        }
+        apply_planar_operation(planar, &operations[k], &curves);
+    }
+
+    int to_gray = end < count && (operations[end].type == OP_GRAYSCALE || operations[end].type == OP_XRAY);
+    if (to_gray) {
+        // The grayscale step itself is done here; the caller still applies the X-ray curve
+        Gray8 **gray = gray_from_planar(planar);
+        if (!gray) {
+            free_planar_image(planar);
+            return -1;
+        }
+        replace_chain_pixels(image, NULL, gray);
+    } else {
+        pack_from_planar(planar, image->rgb);
+    }
+    free_planar_image(planar);
+    printf("Planar run completed.\n");
+    return end;
+}
+
+// Function to tell whether an operation computes each pixel from that pixel alone,
+// which lazy per-tile evaluation relies on (crops and flips change the layout, so they count as not pointwise)
+int operation_is_pointwise(OperationType type) {
+    return type != OP_MEDIAN && type != OP_EDGES && type != OP_MORPHOLOGY && type != OP_CONVOLVE && type != OP_DITHER &&
+           type != OP_CROP && type != OP_ORIENT;
+}
+
+// Function to find the median of a window from its coarse (16 bins) and fine (256 bins) histograms
+static inline int histogram_median(const unsigned short coarse[16], const unsigned short fine[256], int rank) {
+    int bucket = 0;
+    while (rank >= coarse[bucket]) {
+        rank -= coarse[bucket++];
+    }
+    int value = bucket * 16;
+    while (rank >= fine[value]) {
+        rank -= fine[value++];
+    }
+    return value;
+}
+
+// Function to median filter one channel over the columns [strip_x, strip_x + strip_width) of an area.
+// Following Perreault and Hebert, every column keeps a histogram of its 2r + 1 rows, which slides down
+// one row per output row, and the window histogram slides right by adding one column histogram and
+// removing another, so the cost per pixel does not depend on the radius. Borders replicate edge pixels.
+// Returns -1 when the histograms cannot be allocated.
+static int median_filter_strip(const Gray8 *source, int stride, int width, int height, int radius,
+                                Rect area, int strip_x, int strip_width, Gray8 **mask,
+                                unsigned char *target, int pixel_step, size_t row_step) {
+    int columns = strip_width + 2 * radius;
+    unsigned short *column_fine = calloc((size_t)columns * 256, sizeof(unsigned short));
+    unsigned short *column_coarse = calloc((size_t)columns * 16, sizeof(unsigned short));
+    if (!column_fine || !column_coarse) {
+        printf("Memory allocation failed for median histograms.\n");
+        free(column_fine);
+        free(column_coarse);
+        return -1;
+    }
+
+    // Column c of the strip reads image column clamp(strip_x - radius + c)
+    for (int c = 0; c < columns; c++) {
+        int x = min(max(strip_x - radius + c, 0), width - 1);
+        for (int t = -radius; t <= radius; t++) {
+            Gray8 value = source[(size_t)min(max(area.y + t, 0), height - 1) * stride + x];
+            column_fine[c * 256 + value]++;
+            column_coarse[c * 16 + value / 16]++;
+        }
+    }
+
+    int rank = (2 * radius + 1) * (2 * radius + 1) / 2;
+    for (int i = area.y; i < area.y + area.height; i++) {
+        if (i > area.y) {
+            const Gray8 *removed = source + (size_t)max(i - radius - 1, 0) * stride;
+            const Gray8 *added = source + (size_t)min(i + radius, height - 1) * stride;
+            for (int c = 0; c < columns; c++) {
+                int x = min(max(strip_x - radius + c, 0), width - 1);
+                column_fine[c * 256 + removed[x]]--;
+                column_coarse[c * 16 + removed[x] / 16]--;
+                column_fine[c * 256 + added[x]]++;
+                column_coarse[c * 16 + added[x] / 16]++;
+            }
+        }
+
+        unsigned short fine[256] = {0}, coarse[16] = {0};
+        for (int c = 0; c <= 2 * radius; c++) {
+            #pragma omp simd
+            for (int v = 0; v < 256; v++) {
+                fine[v] += column_fine[c * 256 + v];
+            }
+            for (int v = 0; v < 16; v++) {
+                coarse[v] += column_coarse[c * 16 + v];
+            }
+        }
+
+        unsigned char *target_row = target + (size_t)i * row_step;
+        const Gray8 *mask_row = mask ? mask[i] : NULL;
+        for (int j = 0; j < strip_width; j++) {
+            if (j > 0) {
+                const unsigned short *add_fine = column_fine + (size_t)(j + 2 * radius) * 256;
+                const unsigned short *remove_fine = column_fine + (size_t)(j - 1) * 256;
+                #pragma omp simd
+                for (int v = 0; v < 256; v++) {
+                    fine[v] += add_fine[v] - remove_fine[v];
+                }
+                for (int v = 0; v < 16; v++) {
+                    coarse[v] += column_coarse[(j + 2 * radius) * 16 + v] - column_coarse[(j - 1) * 16 + v];
+                }
+            }
+            int x = strip_x + j;
+            if (!mask_row || mask_row[x]) {
+                target_row[(size_t)x * pixel_step] = (unsigned char)histogram_median(coarse, fine, rank);
+            }
+        }
+    }
+
+    free(column_fine);
+    free(column_coarse);
+    return 0;
+}
+
+// Function to median filter one channel plane into target, splitting the area into column strips across threads;
+// returns -1 when any strip could not be filtered
+static int median_filter_plane(const Gray8 *source, int stride, int width, int height, int radius,
+                               Rect area, Gray8 **mask, unsigned char *target, int pixel_step, size_t row_step) {
+    int strip_width = max((area.width + omp_get_max_threads() - 1) / omp_get_max_threads(), MEDIAN_MIN_STRIP);
+    int strips = (area.width + strip_width - 1) / strip_width;
+    int failed = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(+ : failed)
+    for (int s = 0; s < strips; s++) {
+        int strip_x = area.x + s * strip_width;
+        failed += median_filter_strip(source, stride, width, height, radius, area, strip_x,
+                                      min(strip_width, area.x + area.width - strip_x), mask, target, pixel_step, row_step) != 0;
+    }
+    return failed ? -1 : 0;
+}
+
+// Function to apply a median filter of the given radius to a region of an RGB image; returns -1 on failure
+int median_filter_image_region(Pixel **image, int width, int height, int radius, const Region *region) {
+    printf("Applying median filter (radius %d)...\n", radius);
+    Rect area = clip_region(region, width, height);
+    if (area.width <= 0 || area.height <= 0) {
+        return 0;
+    }
+
+    // The planes are an unmodified copy of the input; the result is written straight into the pixels
+    PlanarImage *planar = unpack_to_planar(image, width, height);
+    if (!planar) {
+        return -1;
+    }
+    ImageView view = view_of_image(image, width, height);
+    unsigned char *base = view.base;
+    size_t row_step = view.stride;
+    Gray8 **mask = region ? region->mask : NULL;
+    int failed = 0;
+    failed |= median_filter_plane(planar->planes[0], planar->stride, width, height, radius, area, mask, base + offsetof(Pixel, r), sizeof(Pixel), row_step);
+    failed |= median_filter_plane(planar->planes[1], planar->stride, width, height, radius, area, mask, base + offsetof(Pixel, g), sizeof(Pixel), row_step);
+    failed |= median_filter_plane(planar->planes[2], planar->stride, width, height, radius, area, mask, base + offsetof(Pixel, b), sizeof(Pixel), row_step);
+
+    free_planar_image(planar);
+    if (failed) {
+        return -1;
+    }
+    printf("Median filter applied successfully.\n");
+    return 0;
+}
+
+// Function to apply a median filter of the given radius to a region of a Gray8 image; returns -1 on failure
+int median_filter_gray_region(Gray8 **image, int width, int height, int radius, const Region *region) {
+    printf("Applying median filter (radius %d)...\n", radius);
+    Rect area = clip_region(region, width, height);
+    if (area.width <= 0 || area.height <= 0) {
+        return 0;
+    }
+
+    Gray8 *source = malloc((size_t)width * height);
+    if (!source) {
+        printf("Memory allocation failed for median filter.\n");
+        return -1;
+    }
+    ImageView view = view_of_gray_image(image, width, height);
+    for (int i = 0; i < height; i++) {
+        memcpy(source + (size_t)i * width, image[i], width);
+    }
+    int failed = median_filter_plane(source, width, width, height, radius, area, region ? region->mask : NULL, view.base, 1, view.stride);
+
+    free(source);
+    if (failed) {
+        return -1;
+    }
+    printf("Median filter applied successfully.\n");
+    return 0;
+}
+
+// Function to compute the gradients of a gray image over one tile and store the edge strength.
+// Each output row reads the row triplet above, at and below it once; x and y gradients and the
+// magnitude are computed together, so no per-axis gradient image is ever written. The result goes
+// to magnitude, or to colored as gray pixels (or hue-coded by direction when orientation is set).
+static void detect_edges_tile(Gray8 **gray, int width, int height, int kernel, int orientation, Rect tile,
+                              Gray8 **mask, Gray8 **magnitude, Pixel **colored) {
+    // Sobel weighs the rows 1-2-1, Scharr 3-10-3; dividing by the sum keeps magnitudes in 0-255
+    const int outer = kernel == EDGE_SCHARR ? 3 : 1;
+    const int center = kernel == EDGE_SCHARR ? 10 : 2;
+    const float scale = 1.0f / (2 * outer + center);
+    float strength[EDGE_TILE_SIZE];
+    int gradient_x[EDGE_TILE_SIZE], gradient_y[EDGE_TILE_SIZE];
+
+    for (int i = tile.y; i < tile.y + tile.height; i++) {
+        const Gray8 *up = gray[max(i - 1, 0)];
+        const Gray8 *middle = gray[i];
+        const Gray8 *down = gray[min(i + 1, height - 1)];
+
+        #pragma omp simd
+        for (int t = 0; t < tile.width; t++) {
+            int j = tile.x + t;
+            int left = j > 0 ? j - 1 : 0;
+            int right = j < width - 1 ? j + 1 : width - 1;
+            int gx = outer * (up[right] - up[left]) + center * (middle[right] - middle[left]) + outer * (down[right] - down[left]);
+            int gy = outer * (down[left] - up[left]) + center * (down[j] - up[j]) + outer * (down[right] - up[right]);
+            gradient_x[t] = gx;
+            gradient_y[t] = gy;
+            strength[t] = fminf(sqrtf((float)(gx * gx + gy * gy)) * scale, MAX_COLOR_VALUE);
+        }
+
+        const Gray8 *mask_row = mask ? mask[i] : NULL;
+        for (int t = 0; t < tile.width; t++) {
+            int j = tile.x + t;
+            if (mask_row && !mask_row[j]) {
+                continue;
+            }
+            int value = (int)(strength[t] + 0.5f);
+            if (!colored) {
+                magnitude[i][j] = (Gray8)value;
+            } else if (!orientation) {
+                colored[i][j].r = colored[i][j].g = colored[i][j].b = (unsigned char)value;
+            } else {
+                float turn = atan2f((float)gradient_y[t], (float)gradient_x[t]) / (2 * (float)M_PI);
+                int hue = (int)((turn < 0 ? turn + 1 : turn) * HUE_RANGE) % HUE_RANGE;
+                rgb_from_hsv(hue, MAX_COLOR_VALUE, value, &colored[i][j]);
+            }
+        }
+    }
+}
+
+// Function to run detect_edges_tile over every tile of an area in parallel
+static void detect_edges_area(Gray8 **gray, int width, int height, int kernel, int orientation, Rect area,
+                              Gray8 **mask, Gray8 **magnitude, Pixel **colored) {
+    int tiles_x = (area.width + EDGE_TILE_SIZE - 1) / EDGE_TILE_SIZE;
+    int tiles_y = (area.height + EDGE_TILE_SIZE - 1) / EDGE_TILE_SIZE;
+
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            Rect tile;
+            tile.x = area.x + tx * EDGE_TILE_SIZE;
+            tile.y = area.y + ty * EDGE_TILE_SIZE;
+            tile.width = min(EDGE_TILE_SIZE, area.x + area.width - tile.x);
+            tile.height = min(EDGE_TILE_SIZE, area.y + area.height - tile.y);
+            detect_edges_tile(gray, width, height, kernel, orientation, tile, mask, magnitude, colored);
+        }
+    }
+}
+
+// Function to apply Sobel or Scharr edge detection to a chain image. The gradients are taken on the
+// grayscale image (converted first when the chain holds RGB). Without a region the chain continues on
+// the Gray8 edge map, or on RGB when the edges are colored by orientation.
+int apply_edge_operation(ChainImage *image, const Operation *operation, const Region *region) {
+    printf("Detecting edges (%s)...\n", operation->edge_kernel == EDGE_SCHARR ? "Scharr" : "Sobel");
+    Rect area = clip_region(region, image->width, image->height);
+    Gray8 **mask = region ? region->mask : NULL;
+
+    // The gradients read an unmodified gray copy while the result is written
+    Gray8 **source;
+    if (image->rgb) {
+        source = convert_to_gray8(image->rgb, image->width, image->height);
+    } else {
+        source = allocate_gray_image(image->width, image->height);
+        for (int i = 0; source && i < image->height; i++) {
+            memcpy(source[i], image->gray[i], image->width);
+        }
+    }
+    if (!source) {
+        return -1;
+    }
+
+    if (!region) {
+        Gray8 **magnitude = NULL;
+        Pixel **colored = NULL;
+        if (operation->edge_orientation) {
+            colored = allocate_image(image->width, image->height);
+        } else {
+            magnitude = allocate_gray_image(image->width, image->height);
+        }
+        if (!magnitude && !colored) {
+            free_gray_image(source);
+            return -1;
+        }
+        detect_edges_area(source, image->width, image->height, operation->edge_kernel, operation->edge_orientation,
+                          area, NULL, magnitude, colored);
+        replace_chain_pixels(image, colored, magnitude);
+    } else {
+        if (operation->edge_orientation && promote_chain_image(image) != 0) {
+            free_gray_image(source);
+            return -1;
+        }
+        detect_edges_area(source, image->width, image->height, operation->edge_kernel, operation->edge_orientation,
+                          area, mask, image->gray, image->rgb);
+    }
+
+    free_gray_image(source);
+    printf("Edge detection completed.\n");
+    return 0;
+}
+
+// Function to replace each pixel of every row of a plane by the minimum (or maximum) of the 2r + 1
+// pixels around it, with the van Herk/Gil-Werman algorithm: the padded row is cut into blocks of
+// 2r + 1, running extremes are taken forwards and backwards inside each block, and every window
+// is the extreme of one backward and one forward value, so the cost does not depend on r.
+// Pixels outside the plane count as the neutral value (255 for minimum, 0 for maximum).
+static int running_extreme_rows(Gray8 *plane, int stride, int width, int height, int radius, int is_max) {
+    if (radius == 0) {
+        return 0;
+    }
+    int window = 2 * radius + 1;
+    int padded = (width + 2 * radius + window - 1) / window * window;
+    Gray8 neutral = is_max ? 0 : MAX_COLOR_VALUE;
+    int failed = 0;
+
+    #pragma omp parallel reduction(| : failed)
+    {
+        Gray8 *forward = malloc(padded);
+        Gray8 *backward = malloc(padded);
+        #pragma omp for
+        for (int i = 0; i < height; i++) {
+            Gray8 *row = plane + (size_t)i * stride;
+            if (!forward || !backward) {
+                failed = 1;
+                continue;
+            }
+            for (int p = 0; p < padded; p++) {
+                int x = p - radius;
+                forward[p] = backward[p] = x >= 0 && x < width ? row[x] : neutral;
+            }
+            for (int p = 1; p < padded; p++) {
+                if (p % window) {
+                    forward[p] = is_max ? max(forward[p], forward[p - 1]) : min(forward[p], forward[p - 1]);
+                }
+            }
+            for (int p = padded - 2; p >= 0; p--) {
+                if ((p + 1) % window) {
+                    backward[p] = is_max ? max(backward[p], backward[p + 1]) : min(backward[p], backward[p + 1]);
+                }
+            }
+            #pragma omp simd
+            for (int x = 0; x < width; x++) {
+                Gray8 a = backward[x], b = forward[x + window - 1];
+                row[x] = is_max ? max(a, b) : min(a, b);
+            }
+        }
+        free(forward);
+        free(backward);
+    }
+    return failed ? -1 : 0;
+}
+
+// Function to do the same as running_extreme_rows down the columns. Whole row segments are combined
+// at once, so the inner loops run across MORPH_STRIP_WIDTH contiguous bytes and vectorize cleanly.
+static int running_extreme_columns(Gray8 *plane, int stride, int width, int height, int radius, int is_max) {
+    if (radius == 0) {
+        return 0;
+    }
+    int window = 2 * radius + 1;
+    int padded = (height + 2 * radius + window - 1) / window * window;
+    Gray8 neutral = is_max ? 0 : MAX_COLOR_VALUE;
+    int strips = (width + MORPH_STRIP_WIDTH - 1) / MORPH_STRIP_WIDTH;
+    int failed = 0;
+
+    #pragma omp parallel reduction(| : failed)
+    {
+        Gray8 *forward = malloc((size_t)padded * MORPH_STRIP_WIDTH);
+        Gray8 *backward = malloc((size_t)padded * MORPH_STRIP_WIDTH);
+        #pragma omp for schedule(dynamic)
+        for (int s = 0; s < strips; s++) {
+            int x0 = s * MORPH_STRIP_WIDTH;
+            int columns = min(MORPH_STRIP_WIDTH, width - x0);
+            if (!forward || !backward) {
+                failed = 1;
+                continue;
+            }
+            for (int p = 0; p < padded; p++) {
+                int y = p - radius;
+                Gray8 *f = forward + (size_t)p * MORPH_STRIP_WIDTH;
+                if (y >= 0 && y < height) {
+                    memcpy(f, plane + (size_t)y * stride + x0, columns);
+                } else {
+                    memset(f, neutral, columns);
+                }
+                memcpy(backward + (size_t)p * MORPH_STRIP_WIDTH, f, columns);
+            }
+            for (int p = 1; p < padded; p++) {
+                if (p % window) {
+                    Gray8 *f = forward + (size_t)p * MORPH_STRIP_WIDTH;
+                    const Gray8 *previous = f - MORPH_STRIP_WIDTH;
+                    #pragma omp simd
+                    for (int c = 0; c < columns; c++) {
+                        f[c] = is_max ? max(f[c], previous[c]) : min(f[c], previous[c]);
+                    }
+                }
+            }
+            for (int p = padded - 2; p >= 0; p--) {
+                if ((p + 1) % window) {
+                    Gray8 *b = backward + (size_t)p * MORPH_STRIP_WIDTH;
+                    const Gray8 *next = b + MORPH_STRIP_WIDTH;
+                    #pragma omp simd
+                    for (int c = 0; c < columns; c++) {
+                        b[c] = is_max ? max(b[c], next[c]) : min(b[c], next[c]);
+                    }
+                }
+            }
+            for (int y = 0; y < height; y++) {
+                const Gray8 *b = backward + (size_t)y * MORPH_STRIP_WIDTH;
+                const Gray8 *f = forward + (size_t)(y + window - 1) * MORPH_STRIP_WIDTH;
+                Gray8 *row = plane + (size_t)y * stride + x0;
+                #pragma omp simd
+                for (int c = 0; c < columns; c++) {
+                    row[c] = is_max ? max(b[c], f[c]) : min(b[c], f[c]);
+                }
+            }
+        }
+        free(forward);
+        free(backward);
+    }
+    return failed ? -1 : 0;
+}
+
+// Function to erode (is_max = 0) or dilate (is_max = 1) a plane with a rectangle, one axis at a time;
+// returns -1 when a thread could not allocate its running extremes
+static int erode_dilate_plane(Gray8 *plane, int stride, int width, int height, int radius_x, int radius_y, int is_max) {
+    if (running_extreme_rows(plane, stride, width, height, radius_x, is_max) != 0 ||
+        running_extreme_columns(plane, stride, width, height, radius_y, is_max) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to apply a morphology operation to one channel of the pixels in area. The channel is read
+// at base + pixel_step * x + row_step * y; the work is done on a copy of area grown by twice the
+// radii (enough for open and close), and only area (and the mask) is written back. Returns -1 when memory
+// runs out, with the channel left as it was.
+static int morphology_channel(unsigned char *base, int pixel_step, size_t row_step, int width, int height,
+                               Rect area, Gray8 **mask, int kind, int radius_x, int radius_y) {
+    // A window wider than the image sees the same pixels as one just as wide
+    radius_x = min(radius_x, width);
+    radius_y = min(radius_y, height);
+
+    Rect crop;
+    crop.x = (int)max(0LL, (long long)area.x - 2LL * radius_x);
+    crop.y = (int)max(0LL, (long long)area.y - 2LL * radius_y);
+    crop.width = (int)min((long long)width, (long long)area.x + area.width + 2LL * radius_x) - crop.x;
+    crop.height = (int)min((long long)height, (long long)area.y + area.height + 2LL * radius_y) - crop.y;
+
+    size_t size = (size_t)crop.width * crop.height;
+    Gray8 *plane = malloc(size);
+    Gray8 *scratch = kind == MORPH_GRADIENT ? malloc(size) : NULL;
+    if (!plane || (kind == MORPH_GRADIENT && !scratch)) {
+        printf("Memory allocation failed for morphology.\n");
+        free(plane);
+        free(scratch);
+        return -1;
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < crop.height; i++) {
+        const unsigned char *source = base + (size_t)(crop.y + i) * row_step + (size_t)crop.x * pixel_step;
+        Gray8 *row = plane + (size_t)i * crop.width;
+        for (int j = 0; j < crop.width; j++) {
+            row[j] = source[(size_t)j * pixel_step];
+        }
+    }
+
+    int failed = 0;
+    switch (kind) {
+        case MORPH_ERODE:
+        case MORPH_DILATE:
+            failed = erode_dilate_plane(plane, crop.width, crop.width, crop.height, radius_x, radius_y, kind == MORPH_DILATE);
+            break;
+        case MORPH_OPEN:
+        case MORPH_CLOSE:
+            failed = erode_dilate_plane(plane, crop.width, crop.width, crop.height, radius_x, radius_y, kind == MORPH_CLOSE) ||
+                     erode_dilate_plane(plane, crop.width, crop.width, crop.height, radius_x, radius_y, kind == MORPH_OPEN);
+            break;
+        case MORPH_GRADIENT:
+            memcpy(scratch, plane, size);
+            failed = erode_dilate_plane(plane, crop.width, crop.width, crop.height, radius_x, radius_y, 1) ||
+                     erode_dilate_plane(scratch, crop.width, crop.width, crop.height, radius_x, radius_y, 0);
+            #pragma omp parallel for simd
+            for (size_t k = 0; k < size; k++) {
+                plane[k] = (Gray8)(plane[k] - scratch[k]);
+            }
+            break;
+    }
+    if (failed) {
+        printf("Memory allocation failed for morphology rows.\n");
+        free(plane);
+        free(scratch);
+        return -1;
+    }
+
+    #pragma omp parallel for
+    for (int i = area.y; i < area.y + area.height; i++) {
+        unsigned char *target = base + (size_t)i * row_step;
+        const Gray8 *row = plane + (size_t)(i - crop.y) * crop.width - crop.x;
+        const Gray8 *mask_row = mask ? mask[i] : NULL;
+        for (int j = area.x; j < area.x + area.width; j++) {
+            if (!mask_row || mask_row[j]) {
+                target[(size_t)j * pixel_step] = row[j];
+            }
+        }
+    }
+
+    free(plane);
+    free(scratch);
+    return 0;
+}
+
+// Function to apply erode, dilate, open, close or gradient to a region of an RGB image, channel by channel;
+// returns -1 on failure
+int morphology_image_region(Pixel **image, int width, int height, int kind, int radius_x, int radius_y, const Region *region) {
+    printf("Applying morphology (%d x %d)...\n", 2 * radius_x + 1, 2 * radius_y + 1);
+    Rect area = clip_region(region, width, height);
+    if (area.width <= 0 || area.height <= 0) {
+        return 0;
+    }
+    ImageView view = view_of_image(image, width, height);
+    unsigned char *base = view.base;
+    size_t row_step = view.stride;
+    Gray8 **mask = region ? region->mask : NULL;
+    if (morphology_channel(base + offsetof(Pixel, r), sizeof(Pixel), row_step, width, height, area, mask, kind, radius_x, radius_y) != 0 ||
+        morphology_channel(base + offsetof(Pixel, g), sizeof(Pixel), row_step, width, height, area, mask, kind, radius_x, radius_y) != 0 ||
+        morphology_channel(base + offsetof(Pixel, b), sizeof(Pixel), row_step, width, height, area, mask, kind, radius_x, radius_y) != 0) {
+        return -1;
+    }
+    printf("Morphology applied successfully.\n");
+    return 0;
+}
+
+// Function to apply erode, dilate, open, close or gradient to a region of a Gray8 image; returns -1 on failure
+int morphology_gray_region(Gray8 **image, int width, int height, int kind, int radius_x, int radius_y, const Region *region) {
+    printf("Applying morphology (%d x %d)...\n", 2 * radius_x + 1, 2 * radius_y + 1);
+    Rect area = clip_region(region, width, height);
+    if (area.width <= 0 || area.height <= 0) {
+        return 0;
+    }
+    ImageView view = view_of_gray_image(image, width, height);
+    if (morphology_channel(view.base, 1, view.stride, width, height, area, region ? region->mask : NULL, kind, radius_x, radius_y) != 0) {
+        return -1;
+    }
+    printf("Morphology applied successfully.\n");
+    return 0;
+}
+
+// Function to load a convolution kernel from a text file: the width and height, then the weights
+// row by row. Kernels whose weights sum to a non-zero value are normalized to sum to one.
+float *load_convolution_kernel(const char *file_name, int *kernel_width, int *kernel_height) {
+    FILE *file = fopen(file_name, "r");
+    if (!file) {
+        printf("Error opening the kernel file %s\n", file_name);
+        return NULL;
+    }
+
+    if (fscanf(file, "%d %d", kernel_width, kernel_height) != 2 || *kernel_width <= 0 || *kernel_height <= 0 ||
+        *kernel_width > CONVOLVE_MAX_KERNEL || *kernel_height > CONVOLVE_MAX_KERNEL) {
+        printf("Invalid kernel size in %s\n", file_name);
+        fclose(file);
+        return NULL;
+    }
+
+    size_t taps = (size_t)*kernel_width * *kernel_height;
+    float *kernel = malloc(taps * sizeof(float));
+    if (!kernel) {
+        printf("Memory allocation failed for kernel.\n");
+        fclose(file);
+        return NULL;
+    }
+
+    double sum = 0;
+    for (size_t k = 0; k < taps; k++) {
+        if (fscanf(file, "%f", &kernel[k]) != 1) {
+            printf("Kernel file %s has fewer than %zu weights.\n", file_name, taps);
+            free(kernel);
+            fclose(file);
+            return NULL;
+        }
+        sum += kernel[k];
+    }
+    fclose(file);
+
+    if (fabs(sum) > 1e-9) {
+        for (size_t k = 0; k < taps; k++) {
+            kernel[k] = (float)(kernel[k] / sum);
+        }
+    }
+    return kernel;
+}
+
+// Structure to represent a complex number for the FFT
+typedef struct {
+    float re, im;
+} FftComplex;
+
+// Structure holding the bit-reversal table and twiddle factors of one radix-2 FFT size
+typedef struct {
+    int size;
+    int *reverse;
+    FftComplex *twiddles; // exp(-2 pi i k / size) for k < size / 2
+} FftPlan;
+
+// Function to prepare an FFT of a power-of-two size
+static FftPlan *create_fft_plan(int size) {
+    FftPlan *plan = malloc(sizeof(FftPlan));
+    if (!plan) {
+        return NULL;
+    }
+    plan->size = size;
+    plan->reverse = malloc(size * sizeof(int));
+    plan->twiddles = malloc(size / 2 * sizeof(FftComplex));
+    if (!plan->reverse || !plan->twiddles) {
+        free(plan->reverse);
+        free(plan->twiddles);
+        free(plan);
+        return NULL;
+    }
+
+    int bits = 0;
+    while ((1 << bits) < size) {
+        bits++;
+    }
+    for (int k = 0; k < size; k++) {
+        int reversed = 0;
+        for (int b = 0; b < bits; b++) {
+            reversed |= ((k >> b) & 1) << (bits - 1 - b);
+        }
+        plan->reverse[k] = reversed;
+    }
+    for (int k = 0; k < size / 2; k++) {
+        double angle = -2 * M_PI * k / size;
+        plan->twiddles[k].re = (float)cos(angle);
+        plan->twiddles[k].im = (float)sin(angle);
+    }
+    return plan;
+}
+
+// Function to free an FFT plan
+static void free_fft_plan(FftPlan *plan) {
+    if (!plan) {
+        return;
+    }
+    free(plan->reverse);
+    free(plan->twiddles);
+    free(plan);
+}
+
+// Function to run an in-place iterative radix-2 FFT (inverse when inverse is set, without the 1/n scale)
+static void fft_transform(const FftPlan *plan, FftComplex *data, int inverse) {
+    int n = plan->size;
+    for (int k = 0; k < n; k++) {
+        int r = plan->reverse[k];
+        if (r > k) {
+            FftComplex swap = data[k];
+            data[k] = data[r];
+            data[r] = swap;
+        }
+    }
+
+    float sign = inverse ? -1.0f : 1.0f;
+    for (int length = 2; length <= n; length *= 2) {
+        int half = length / 2;
+        int step = n / length;
+        for (int start = 0; start < n; start += length) {
+            FftComplex *a = data + start;
+            FftComplex *b = a + half;
+            for (int k = 0; k < half; k++) {
+                FftComplex w = plan->twiddles[k * step];
+                float w_im = sign * w.im;
+                float re = b[k].re * w.re - b[k].im * w_im;
+                float im = b[k].re * w_im + b[k].im * w.re;
+                b[k].re = a[k].re - re;
+                b[k].im = a[k].im - im;
+                a[k].re += re;
+                a[k].im += im;
+            }
+        }
+    }
+}
+
+// Function to run a 2D FFT over an n x n block: every row, then every column through a scratch line
+static void fft_transform_2d(const FftPlan *plan, FftComplex *data, FftComplex *column, int inverse) {
+    int n = plan->size;
+    for (int i = 0; i < n; i++) {
+        fft_transform(plan, data + (size_t)i * n, inverse);
+    }
+    for (int j = 0; j < n; j++) {
+        for (int i = 0; i < n; i++) {
+            column[i] = data[(size_t)i * n + j];
+        }
+        fft_transform(plan, column, inverse);
+        for (int i = 0; i < n; i++) {
+            data[(size_t)i * n + j] = column[i];
+        }
+    }
+}
+
+// Function to estimate the work per output pixel of the FFT path with tiles of fft_size squared
+static double fft_convolution_cost(int fft_size, int kernel_width, int kernel_height, int channels) {
+    int block_width = fft_size - kernel_width + 1;
+    int block_height = fft_size - kernel_height + 1;
+    double log_size = log2(fft_size);
+    double per_tile = 2 * 5.0 * fft_size * fft_size * log_size * 2 + 6.0 * fft_size * fft_size;
+    int pairs = (channels + 1) / 2; // Two real channels share one complex transform
+    return pairs * per_tile / ((double)block_width * block_height);
+}
+
+// Function to convolve directly: every output pixel sums kernel_width x kernel_height taps.
+// Edge pixels are replicated; source rows are copied into a padded float line so the tap loop is branch-free.
+// Returns -1 when a thread cannot allocate its lines.
+static int convolve_direct(const unsigned char *source, unsigned char *target, int channels, int pixel_step, size_t row_step,
+                           int width, int height, const float *kernel, int kernel_width, int kernel_height,
+                           Rect area, Gray8 **mask) {
+    int center_x = kernel_width / 2, center_y = kernel_height / 2;
+    int line_length = area.width + kernel_width - 1;
+    int failed = 0;
+
+    #pragma omp parallel reduction(| : failed)
+    {
+        float *line = malloc((size_t)line_length * sizeof(float));
+        float *sum = malloc((size_t)area.width * sizeof(float));
+        #pragma omp for
+        for (int i = area.y; i < area.y + area.height; i++) {
+            if (!line || !sum) {
+                failed = 1;
+                continue;
+            }
+            const Gray8 *mask_row = mask ? mask[i] : NULL;
+            for (int c = 0; c < channels; c++) {
+                memset(sum, 0, (size_t)area.width * sizeof(float));
+                for (int ky = 0; ky < kernel_height; ky++) {
+                    const unsigned char *row = source + (size_t)min(max(i + ky - center_y, 0), height - 1) * row_step + c;
+                    for (int p = 0; p < line_length; p++) {
+                        line[p] = row[(size_t)min(max(area.x + p - center_x, 0), width - 1) * pixel_step];
+                    }
+                    for (int kx = 0; kx < kernel_width; kx++) {
+                        float weight = kernel[ky * kernel_width + kx];
+                        const float *shifted = line + kx;
+                        #pragma omp simd
+                        for (int j = 0; j < area.width; j++) {
+                            sum[j] += weight * shifted[j];
+                        }
+                    }
+                }
+                unsigned char *out = target + (size_t)i * row_step + c;
+                for (int j = 0; j < area.width; j++) {
+                    if (!mask_row || mask_row[area.x + j]) {
+                        out[(size_t)(area.x + j) * pixel_step] = (unsigned char)fminf(fmaxf(sum[j] + 0.5f, 0), MAX_COLOR_VALUE);
+                    }
+                }
+            }
+        }
+        free(line);
+        free(sum);
+    }
+    if (failed) {
+        printf("Memory allocation failed for convolution lines.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to convolve with FFTs using overlap-add. The input that area depends on (area grown by the
+// kernel, with edge pixels replicated) is cut into blocks; each block is zero-padded to fft_size squared,
+// transformed, multiplied by the kernel spectrum and transformed back, and its full result is added
+// into an accumulator. Blocks are processed one band of rows at a time, so the accumulator only holds
+// one band plus the kernel overlap. Within a band, even and odd blocks alternate so that the blocks
+// running in parallel never add to the same pixels. Two channels share each complex transform (one as
+// the real part, one as the imaginary part), since the kernel is real.
+static int convolve_fft(const unsigned char *source, unsigned char *target, int channels, int pixel_step, size_t row_step,
+                        int width, int height, const float *kernel, int kernel_width, int kernel_height,
+                        Rect area, Gray8 **mask, int fft_size) {
+    int block_width = fft_size - kernel_width + 1;
+    int block_height = fft_size - kernel_height + 1;
+    int center_x = kernel_width / 2, center_y = kernel_height / 2;
+    int input_x = area.x - center_x;
+    int input_y = area.y - center_y;
+    int input_width = area.width + kernel_width - 1;
+    int input_height = area.height + kernel_height - 1;
+    int blocks_x = (input_width + block_width - 1) / block_width;
+    int bands = (input_height + block_height - 1) / block_height;
+    int pairs = (channels + 1) / 2;
+    size_t block_size = (size_t)fft_size * fft_size;
+    int accumulator_rows = block_height + kernel_height - 1;
+    size_t accumulator_plane = (size_t)accumulator_rows * area.width;
+
+    FftPlan *plan = create_fft_plan(fft_size);
+    FftComplex *spectrum = malloc(block_size * sizeof(FftComplex));
+    FftComplex *column = malloc(fft_size * sizeof(FftComplex));
+    float *accumulator = calloc(accumulator_plane * channels, sizeof(float));
+    if (!plan || !spectrum || !column || !accumulator) {
+        printf("Memory allocation failed for FFT convolution.\n");
+        free_fft_plan(plan);
+        free(spectrum);
+        free(column);
+        free(accumulator);
+        return -1;
+    }
+
+    // Kernel spectrum, flipped so that the result matches the direct (correlation) path
+    memset(spectrum, 0, block_size * sizeof(FftComplex));
+    for (int ky = 0; ky < kernel_height; ky++) {
+        for (int kx = 0; kx < kernel_width; kx++) {
+            spectrum[(size_t)ky * fft_size + kx].re = kernel[(kernel_height - 1 - ky) * kernel_width + (kernel_width - 1 - kx)];
+        }
+    }
+    fft_transform_2d(plan, spectrum, column, 0);
+    free(column);
+    float scale = 1.0f / ((float)fft_size * fft_size);
+    int failed = 0;
+
+    for (int band = 0; band < bands; band++) {
+        // Output rows of this band's accumulator start kernel_height - 1 rows above the band
+        int first_row = band * block_height - (kernel_height - 1);
+
+        for (int parity = 0; parity < 2; parity++) {
+            #pragma omp parallel reduction(| : failed)
+            {
+                FftComplex *work = malloc(block_size * pairs * sizeof(FftComplex));
+                FftComplex *line = malloc(fft_size * sizeof(FftComplex));
+                #pragma omp for schedule(dynamic)
+                for (int bx = parity; bx < blocks_x; bx += 2) {
+                    if (!work || !line) {
+                        failed = 1; // The block would be missing from the result
+                        continue;
+                    }
+                    int rows = min(block_height, input_height - band * block_height);
+                    int columns = min(block_width, input_width - bx * block_width);
+                    for (int p = 0; p < pairs; p++) {
+                        FftComplex *data = work + p * block_size;
+                        memset(data, 0, block_size * sizeof(FftComplex));
+                        for (int u = 0; u < rows; u++) {
+                            int y = min(max(input_y + band * block_height + u, 0), height - 1);
+                            const unsigned char *row = source + (size_t)y * row_step;
+                            for (int v = 0; v < columns; v++) {
+                                int x = min(max(input_x + bx * block_width + v, 0), width - 1);
+                                const unsigned char *pixel = row + (size_t)x * pixel_step;
+                                data[(size_t)u * fft_size + v].re = pixel[2 * p];
+                                data[(size_t)u * fft_size + v].im = 2 * p + 1 < channels ? pixel[2 * p + 1] : 0;
+                            }
+                        }
+                        fft_transform_2d(plan, data, line, 0);
+                        #pragma omp simd
+                        for (size_t k = 0; k < block_size; k++) {
+                            float re = data[k].re * spectrum[k].re - data[k].im * spectrum[k].im;
+                            float im = data[k].re * spectrum[k].im + data[k].im * spectrum[k].re;
+                            data[k].re = re;
+                            data[k].im = im;
+                        }
+                        fft_transform_2d(plan, data, line, 1);
+
+                        // Block result (u, v) lands on output (first_row + u, bx * block_width + v - kernel_width + 1)
+                        for (int u = 0; u < rows + kernel_height - 1; u++) {
+                            float *real_row = accumulator + (size_t)(2 * p) * accumulator_plane + (size_t)u * area.width;
+                            float *imag_row = accumulator + (size_t)(2 * p + 1) * accumulator_plane + (size_t)u * area.width;
+                            for (int v = 0; v < columns + kernel_width - 1; v++) {
+                                int x = bx * block_width + v - (kernel_width - 1);
+                                if (x < 0 || x >= area.width) {
+                                    continue;
+                                }
+                                real_row[x] += data[(size_t)u * fft_size + v].re * scale;
+                                if (2 * p + 1 < channels) {
+                                    imag_row[x] += data[(size_t)u * fft_size + v].im * scale;
+                                }
+                            }
+                        }
+                    }
+                }
+                free(work);
+                free(line);
+            }
+        }
+        if (failed) {
+            printf("Memory allocation failed for FFT convolution blocks.\n");
+            break;
+        }
+
+        // Rows no later band adds to are final: write them out and slide the overlap to the top
+        int final_rows = band == bands - 1 ? accumulator_rows : block_height;
+        #pragma omp parallel for
+        for (int u = 0; u < final_rows; u++) {
+            int y = first_row + u;
+            if (y < 0 || y >= area.height) {
+                continue;
+            }
+            const Gray8 *mask_row = mask ? mask[area.y + y] : NULL;
+            unsigned char *out = target + (size_t)(area.y + y) * row_step;
+            for (int c = 0; c < channels; c++) {
+                const float *sum = accumulator + (size_t)c * accumulator_plane + (size_t)u * area.width;
+                for (int x = 0; x < area.width; x++) {
+                    if (!mask_row || mask_row[area.x + x]) {
+                        out[(size_t)(area.x + x) * pixel_step + c] = (unsigned char)fminf(fmaxf(sum[x] + 0.5f, 0), MAX_COLOR_VALUE);
+                    }
+                }
+            }
+        }
+        for (int c = 0; c < channels; c++) {
+            float *plane = accumulator + (size_t)c * accumulator_plane;
+            memmove(plane, plane + (size_t)block_height * area.width, (size_t)(kernel_height - 1) * area.width * sizeof(float));
+            memset(plane + (size_t)(kernel_height - 1) * area.width, 0, (size_t)block_height * area.width * sizeof(float));
+        }
+    }
+
+    free_fft_plan(plan);
+    free(spectrum);
+    free(accumulator);
+    return failed ? -1 : 0;
+}
+
+// Function to convolve a region of a view with an arbitrary kernel. Small kernels are applied directly;
+// larger ones go through FFT overlap-add with the tile size the cost estimate finds cheapest.
+// Returns -1 when the buffers cannot be allocated.
+int convolve_region(const ImageView *view, const float *kernel, int kernel_width, int kernel_height, const Region *region) {
+    unsigned char *base = view->base;
+    int channels = view->channels, pixel_step = view->channels;
+    int width = view->width, height = view->height;
+    size_t row_step = view->stride;
+    Rect area = clip_region(region, width, height);
+    if (area.width <= 0 || area.height <= 0) {
+        return 0;
+    }
+
+    // Blocks need to be at least as large as the kernel so that only neighbouring blocks overlap
+    int best_size = 0;
+    double best_cost = 2.0 * channels * kernel_width * kernel_height / CONVOLVE_DIRECT_SPEEDUP;
+    for (int size = CONVOLVE_MIN_FFT; size <= CONVOLVE_MAX_FFT; size *= 2) {
+        if (size < 2 * max(kernel_width, kernel_height)) {
+            continue;
+        }
+        double cost = fft_convolution_cost(size, kernel_width, kernel_height, channels);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_size = size;
+        }
+    }
+
+    // The kernels read the unmodified input, laid out with the same stride, while the result is written
+    unsigned char *source = malloc(row_step * height);
+    if (!source) {
+        printf("Memory allocation failed for convolution.\n");
+        return -1;
+    }
+    for (int i = 0; i < height; i++) {
+        memcpy(source + (size_t)i * row_step, base + (size_t)i * row_step, (size_t)width * pixel_step);
+    }
+    Gray8 **mask = region ? region->mask : NULL;
+
+    if (best_size) {
+        printf("Convolving with a %d x %d kernel (FFT, %d x %d tiles)...\n", kernel_width, kernel_height, best_size, best_size);
+        if (convolve_fft(source, base, channels, pixel_step, row_step, width, height, kernel, kernel_width, kernel_height,
+                         area, mask, best_size) != 0) {
+            free(source);
+            return -1;
+        }
+    } else {
+        printf("Convolving with a %d x %d kernel (direct)...\n", kernel_width, kernel_height);
+        if (convolve_direct(source, base, channels, pixel_step, row_step, width, height, kernel, kernel_width, kernel_height,
+                            area, mask) != 0) {
+            free(source);
+            return -1;
+        }
+    }
+    free(source);
+    printf("Convolution completed.\n");
+    return 0;
+}
+
+// Function to round a value to the nearest of levels evenly spaced output levels
+static inline int quantize_level(int value, int levels) {
+    int index = (value * (levels - 1) + MAX_COLOR_VALUE / 2) / MAX_COLOR_VALUE;
+    return (index * MAX_COLOR_VALUE + (levels - 1) / 2) / (levels - 1);
+}
+
+// Function to dither an area with Floyd-Steinberg or Atkinson error diffusion. Each row only needs
+// the row above to be DITHER_LAG pixels ahead, so rows are handed to threads round robin and run as a
+// skewed wavefront: a row processes DITHER_CHUNK pixels at a time after checking the progress of the
+// row above. Errors are integers in 1/16 units; a slot of the error ring is cleared as it is read,
+// so the ring can be reused DITHER_ERROR_ROWS rows later.
+static int dither_error_diffusion(unsigned char *base, int channels, int pixel_step, size_t row_step,
+                                  Rect area, Gray8 **mask, int atkinson, int levels) {
+    int error_stride = (area.width + 4) * channels; // Two padding pixels on each side
+    int *errors = calloc((size_t)DITHER_ERROR_ROWS * error_stride, sizeof(int));
+    int *progress = calloc(area.height, sizeof(int));
+    if (!errors || !progress) {
+        printf("Memory allocation failed for dithering.\n");
+        free(errors);
+        free(progress);
+        return -1;
+    }
+
+    #pragma omp parallel for schedule(static, 1)
+    for (int y = 0; y < area.height; y++) {
+        int *current = errors + (size_t)(y % DITHER_ERROR_ROWS) * error_stride + 2 * channels;
+        int *below = errors + (size_t)((y + 1) % DITHER_ERROR_ROWS) * error_stride + 2 * channels;
+        int *below2 = errors + (size_t)((y + 2) % DITHER_ERROR_ROWS) * error_stride + 2 * channels;
+        unsigned char *row = base + (size_t)(area.y + y) * row_step + (size_t)area.x * pixel_step;
+        const Gray8 *mask_row = mask ? mask[area.y + y] + area.x : NULL;
+
+        for (int chunk = 0; chunk < area.width; chunk += DITHER_CHUNK) {
+            int chunk_end = min(chunk + DITHER_CHUNK, area.width);
+            if (y > 0) {
+                int needed = min(chunk_end + DITHER_LAG, area.width);
+                int done, spins = 0;
+                for (;;) {
+                    #pragma omp atomic read
+                    done = progress[y - 1];
+                    if (done >= needed) {
+                        break;
+                    }
+                    // Give the core away if the row above is stalled (more threads than cores)
+                    if (++spins % 1024 == 0) {
+                        SwitchToThread();
+                    } else {
+                        YieldProcessor();
+                    }
+                }
+                #pragma omp flush
+            }
+
+            for (int x = chunk; x < chunk_end; x++) {
+                unsigned char *pixel = row + (size_t)x * pixel_step;
+                int skip = mask_row && !mask_row[x];
+                for (int c = 0; c < channels; c++) {
+                    int *error = current + x * channels + c;
+                    int value = pixel[c] + ((*error + 8) >> 4);
+                    *error = 0;
+                    if (skip) {
+                        continue;
+                    }
+                    value = value < 0 ? 0 : value > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : value;
+                    int output = quantize_level(value, levels);
+                    int e = value - output;
+                    pixel[c] = (unsigned char)output;
+
+                    if (atkinson) {
+                        // 1/8 of the error to six neighbours (2/16 each); the remaining quarter is dropped
+                        current[(x + 1) * channels + c] += 2 * e;
+                        current[(x + 2) * channels + c] += 2 * e;
+                        below[(x - 1) * channels + c] += 2 * e;
+                        below[x * channels + c] += 2 * e;
+                        below[(x + 1) * channels + c] += 2 * e;
+                        below2[x * channels + c] += 2 * e;
+                    } else {
+                        current[(x + 1) * channels + c] += 7 * e;
+                        below[(x - 1) * channels + c] += 3 * e;
+                        below[x * channels + c] += 5 * e;
+                        below[(x + 1) * channels + c] += e;
+                    }
+                }
+            }
+
+            #pragma omp flush
+            #pragma omp atomic write
+            progress[y] = chunk_end;
+        }
+    }
+
+    free(errors);
+    free(progress);
+    return 0;
+}
+
+// Function to dither an area with an 8x8 Bayer threshold matrix; every pixel is independent
+static void dither_ordered(unsigned char *base, int channels, int pixel_step, size_t row_step,
+                           Rect area, Gray8 **mask, int levels) {
+    static const int bayer[8][8] = {
+        {0, 32, 8, 40, 2, 34, 10, 42}, {48, 16, 56, 24, 50, 18, 58, 26},
+        {12, 44, 4, 36, 14, 46, 6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+        {3, 35, 11, 43, 1, 33, 9, 41}, {51, 19, 59, 27, 49, 17, 57, 25},
+        {15, 47, 7, 39, 13, 45, 5, 37}, {63, 31, 55, 23, 61, 29, 53, 21},
+    };
+    // Threshold offsets spread over one output step, centered on zero
+    int offsets[8][8];
+    double step = (double)MAX_COLOR_VALUE / (levels - 1);
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            offsets[i][j] = (int)lround(((bayer[i][j] + 0.5) / 64 - 0.5) * step);
+        }
+    }
+
+    #pragma omp parallel for
+    for (int i = area.y; i < area.y + area.height; i++) {
+        unsigned char *row = base + (size_t)i * row_step;
+        const Gray8 *mask_row = mask ? mask[i] : NULL;
+        const int *offset_row = offsets[i & 7];
+        for (int j = area.x; j < area.x + area.width; j++) {
+            if (mask_row && !mask_row[j]) {
+                continue;
+            }
+            unsigned char *pixel = row + (size_t)j * pixel_step;
+            for (int c = 0; c < channels; c++) {
+                int value = pixel[c] + offset_row[j & 7];
+                value = value < 0 ? 0 : value > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : value;
+                pixel[c] = (unsigned char)quantize_level(value, levels);
+            }
+        }
+    }
+}
+
+// Function to reduce a region of a view to levels values per channel with the given dithering method;
+// returns -1 when error diffusion cannot allocate its buffers
+int dither_region(const ImageView *view, int method, int levels, const Region *region) {
+    static const char *method_names[] = {"Floyd-Steinberg", "Atkinson", "Bayer"};
+    printf("Dithering to %d levels (%s)...\n", levels, method_names[method]);
+    unsigned char *base = view->base;
+    int channels = view->channels, pixel_step = view->channels;
+    size_t row_step = view->stride;
+    Rect area = clip_region(region, view->width, view->height);
+    if (area.width <= 0 || area.height <= 0) {
+        return 0;
+    }
+    Gray8 **mask = region ? region->mask : NULL;
+    if (method == DITHER_BAYER) {
+        dither_ordered(base, channels, pixel_step, row_step, area, mask, levels);
+    } else if (dither_error_diffusion(base, channels, pixel_step, row_step, area, mask, method == DITHER_ATKINSON, levels) != 0) {
+        return -1;
+    }
+    printf("Dithering completed.\n");
+    return 0;
+}
+
+// Function to composite an overlay with per-pixel alpha onto an image, its top-left corner at (rect.x, rect.y).
+// Only the rows and columns of the overlay rectangle that fall inside the image are visited.
+void overlay_region(Pixel **image, int width, int height, Pixel **overlay, Gray8 **alpha, Rect rect) {
+    printf("Compositing a %d x %d overlay at (%d, %d)...\n", rect.width, rect.height, rect.x, rect.y);
+    Region region = {rect, NULL, 0, 0};
+    Rect area = clip_region(&region, width, height);
+
+    #pragma omp parallel for
+    for (int i = area.y; i < area.y + area.height; i++) {
+        unsigned char *row = (unsigned char *)(image[i] + area.x);
+        const unsigned char *over = (const unsigned char *)(overlay[i - rect.y] + (area.x - rect.x));
+        const Gray8 *opacity = alpha[i - rect.y] + (area.x - rect.x);
+        #pragma omp simd
+        for (int j = 0; j < area.width * 3; j++) {
+            row[j] = (unsigned char)blend_channel(row[j], over[j], opacity[j / 3]);
+        }
+    }
+    printf("Overlay completed.\n");
+}
+
+// Function to release the buffers held by a chain image
+void free_chain_image(ChainImage *image) {
+    free_image(image->rgb);
+    free_gray_image(image->gray);
+    free(image->parent);
+    image->rgb = NULL;
+    image->gray = NULL;
+    image->parent = NULL;
+}
+
+// Function to give a chain image a new buffer of its own. The old rows go, and so does the parent of a
+// cropped view, so a set parent always means the current rows are a view into it.
+void replace_chain_pixels(ChainImage *image, Pixel **rgb, Gray8 **gray) {
+    free_image(image->rgb);
+    free_gray_image(image->gray);
+    free(image->parent);
+    image->rgb = rgb;
+    image->gray = gray;
+    image->parent = NULL;
+}
+
+// Function to describe the current pixels of a chain image as a view
+ImageView chain_image_view(const ChainImage *image) {
+    return image->gray ? view_of_gray_image(image->gray, image->width, image->height)
+                       : view_of_image(image->rgb, image->width, image->height);
+}
+
+// Function to crop a chain image without copying: the image becomes a view into its current buffer,
+// which is kept as the parent until the chain image is freed
+int crop_chain_image(ChainImage *image, Rect rect) {
+    ImageView view = crop_view(chain_image_view(image), rect);
+    if (view.width <= 0 || view.height <= 0) {
+        printf("Crop %d x %d at (%d, %d) lies outside the %d x %d image.\n",
+               rect.width, rect.height, rect.x, rect.y, image->width, image->height);
+        return -1;
+    }
+
+    void *rows = image->gray ? (void *)gray_image_from_view(&view) : (void *)image_from_view(&view);
+    if (!rows) {
+        return -1;
+    }
+    void *current = image->gray ? (void *)image->gray : (void *)image->rgb;
+    if (image->parent) {
+        free(current); // Already a view, only its row array goes
+    } else {
+        image->parent = current;
+    }
+    if (image->gray) {
+        image->gray = rows;
+    } else {
+        image->rgb = rows;
+    }
+    printf("Cropped to %d x %d at (%d, %d) without copying.\n", view.width, view.height, max(rect.x, 0), max(rect.y, 0));
+    image->width = view.width;
+    image->height = view.height;
+    return 0;
+}
+
+// Function to compose two orientation tags: the result shows the image as first, then second, would.
+// A transpose in first swaps the roles of second's mirrors, since they act on the swapped axes.
+int compose_orientation(int first, int second) {
+    int transposed = (first ^ second) & ORIENT_TRANSPOSE;
+    int mirror_x = (first & ORIENT_TRANSPOSE) ? (second & ORIENT_MIRROR_Y) != 0 : (second & ORIENT_MIRROR_X) != 0;
+    int mirror_y = (first & ORIENT_TRANSPOSE) ? (second & ORIENT_MIRROR_X) != 0 : (second & ORIENT_MIRROR_Y) != 0;
+    return transposed | ((first & ORIENT_MIRROR_X) ^ mirror_x) | ((first & ORIENT_MIRROR_Y) ^ (mirror_y << 1));
+}
+
+// Function to find the stored coordinates shown at (x, y) under an orientation, for a width x height store
+static inline void orientation_map(int orientation, long long width, long long height, long long x, long long y,
+                                   long long *stored_x, long long *stored_y) {
+    long long swapped_x = orientation & ORIENT_TRANSPOSE ? y : x;
+    long long swapped_y = orientation & ORIENT_TRANSPOSE ? x : y;
+    *stored_x = orientation & ORIENT_MIRROR_X ? width - 1 - swapped_x : swapped_x;
+    *stored_y = orientation & ORIENT_MIRROR_Y ? height - 1 - swapped_y : swapped_y;
+}
+
+// Function to map a rectangle of the oriented image to the stored pixels of a width x height store
+static Rect orient_rect(int orientation, int width, int height, Rect rect) {
+    long long x0, y0, x1, y1;
+    orientation_map(orientation, width, height, rect.x, rect.y, &x0, &y0);
+    orientation_map(orientation, width, height, (long long)rect.x + rect.width - 1, (long long)rect.y + rect.height - 1, &x1, &y1);
+    long long left = x0 < x1 ? x0 : x1, top = y0 < y1 ? y0 : y1;
+    left = left < INT_MIN ? INT_MIN : left > INT_MAX ? INT_MAX : left;
+    top = top < INT_MIN ? INT_MIN : top > INT_MAX ? INT_MAX : top;
+    Rect stored = {(int)left, (int)top, orientation & ORIENT_TRANSPOSE ? rect.height : rect.width,
+                   orientation & ORIENT_TRANSPOSE ? rect.width : rect.height};
+    return stored;
+}
+
+// Function to write a view in its oriented layout into a target view of the oriented size.
+// Pixels are gathered in tiles so transposing reads stay within a few cache lines per row.
+void orient_view(const ImageView *source, int orientation, const ImageView *target) {
+    long long x0, y0, x1, y1, x2, y2;
+    orientation_map(orientation, source->width, source->height, 0, 0, &x0, &y0);
+    orientation_map(orientation, source->width, source->height, 1, 0, &x1, &y1);
+    orientation_map(orientation, source->width, source->height, 0, 1, &x2, &y2);
+    int channels = source->channels;
+    const unsigned char *origin = source->base + y0 * (ptrdiff_t)source->stride + x0 * channels;
+    ptrdiff_t step_x = (y1 - y0) * (ptrdiff_t)source->stride + (x1 - x0) * channels;
+    ptrdiff_t step_y = (y2 - y0) * (ptrdiff_t)source->stride + (x2 - x0) * channels;
+
+    int tiles_x = (target->width + ORIENT_TILE_SIZE - 1) / ORIENT_TILE_SIZE;
+    int tiles_y = (target->height + ORIENT_TILE_SIZE - 1) / ORIENT_TILE_SIZE;
+    #pragma omp parallel for collapse(2)
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            int right = min(target->width, (tx + 1) * ORIENT_TILE_SIZE);
+            int bottom = min(target->height, (ty + 1) * ORIENT_TILE_SIZE);
+            for (int i = ty * ORIENT_TILE_SIZE; i < bottom; i++) {
+                unsigned char *out = target->base + (size_t)i * target->stride;
+                const unsigned char *in = origin + i * step_y;
+                for (int j = tx * ORIENT_TILE_SIZE; j < right; j++) {
+                    const unsigned char *pixel = in + j * step_x;
+                    for (int c = 0; c < channels; c++) {
+                        out[j * channels + c] = pixel[c];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Function to express an operation on the stored pixels of an image with a pending orientation, mapping
+// its rectangles (and swapping the morphology radii when the axes are swapped). Returns 0 when the operation
+// depends on the layout (masks, kernels, scan order, overlays, colored edge directions) and needs it resolved.
+int orient_operation(const Operation *operation, const ChainImage *image, Operation *oriented) {
+    switch (operation->type) {
+        case OP_ROTATE:
+        case OP_ORIENT:
+        case OP_CONVOLVE:
+        case OP_DITHER:
+        case OP_OVERLAY:
+            return 0;
+        case OP_EDGES:
+            if (operation->edge_orientation) {
+                return 0;
+            }
+            break;
+        default:
+            break;
+    }
+    if (operation->has_region && operation->region.mask) {
+        return 0;
+    }
+
+    *oriented = *operation;
+    if (operation->has_region) {
+        oriented->region.rect = orient_rect(image->orientation, image->width, image->height, operation->region.rect);
+    }
+    if (operation->type == OP_CROP) {
+        oriented->crop = orient_rect(image->orientation, image->width, image->height, operation->crop);
+    }
+    if (operation->type == OP_MORPHOLOGY && (image->orientation & ORIENT_TRANSPOSE)) {
+        oriented->radius = operation->radius_y;
+        oriented->radius_y = operation->radius;
+    }
+    return 1;
+}
+
+// Function to give a chain image the physical layout of its pending orientation.
+// Packed images are reordered in place in low-memory mode or when a second buffer cannot be allocated;
+// crop views always go through a copy since their rows are not packed.
+int resolve_chain_orientation(ChainImage *image) {
+    if (!image->orientation) {
+        return 0;
+    }
+    int transposed = image->orientation & ORIENT_TRANSPOSE;
+    int width = transposed ? image->height : image->width;
+    int height = transposed ? image->width : image->height;
+    printf("Applying the pending orientation (%d x %d)...\n", width, height);
+
+    void *current = image->gray ? (void *)image->gray : (void *)image->rgb;
+    int element = image->gray ? sizeof(Gray8) : sizeof(Pixel);
+    void *oriented = NULL;
+    if (!low_memory_mode || image->parent) {
+        oriented = image->gray ? (void *)allocate_gray_image(width, height) : (void *)allocate_image(width, height);
+    }
+    if (oriented) {
+        ImageView source = chain_image_view(image);
+        ImageView target = image->gray ? view_of_gray_image(oriented, width, height) : view_of_image(oriented, width, height);
+        orient_view(&source, image->orientation, &target);
+        free(current);
+        free(image->parent); // A cropped view now has a buffer of its own
+        image->parent = NULL;
+    } else if (!image->parent) {
+        orient_image_in_place(current, element, &image->width, &image->height, image->orientation);
+        oriented = current;
+    } else {
+        return -1;
+    }
+
+    if (image->gray) {
+        image->gray = oriented;
+    } else {
+        image->rgb = oriented;
+    }
+    image->width = width;
+    image->height = height;
+    image->orientation = 0;
+    return 0;
+}
+
+// Function to make a gray chain image RGB again (used when a regional or colored operation needs RGB)
+int promote_chain_image(ChainImage *image) {
+    if (image->rgb) {
+        return 0;
+    }
+    Pixel **rgb = allocate_image(image->width, image->height);
+    if (!rgb) {
+        return -1;
+    }
+    expand_gray_image(image->gray, rgb, image->width, image->height);
+    replace_chain_pixels(image, rgb, NULL);
+    return 0;
+}
+
+// Function to apply a chain of operations; once an operation produces gray data the image stays single-channel.
+// Operations restricted to a region leave the rest of the image untouched, so they keep RGB data as RGB.
+int apply_operation_chain(ChainImage *image, const Operation *chain, int count) {
+    // Consecutive color matrices are multiplied together so they cost a single pass
+    Operation operations[MAX_OPERATIONS];
+    count = min(count, MAX_OPERATIONS);
+    memcpy(operations, chain, count * sizeof(Operation));
+    count = plan_operation_chain(operations, count);
+
+    for (int k = 0; k < count; k++) {
+        // Rotations and flips only change the orientation tag; the pixels stay where they are
+        if (operations[k].type == OP_ROTATE || operations[k].type == OP_ORIENT) {
+            image->orientation = compose_orientation(image->orientation,
+                                                     operations[k].type == OP_ROTATE ? ORIENT_ROTATE : operations[k].orientation);
+            continue;
+        }
+
+        // Under a pending orientation, operations that do not care about the layout run on the stored pixels
+        // with their rectangles mapped; the others need the oriented layout first
+        const Operation *operation = &operations[k];
+        Operation oriented;
+        if (image->orientation) {
+            if (orient_operation(operation, image, &oriented)) {
+                operation = &oriented;
+            } else if (resolve_chain_orientation(image) != 0) {
+                return -1;
+            }
+        }
+
+        const Region *region = operation->has_region ? &operation->region : NULL;
+        if (region && region->mask && (region->mask_width != image->width || region->mask_height != image->height)) {
+            printf("Mask size %d x %d does not match the image size %d x %d.\n",
+                   region->mask_width, region->mask_height, image->width, image->height);
+            return -1;
+        }
+
+        // Runs of several RGB operations are cheaper on channel planes than on packed pixels
+        if (image->rgb) {
+            const Operation *run = operations + k;
+            int run_count = count - k;
+            Operation oriented_run[MAX_OPERATIONS];
+            if (image->orientation) {
+                run = oriented_run;
+                run_count = 0;
+                while (k + run_count < count && orient_operation(&operations[k + run_count], image, &oriented_run[run_count])) {
+                    run_count++;
+                }
+            }
+            int applied = apply_planar_run(image, run, 0, run_count);
+            if (applied < 0) {
+                return -1;
+            }
+            if (applied > 0) {
+                k += applied - 1;
+                continue;
+            }
+        }
+
+        switch (operation->type) {
+            case OP_GRAYSCALE:
+            case OP_XRAY:
+                if (region && image->rgb) {
+                    if (operation->type == OP_XRAY) {
+                        generate_xray_image_region(image->rgb, image->width, image->height, region);
+                    } else {
+                        convert_to_grayscale_region(image->rgb, image->width, image->height, region);
+                    }
+                    break;
+                }
+                if (image->rgb) {
+                    Gray8 **gray = convert_to_gray8(image->rgb, image->width, image->height);
+                    if (!gray) {
+                        return -1;
+                    }
+                    replace_chain_pixels(image, NULL, gray);
+                }
+                if (operation->type == OP_XRAY) {
+                    generate_xray_gray_region(image->gray, image->width, image->height, region);
+                }
+                break;
+            case OP_NEGATIVE:
+                if (image->gray) {
+                    generate_negative_gray_region(image->gray, image->width, image->height, region);
+                } else {
+                    generate_negative_image_region(image->rgb, image->width, image->height, region);
+                }
+                break;
+            case OP_ROTATE:
+            case OP_ORIENT:
+                break; // Folded into the orientation tag above
+            case OP_AGED:
+                // The aged tint is colored, so gray input goes back to RGB through per-channel curves
+                if (image->gray && !region) {
+                    Pixel **aged = generate_aged_from_gray(image->gray, image->width, image->height);
+                    if (!aged) {
+                        return -1;
+                    }
+                    replace_chain_pixels(image, aged, NULL);
+                } else {
+                    if (promote_chain_image(image) != 0) {
+                        return -1;
+                    }
+                    generate_aged_image_region(image->rgb, image->width, image->height, region);
+                }
+                break;
+            case OP_COLOR_MATRIX:
+                if (promote_chain_image(image) != 0) {
+                    return -1;
+                }
+                apply_color_matrix_region(image->rgb, image->width, image->height, &operation->matrix, region);
+                break;
+            case OP_LUMA_CURVE:
+                // A Gray8 image is its own luminance plane
+                if (image->gray) {
+                    apply_gray_curve_region(image->gray, image->width, image->height, operation->curve, region);
+                } else if (apply_luma_curve_region(image->rgb, image->width, image->height, operation->curve, region) != 0) {
+                    return -1;
+                }
+                break;
+            case OP_HUE_SATURATION:
+                // Gray pixels have no saturation, so neither hue nor saturation changes them
+                if (image->rgb && apply_hue_saturation_region(image->rgb, image->width, image->height,
+                                                              operation->hue_shift, operation->saturation_scale, region) != 0) {
+                    return -1;
+                }
+                break;
+            case OP_MEDIAN: {
+                int failed = image->gray ? median_filter_gray_region(image->gray, image->width, image->height, operation->radius, region)
+                                         : median_filter_image_region(image->rgb, image->width, image->height, operation->radius, region);
+                if (failed) {
+                    return -1;
+                }
+                break;
+            }
+            case OP_EDGES:
+                if (apply_edge_operation(image, operation, region) != 0) {
+                    return -1;
+                }
+                break;
+            case OP_CONVOLVE: {
+                ImageView view = chain_image_view(image);
+                if (convolve_region(&view, operation->kernel, operation->kernel_width, operation->kernel_height, region) != 0) {
+                    return -1;
+                }
+                break;
+            }
+            case OP_DITHER: {
+                ImageView view = chain_image_view(image);
+                if (dither_region(&view, operation->dither_method, operation->levels, region) != 0) {
+                    return -1;
+                }
+                break;
+            }
+            case OP_CROP:
+                if (crop_chain_image(image, operation->crop) != 0) {
+                    return -1;
+                }
+                break;
+            case OP_OVERLAY:
+                // Overlays are colored, so a gray image goes back to RGB first
+                if (promote_chain_image(image) != 0) {
+                    return -1;
+                }
+                overlay_region(image->rgb, image->width, image->height, operation->overlay,
+                               operation->overlay_alpha, operation->region.rect);
+                break;
+            case OP_MORPHOLOGY: {
+                int failed = image->gray ? morphology_gray_region(image->gray, image->width, image->height, operation->morphology,
+                                                                  operation->radius, operation->radius_y, region)
+                                         : morphology_image_region(image->rgb, image->width, image->height, operation->morphology,
+                                                                   operation->radius, operation->radius_y, region);
+                if (failed) {
+                    return -1;
+                }
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to decode a P6, P5 or QOI image held in memory into a chain image
+int decode_chain_image(const unsigned char *data, size_t size, ChainImage *image) {
+    image->rgb = NULL;
+    image->gray = NULL;
+    if (size >= 4 && memcmp(data, QOI_MAGIC, 4) == 0) {
+        image->rgb = decode_qoi_buffer(data, size, &image->width, &image->height);
+    } else if (size >= 2 && data[0] == 'P' && data[1] == '5') {
+        image->gray = decode_pgm_buffer(data, size, &image->width, &image->height);
+    } else {
+        image->rgb = decode_ppm_buffer(data, size, &image->width, &image->height);
+    }
+    return image->rgb || image->gray ? 0 : -1;
+}
+
+// Function to encode a chain image as P6, or as P5 when it is gray.
+// A pending orientation is applied while the pixels are copied into the encoded buffer.
+unsigned char *encode_chain_image(const ChainImage *image, size_t *size) {
+    if (image->orientation) {
+        int transposed = image->orientation & ORIENT_TRANSPOSE;
+        ImageView source = chain_image_view(image);
+        ImageView target = {NULL, transposed ? image->height : image->width, transposed ? image->width : image->height,
+                            source.channels, 0};
+        target.stride = (size_t)target.width * target.channels;
+
+        char header[64];
+        int header_length = snprintf(header, sizeof(header), "P%c\n%d %d\n%d\n", image->gray ? '5' : '6',
+                                     target.width, target.height, MAX_COLOR_VALUE);
+        *size = header_length + target.stride * target.height;
+        unsigned char *buffer = malloc(*size);
+        if (!buffer) {
+            printf("Memory allocation failed for encoded image.\n");
+            return NULL;
+        }
+        memcpy(buffer, header, header_length);
+        target.base = buffer + header_length;
+        orient_view(&source, image->orientation, &target);
+        return buffer;
+    }
+    if (image->gray) {
+        return encode_pgm_buffer(image->gray, image->width, image->height, size);
+    }
+    return encode_ppm_buffer(image->rgb, image->width, image->height, size);
+}
+
+// Function to parse the header of a binary PNM image ("P5" or "P6"); returns the offset of the pixel data or 0 on error
+size_t parse_pnm_header(const unsigned char *data, size_t size, char type, int *width, int *height) {
+    if (size < 2 || data[0] != 'P' || data[1] != type) {
+        printf("Invalid format. Expected a P%c payload.\n", type);
+        return 0;
+    }
+
+    // Read width, height and max color, skipping whitespace and comments
+    int values[3];
+    size_t pos = 2;
+    for (int k = 0; k < 3; k++) {
+        while (pos < size && (isspace(data[pos]) || data[pos] == '#')) {
+            if (data[pos] == '#') {
+                while (pos < size && data[pos] != '\n') {
+                    pos++;
+                }
+            } else {
+                pos++;
+            }
+        }
+        if (pos >= size || !isdigit(data[pos])) {
+            printf("Error reading PNM header.\n");
+            return 0;
+        }
+        long value = 0;
+        while (pos < size && isdigit(data[pos]) && value <= 1000000) {
+            value = value * 10 + (data[pos++] - '0');
+        }
+        values[k] = (int)value;
+    }
+    pos++; // Single whitespace byte after max color
+
+    *width = values[0];
+    *height = values[1];
+    if (*width <= 0 || *height <= 0 || values[2] <= 0 || values[2] > MAX_COLOR_VALUE) {
+        printf("Invalid PNM dimensions or max color.\n");
+        return 0;
+    }
+
+    size_t pixel_bytes = (size_t)*width * *height * (type == '6' ? sizeof(Pixel) : sizeof(Gray8));
+    if (pos > size || size - pos < pixel_bytes) {
+        printf("PNM payload is truncated.\n");
+        return 0;
+    }
+    return pos;
+}
+
+// Function to decode a binary PPM (P6) held in memory
+Pixel **decode_ppm_buffer(const unsigned char *data, size_t size, int *width, int *height) {
+    size_t pos = parse_pnm_header(data, size, '6', width, height);
+    if (pos == 0) {
+        return NULL;
+    }
+    size_t pixel_bytes = (size_t)*width * *height * sizeof(Pixel);
+
+    Pixel **image = allocate_image(*width, *height);
+    if (!image) {
+        return NULL;
+    }
+    memcpy(image[0], data + pos, pixel_bytes);
+    return image;
+}
+
+// Function to encode an image as binary PPM (P6) into a newly allocated buffer
+unsigned char *encode_ppm_buffer(Pixel **image, int width, int height, size_t *size) {
+    char header[64];
+    int header_length = snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", width, height, MAX_COLOR_VALUE);
+    size_t pixel_bytes = (size_t)width * height * sizeof(Pixel);
+
+    unsigned char *buffer = malloc(header_length + pixel_bytes);
+    if (!buffer) {
+        printf("Memory allocation failed for encoded image.\n");
+        return NULL;
+    }
+    memcpy(buffer, header, header_length);
+    for (int i = 0; i < height; i++) {
+        memcpy(buffer + header_length + (size_t)i * width * sizeof(Pixel), image[i], width * sizeof(Pixel));
+    }
+    *size = header_length + pixel_bytes;
+    return buffer;
+}
+
+// Function to decode a binary PGM (P5) held in memory
+Gray8 **decode_pgm_buffer(const unsigned char *data, size_t size, int *width, int *height) {
+    size_t pos = parse_pnm_header(data, size, '5', width, height);
+    if (pos == 0) {
+        return NULL;
+    }
+
+    Gray8 **image = allocate_gray_image(*width, *height);
+    if (!image) {
+        return NULL;
+    }
+    memcpy(image[0], data + pos, (size_t)*width * *height);
+    return image;
+}
+
+// Function to encode a gray image as binary PGM (P5) into a newly allocated buffer
+unsigned char *encode_pgm_buffer(Gray8 **image, int width, int height, size_t *size) {
+    char header[64];
+    int header_length = snprintf(header, sizeof(header), "P5\n%d %d\n%d\n", width, height, MAX_COLOR_VALUE);
+    size_t pixel_bytes = (size_t)width * height;
+
+    unsigned char *buffer = malloc(header_length + pixel_bytes);
+    if (!buffer) {
+        printf("Memory allocation failed for encoded image.\n");
+        return NULL;
+    }
+    memcpy(buffer, header, header_length);
+    for (int i = 0; i < height; i++) {
+        memcpy(buffer + header_length + (size_t)i * width, image[i], width);
+    }
+    *size = header_length + pixel_bytes;
+    return buffer;
+}
+
+// Function to compute a 64-bit FNV-1a style hash, consuming eight bytes per step
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t hash = 0xcbf29ce484222325ull ^ seed;
+
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+        bytes += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        hash = (hash ^ *bytes++) * 0x100000001b3ull;
+        size--;
+    }
+    return hash;
+}
+
+// Structure to represent one cached service result
+typedef struct ServiceCacheEntry {
+    uint64_t payload_hash;               // Hash of the request payload
+    uint64_t payload_length;
+    char *operations;                    // Operation chain text exactly as received
+    uint64_t chain_hash;                 // hash_operation_chain of the parsed chain
+    unsigned char *result;               // Encoded P6 result
+    size_t result_length;
+    uint64_t last_used;                  // Value of service_cache_clock at last hit
+    struct ServiceCacheEntry *next;
+} ServiceCacheEntry;
+
+// In-memory result cache shared by all service connections
+ServiceCacheEntry *service_cache = NULL;
+size_t service_cache_bytes = 0;
+uint64_t service_cache_clock = 0;
+CRITICAL_SECTION service_cache_lock;
+
+// Function to look up a cached result; returns a private copy the caller must free
+unsigned char *service_cache_lookup(uint64_t payload_hash, uint64_t payload_length, const char *operations,
+                                    uint64_t chain_hash, size_t *result_length) {
+    unsigned char *copy = NULL;
+
+    EnterCriticalSection(&service_cache_lock);
+    for (ServiceCacheEntry *entry = service_cache; entry; entry = entry->next) {
+        if (entry->payload_hash == payload_hash && entry->payload_length == payload_length &&
+            entry->chain_hash == chain_hash && strcmp(entry->operations, operations) == 0) {
+            copy = malloc(entry->result_length);
+            if (copy) {
+                memcpy(copy, entry->result, entry->result_length);
+                *result_length = entry->result_length;
+                entry->last_used = ++service_cache_clock;
+            }
+            break;
+        }
+    }
+    LeaveCriticalSection(&service_cache_lock);
+    return copy;
+}
+
+// Function to store a result in the cache, evicting the least recently used entries when full
+void service_cache_store(uint64_t payload_hash, uint64_t payload_length, const char *operations, uint64_t chain_hash,
+                         const unsigned char *result, size_t result_length) {
+    if (result_length > SERVICE_CACHE_CAPACITY) {
+        return;
+    }
+
+    ServiceCacheEntry *entry = malloc(sizeof(ServiceCacheEntry));
+    char *operations_copy = malloc(strlen(operations) + 1);
+    unsigned char *result_copy = malloc(result_length);
+    if (!entry || !operations_copy || !result_copy) {
+        free(entry);
+        free(operations_copy);
+        free(result_copy);
+        return;
+    }
+    strcpy(operations_copy, operations);
+    memcpy(result_copy, result, result_length);
+
+    entry->payload_hash = payload_hash;
+    entry->payload_length = payload_length;
+    entry->operations = operations_copy;
+    entry->chain_hash = chain_hash;
+    entry->result = result_copy;
+    entry->result_length = result_length;
+
+    EnterCriticalSection(&service_cache_lock);
+    while (service_cache && service_cache_bytes + result_length > SERVICE_CACHE_CAPACITY) {
+        ServiceCacheEntry **oldest = &service_cache;
+        for (ServiceCacheEntry **link = &service_cache; *link; link = &(*link)->next) {
+            if ((*link)->last_used < (*oldest)->last_used) {
+                oldest = link;
+            }
+        }
+        ServiceCacheEntry *evicted = *oldest;
+        *oldest = evicted->next;
+        service_cache_bytes -= evicted->result_length;
+        free(evicted->operations);
+        free(evicted->result);
+        free(evicted);
+    }
+    entry->last_used = ++service_cache_clock;
+    entry->next = service_cache;
+    service_cache = entry;
+    service_cache_bytes += result_length;
+    LeaveCriticalSection(&service_cache_lock);
+}
+
+// Function to send a service reply header followed by an optional payload
+int service_reply(SOCKET client, int status, int cached, const unsigned char *payload, size_t payload_length) {
+    ServiceResponse response = {0};
+    response.magic = SERVICE_MAGIC;
+    response.status = status;
+    response.cached = cached;
+    response.payload_length = payload_length;
+
+    if (service_send_all(client, &response, sizeof(response)) != 0) {
+        return -1;
+    }
+    return payload_length ? service_send_all(client, payload, payload_length) : 0;
+}
+
+// Function to handle the requests of one connected client until it disconnects
+DWORD WINAPI service_client_thread(LPVOID parameter) {
+    SOCKET client = (SOCKET)(ULONG_PTR)parameter;
+    ServiceRequest request;
+
+    while (service_recv_all(client, &request, sizeof(request)) == 0) {
+        if (request.magic != SERVICE_MAGIC || request.ops_length > SERVICE_MAX_OPS_LENGTH ||
+            request.shm_name_length > SERVICE_MAX_SHM_NAME_LENGTH || request.payload_length == 0) {
+            service_reply(client, SERVICE_STATUS_BAD_REQUEST, 0, NULL, 0);
+            break;
+        }
+
+        char operations[SERVICE_MAX_OPS_LENGTH + 1];
+        char shm_name[SERVICE_MAX_SHM_NAME_LENGTH + 1];
+        if (service_recv_all(client, operations, request.ops_length) != 0 ||
+            service_recv_all(client, shm_name, request.shm_name_length) != 0) {
+            break;
+        }
+        operations[request.ops_length] = '\0';
+        shm_name[request.shm_name_length] = '\0';
+
+        // The payload either follows in the socket or lives in a named file mapping created by the client
+        unsigned char *payload = NULL;
+        HANDLE mapping = NULL;
+        if (request.shm_name_length > 0) {
+            mapping = OpenFileMapping(FILE_MAP_READ, FALSE, shm_name);
+            payload = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (SIZE_T)request.payload_length) : NULL;
+            if (!payload) {
+                if (mapping) {
+                    CloseHandle(mapping);
+                }
+                service_reply(client, SERVICE_STATUS_BAD_REQUEST, 0, NULL, 0);
+                continue;
+            }
+        } else {
+            payload = malloc(request.payload_length);
+            if (!payload) {
+                service_reply(client, SERVICE_STATUS_FAILED, 0, NULL, 0);
+                break;
+            }
+            if (service_recv_all(client, payload, request.payload_length) != 0) {
+                free(payload);
+                break;
+            }
+        }
+
+        // The chain is parsed first so the cache key covers everything it depends on
+        Operation chain[MAX_OPERATIONS];
+        int count = parse_operation_chain(operations, chain, MAX_OPERATIONS);
+        uint64_t payload_hash = hash_bytes(payload, request.payload_length, 0);
+        uint64_t chain_hash = count >= 0 ? hash_operation_chain(operations, chain, count) : 0;
+        size_t result_length = 0;
+        unsigned char *result = count >= 0 ? service_cache_lookup(payload_hash, request.payload_length, operations,
+                                                                  chain_hash, &result_length) : NULL;
+        int cached = result != NULL;
+        int status = SERVICE_STATUS_OK;
+
+        if (count < 0) {
+            status = SERVICE_STATUS_BAD_OPERATIONS;
+        } else if (!result) {
+            ChainImage work = {0};
+            if (decode_chain_image(payload, request.payload_length, &work) != 0) {
+                status = SERVICE_STATUS_BAD_IMAGE;
+            } else {
+                if (apply_operation_chain(&work, chain, count) == 0) {
+                    result = encode_chain_image(&work, &result_length);
+                }
+                free_chain_image(&work);
+                if (result) {
+                    service_cache_store(payload_hash, request.payload_length, operations, chain_hash, result, result_length);
+                } else {
+                    status = SERVICE_STATUS_FAILED;
+                }
+            }
+        }
+        if (count > 0) {
+            free_operation_chain(chain, count);
+        }
+
+        if (mapping) {
+            UnmapViewOfFile(payload);
+            CloseHandle(mapping);
+        } else {
+            free(payload);
+        }
+
+        int sent = service_reply(client, status, cached, result, result ? result_length : 0);
+        free(result);
+        if (sent != 0) {
+            break;
+        }
+    }
+
+    closesocket(client);
+    return 0;
+}
+
+// Function to run the image service on a Unix domain socket, one thread per connected client
+int run_image_service(const char *socket_path) {
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        printf("Failed to initialize Winsock.\n");
+        return 1;
+    }
+    InitializeCriticalSection(&service_cache_lock);
+    operation_files_allowed = 0;
+
+    SOCKET server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == INVALID_SOCKET) {
+        printf("Failed to create the service socket.\n");
+        WSACleanup();
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    DeleteFile(socket_path); // Remove a stale socket left by a previous run
+
+    if (bind(server, (struct sockaddr *)&address, sizeof(address)) == SOCKET_ERROR ||
+        listen(server, SOMAXCONN) == SOCKET_ERROR) {
+        printf("Failed to listen on %s\n", socket_path);
+        closesocket(server);
+        WSACleanup();
+        return 1;
+    }
+
+    printf("Image service listening on %s\n", socket_path);
+
+    for (;;) {
+        SOCKET client = accept(server, NULL, NULL);
+        if (client == INVALID_SOCKET) {
+            printf("Failed to accept a service connection.\n");
+            continue;
+        }
+        HANDLE thread = CreateThread(NULL, 0, service_client_thread, (LPVOID)(ULONG_PTR)client, 0, NULL);
+        if (!thread) {
+            closesocket(client);
+            continue;
+        }
+        CloseHandle(thread);
+    }
+}
+
+
+// Function to build an output file name with the extension of the selected output format
+void build_output_name(char *buffer, size_t size, const char *base_name, int is_gray) {
+    const char *extension = output_format == FORMAT_QOI ? "qoi" : is_gray && output_format != FORMAT_P3 ? "pgm" : "ppm";
+    snprintf(buffer, size, "%s.%s", base_name, extension);
+}
+
+// Function to encode an image as ASCII PPM (P3). Each image row starts a new line and wraps before
+// P3_MAX_LINE characters, so chunks of rows can be formatted independently: every chunk is written in parallel
+// into its own worst-case sized slot (3 digits and a separator per value) using a table of the 256 decimal
+// strings, then the slots are moved together into one contiguous buffer.
+unsigned char *encode_p3_buffer(Pixel **image, int width, int height, size_t *size) {
+    struct {
+        char text[4];
+        int length;
+    } digits[256];
+    for (int v = 0; v < 256; v++) {
+        digits[v].length = snprintf(digits[v].text, sizeof(digits[v].text), "%d", v);
+    }
+
+    char header[64];
+    int header_length = snprintf(header, sizeof(header), "P3\n%d %d\n%d\n", width, height, MAX_COLOR_VALUE);
+    size_t row_slot = (size_t)width * 3 * 4;
+    int chunks = (height + P3_CHUNK_ROWS - 1) / P3_CHUNK_ROWS;
+    size_t *chunk_lengths = malloc(max(chunks, 1) * sizeof(size_t));
+    unsigned char *buffer = malloc(header_length + row_slot * height);
+    if (!buffer || !chunk_lengths) {
+        printf("Memory allocation failed for the P3 output.\n");
+        free(chunk_lengths);
+        free(buffer);
+        return NULL;
+    }
+    memcpy(buffer, header, header_length);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < chunks; c++) {
+        unsigned char *start = buffer + header_length + (size_t)c * P3_CHUNK_ROWS * row_slot;
+        unsigned char *out = start;
+        for (int i = c * P3_CHUNK_ROWS; i < min(height, (c + 1) * P3_CHUNK_ROWS); i++) {
+            const unsigned char *values = (const unsigned char *)image[i];
+            int line_length = 0;
+            for (int k = 0; k < width * 3; k++) {
+                int length = digits[values[k]].length;
+                if (line_length > 0) {
+                    int wrap = line_length + 1 + length > P3_MAX_LINE;
+                    *out++ = wrap ? '\n' : ' ';
+                    line_length = wrap ? 0 : line_length + 1;
+                }
+                memcpy(out, digits[values[k]].text, 4); // Fixed-size copy; the unused bytes are overwritten next
+                out += length;
+                line_length += length;
+            }
+            *out++ = '\n';
+        }
+        chunk_lengths[c] = (size_t)(out - start);
+    }
+
+    // Move the formatted chunks together; each one only moves towards the start of the buffer
+    size_t length = header_length;
+    for (int c = 0; c < chunks; c++) {
+        memmove(buffer + length, buffer + header_length + (size_t)c * P3_CHUNK_ROWS * row_slot, chunk_lengths[c]);
+        length += chunk_lengths[c];
+    }
+    free(chunk_lengths);
+    *size = length;
+    return buffer;
+}
+
+// Function to write a 32-bit big-endian value
+static void write_u32_be(unsigned char *buffer, uint32_t value) {
+    buffer[0] = (unsigned char)(value >> 24);
+    buffer[1] = (unsigned char)(value >> 16);
+    buffer[2] = (unsigned char)(value >> 8);
+    buffer[3] = (unsigned char)value;
+}
+
+// Function to read a 32-bit big-endian value
+static uint32_t read_u32_be(const unsigned char *buffer) {
+    return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+}
+
+// Function to encode an image as QOI (RGB, sRGB) into a newly allocated buffer
+unsigned char *encode_qoi_buffer(Pixel **image, int width, int height, size_t *size) {
+    size_t pixel_count = (size_t)width * height;
+    if (width <= 0 || height <= 0 || pixel_count > QOI_MAX_PIXELS) {
+        printf("Image dimensions are not valid for QOI.\n");
+        return NULL;
+    }
+
+    // Worst case is one QOI_OP_RGB chunk (4 bytes) per pixel
+    unsigned char *buffer = malloc(QOI_HEADER_SIZE + pixel_count * 4 + QOI_PADDING_SIZE);
+    if (!buffer) {
+        printf("Memory allocation failed for QOI encoding.\n");
+        return NULL;
+    }
+
+    memcpy(buffer, QOI_MAGIC, 4);
+    write_u32_be(buffer + 4, (uint32_t)width);
+    write_u32_be(buffer + 8, (uint32_t)height);
+    buffer[12] = 3; // Channels
+    buffer[13] = 0; // sRGB with linear alpha
+    size_t pos = QOI_HEADER_SIZE;
+
+    QoiColor index[64] = {0};
+    QoiColor previous = {0, 0, 0, 255};
+    int run = 0;
+
+    for (int i = 0; i < height; i++) {
+        const Pixel *row = image[i];
+        for (int j = 0; j < width; j++) {
+            QoiColor pixel = {row[j].r, row[j].g, row[j].b, 255};
+
+            if (pixel.r == previous.r && pixel.g == previous.g && pixel.b == previous.b) {
+                run++;
+                if (run == 62) {
+                    buffer[pos++] = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run > 0) {
+                buffer[pos++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            int hash = QOI_HASH(pixel);
+            if (index[hash].r == pixel.r && index[hash].g == pixel.g && index[hash].b == pixel.b && index[hash].a == 255) {
+                buffer[pos++] = QOI_OP_INDEX | hash;
+            } else {
+                index[hash] = pixel;
+
+                signed char vr = (signed char)(pixel.r - previous.r);
+                signed char vg = (signed char)(pixel.g - previous.g);
+                signed char vb = (signed char)(pixel.b - previous.b);
+                signed char vg_r = (signed char)(vr - vg);
+                signed char vg_b = (signed char)(vb - vg);
+
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    buffer[pos++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                    buffer[pos++] = QOI_OP_LUMA | (vg + 32);
+                    buffer[pos++] = (vg_r + 8) << 4 | (vg_b + 8);
+                } else {
+                    buffer[pos++] = QOI_OP_RGB;
+                    buffer[pos++] = pixel.r;
+                    buffer[pos++] = pixel.g;
+                    buffer[pos++] = pixel.b;
+                }
+            }
+            previous = pixel;
+        }
+    }
+    if (run > 0) {
+        buffer[pos++] = QOI_OP_RUN | (run - 1);
+    }
+
+    memset(buffer + pos, 0, QOI_PADDING_SIZE - 1);
+    buffer[pos + QOI_PADDING_SIZE - 1] = 1;
+    *size = pos + QOI_PADDING_SIZE;
+    return buffer;
+}
+
+// Function to decode a QOI image held in memory (alpha is discarded)
+Pixel **decode_qoi_buffer(const unsigned char *data, size_t size, int *width, int *height) {
+    return decode_qoi_with_alpha(data, size, width, height, NULL);
+}
+
+// Function to decode a QOI image held in memory, also returning its alpha channel as a Gray8 image when alpha is set
+Pixel **decode_qoi_with_alpha(const unsigned char *data, size_t size, int *width, int *height, Gray8 ***alpha) {
+    if (size < QOI_HEADER_SIZE + QOI_PADDING_SIZE || memcmp(data, QOI_MAGIC, 4) != 0) {
+        printf("Invalid QOI header.\n");
+        return NULL;
+    }
+
+    uint32_t qoi_width = read_u32_be(data + 4);
+    uint32_t qoi_height = read_u32_be(data + 8);
+    if (qoi_width == 0 || qoi_height == 0 || (data[12] != 3 && data[12] != 4) ||
+        (uint64_t)qoi_width * qoi_height > QOI_MAX_PIXELS) {
+        printf("Invalid QOI dimensions or channel count.\n");
+        return NULL;
+    }
+    *width = (int)qoi_width;
+    *height = (int)qoi_height;
+
+    Pixel **image = allocate_image(*width, *height);
+    if (!image) {
+        return NULL;
+    }
+
+    Gray8 *alpha_out = NULL;
+    if (alpha) {
+        *alpha = allocate_gray_image(*width, *height);
+        if (!*alpha) {
+            free_image(image);
+            return NULL;
+        }
+        alpha_out = (*alpha)[0];
+    }
+
+    QoiColor index[64] = {0};
+    QoiColor pixel = {0, 0, 0, 255};
+    size_t pos = QOI_HEADER_SIZE;
+    size_t chunks_end = size - QOI_PADDING_SIZE;
+    size_t pixel_count = (size_t)*width * *height;
+    Pixel *out = image[0];
+    int run = 0;
+
+    for (size_t k = 0; k < pixel_count; k++) {
+        if (run > 0) {
+            run--;
+        } else if (pos < chunks_end) {
+            int b1 = data[pos++];
+
+            if (b1 == QOI_OP_RGB) {
+                pixel.r = data[pos];
+                pixel.g = data[pos + 1];
+                pixel.b = data[pos + 2];
+                pos += 3;
+            } else if (b1 == QOI_OP_RGBA) {
+                pixel.r = data[pos];
+                pixel.g = data[pos + 1];
+                pixel.b = data[pos + 2];
+                pixel.a = data[pos + 3];
+                pos += 4;
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                pixel = index[b1];
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                pixel.r += ((b1 >> 4) & 0x03) - 2;
+                pixel.g += ((b1 >> 2) & 0x03) - 2;
+                pixel.b += (b1 & 0x03) - 2;
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                int b2 = data[pos++];
+                int vg = (b1 & 0x3f) - 32;
+                pixel.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                pixel.g += vg;
+                pixel.b += vg - 8 + (b2 & 0x0f);
+            } else { // QOI_OP_RUN
+                run = b1 & 0x3f;
+            }
+
+            index[QOI_HASH(pixel)] = pixel;
+        } else {
+            printf("QOI data is truncated.\n");
+            free_image(image);
+            if (alpha) {
+                free_gray_image(*alpha);
+                *alpha = NULL;
+            }
+            return NULL;
+        }
+
+        out[k].r = pixel.r;
+        out[k].g = pixel.g;
+        out[k].b = pixel.b;
+        if (alpha_out) {
+            alpha_out[k] = pixel.a;
+        }
+    }
+
+    return image;
+}
+
+// Function to write a 32-bit little-endian value
+static void write_u32_le(unsigned char *buffer, uint32_t value) {
+    buffer[0] = (unsigned char)value;
+    buffer[1] = (unsigned char)(value >> 8);
+    buffer[2] = (unsigned char)(value >> 16);
+    buffer[3] = (unsigned char)(value >> 24);
+}
+
+// Function to read a 32-bit little-endian value
+static uint32_t read_u32_le(const unsigned char *buffer) {
+    return buffer[0] | ((uint32_t)buffer[1] << 8) | ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+// Function to convert a PPM (P3/P6) into a tiled container, streaming one band of tile rows at a time
+int convert_to_tiled(const char *input_name, const char *output_name, int tile_size, int compression) {
+    printf("Converting %s to tiled container %s...\n", input_name, output_name);
+
+    FILE *input = fopen(input_name, "rb");
+    if (!input) {
+        printf("Error opening the file %s\n", input_name);
+        return -1;
+    }
+
+    char format[3];
+    int image_width, image_height, max_color;
+    if (read_pnm_header(input, format, &image_width, &image_height, &max_color) != 0 || strcmp(format, "P5") == 0) {
+        printf("Only PPM (P3 and P6) images can be converted.\n");
+        fclose(input);
+        return -1;
+    }
+
+    FILE *output = fopen(output_name, "wb");
+    if (!output) {
+        printf("Error opening file %s for writing.\n", output_name);
+        fclose(input);
+        return -1;
+    }
+
+    int tiles_x = (image_width + tile_size - 1) / tile_size;
+    int tiles_y = (image_height + tile_size - 1) / tile_size;
+    size_t tile_count = (size_t)tiles_x * tiles_y;
+    size_t index_size = tile_count * TILED_INDEX_ENTRY_SIZE;
+
+    unsigned char *index = calloc(1, index_size);
+    Pixel **band = allocate_image(image_width, tile_size);
+    Pixel ***tile_rows = calloc(tiles_x, sizeof(Pixel **));
+    unsigned char **encoded = calloc(tiles_x, sizeof(unsigned char *));
+    size_t *encoded_lengths = calloc(tiles_x, sizeof(size_t));
+    int failed = !index || !band || !tile_rows || !encoded || !encoded_lengths;
+    for (int tx = 0; tx < tiles_x && !failed; tx++) {
+        tile_rows[tx] = malloc(tile_size * sizeof(Pixel *));
+        failed = !tile_rows[tx];
+    }
+    if (failed) {
+        printf("Memory allocation failed for tiled conversion.\n");
+    } else {
+        unsigned char header[TILED_HEADER_SIZE];
+        memcpy(header, TILED_MAGIC, 4);
+        write_u32_le(header + 4, TILED_VERSION);
+        write_u32_le(header + 8, image_width);
+        write_u32_le(header + 12, image_height);
+        write_u32_le(header + 16, tile_size);
+        write_u32_le(header + 20, 3); // Channels
+        write_u32_le(header + 24, compression);
+        write_u32_le(header + 28, tiles_x);
+        write_u32_le(header + 32, tiles_y);
+        fwrite(header, 1, TILED_HEADER_SIZE, output);
+        fwrite(index, 1, index_size, output); // Placeholder, rewritten once the offsets are known
+    }
+
+    uint64_t offset = TILED_HEADER_SIZE + index_size;
+
+    for (int ty = 0; ty < tiles_y && !failed; ty++) {
+        int band_height = min(tile_size, image_height - ty * tile_size);
+
+        // Read the next band of rows from the source
+        for (int i = 0; i < band_height && !failed; i++) {
+            if (strcmp(format, "P6") == 0) {
+                failed = fread(band[i], sizeof(Pixel), image_width, input) != (size_t)image_width;
+            } else {
+                for (int j = 0; j < image_width && !failed; j++) {
+                    int r, g, b;
+                    failed = fscanf(input, "%d %d %d", &r, &g, &b) != 3;
+                    band[i][j].r = (unsigned char)(MAX_COLOR_VALUE * r / max_color);
+                    band[i][j].g = (unsigned char)(MAX_COLOR_VALUE * g / max_color);
+                    band[i][j].b = (unsigned char)(MAX_COLOR_VALUE * b / max_color);
+                }
+            }
+        }
+        if (failed) {
+            printf("Error reading pixel data.\n");
+            break;
+        }
+
+        // Encode the tiles of the band in parallel; tile rows point straight into the band
+        #pragma omp parallel for schedule(dynamic)
+        for (int tx = 0; tx < tiles_x; tx++) {
+            int tile_width = min(tile_size, image_width - tx * tile_size);
+            for (int i = 0; i < band_height; i++) {
+                tile_rows[tx][i] = band[i] + tx * tile_size;
+            }
+
+            if (compression == TILED_COMPRESSION_QOI) {
+                encoded[tx] = encode_qoi_buffer(tile_rows[tx], tile_width, band_height, &encoded_lengths[tx]);
+            } else {
+                encoded_lengths[tx] = (size_t)tile_width * band_height * sizeof(Pixel);
+                encoded[tx] = malloc(encoded_lengths[tx]);
+                if (encoded[tx]) {
+                    for (int i = 0; i < band_height; i++) {
+                        memcpy(encoded[tx] + (size_t)i * tile_width * sizeof(Pixel), tile_rows[tx][i], tile_width * sizeof(Pixel));
+                    }
+                }
+            }
+        }
+
+        // Append the tiles in order and record their place in the index
+        for (int tx = 0; tx < tiles_x; tx++) {
+            unsigned char *entry = index + ((size_t)ty * tiles_x + tx) * TILED_INDEX_ENTRY_SIZE;
+            if (!encoded[tx] || fwrite(encoded[tx], 1, encoded_lengths[tx], output) != encoded_lengths[tx]) {
+                failed = 1;
+            }
+            write_u32_le(entry, (uint32_t)offset);
+            write_u32_le(entry + 4, (uint32_t)(offset >> 32));
+            write_u32_le(entry + 8, (uint32_t)encoded_lengths[tx]);
+            write_u32_le(entry + 12, (uint32_t)((uint64_t)encoded_lengths[tx] >> 32));
+            offset += encoded_lengths[tx];
+            free(encoded[tx]);
+            encoded[tx] = NULL;
+        }
+    }
+
+    if (!failed) {
+        _fseeki64(output, TILED_HEADER_SIZE, SEEK_SET);
+        fwrite(index, 1, index_size, output);
+        printf("Tiled container saved as %s (%d x %d tiles of %d pixels)\n", output_name, tiles_x, tiles_y, tile_size);
+    }
+
+    for (int tx = 0; tile_rows && tx < tiles_x; tx++) {
+        free(tile_rows[tx]);
+    }
+    free(tile_rows);
+    free(encoded);
+    free(encoded_lengths);
+    free_image(band);
+    free(index);
+    fclose(output);
+    fclose(input);
+    return failed ? -1 : 0;
+}
+
+// Function to read the header and tile index of a tiled container
+int read_tiled_header(FILE *file, TiledHeader *header) {
+    unsigned char buffer[TILED_HEADER_SIZE];
+    if (fread(buffer, 1, TILED_HEADER_SIZE, file) != TILED_HEADER_SIZE || memcmp(buffer, TILED_MAGIC, 4) != 0 ||
+        read_u32_le(buffer + 4) != TILED_VERSION || read_u32_le(buffer + 20) != 3) {
+        printf("Invalid tiled container header.\n");
+        return -1;
+    }
+
+    header->width = (int)read_u32_le(buffer + 8);
+    header->height = (int)read_u32_le(buffer + 12);
+    header->tile_size = (int)read_u32_le(buffer + 16);
+    header->compression = (int)read_u32_le(buffer + 24);
+    header->tiles_x = (int)read_u32_le(buffer + 28);
+    header->tiles_y = (int)read_u32_le(buffer + 32);
+    if (header->width <= 0 || header->height <= 0 || header->tile_size <= 0 ||
+        header->tiles_x != (header->width + header->tile_size - 1) / header->tile_size ||
+        header->tiles_y != (header->height + header->tile_size - 1) / header->tile_size) {
+        printf("Invalid tiled container dimensions.\n");
+        return -1;
+    }
+
+    size_t tile_count = (size_t)header->tiles_x * header->tiles_y;
+    unsigned char *index = malloc(tile_count * TILED_INDEX_ENTRY_SIZE);
+    header->tile_offsets = malloc(tile_count * sizeof(uint64_t));
+    header->tile_lengths = malloc(tile_count * sizeof(uint64_t));
+    if (!index || !header->tile_offsets || !header->tile_lengths ||
+        fread(index, TILED_INDEX_ENTRY_SIZE, tile_count, file) != tile_count) {
+        printf("Error reading the tile index.\n");
+        free(index);
+        free(header->tile_offsets);
+        free(header->tile_lengths);
+        return -1;
+    }
+
+    for (size_t k = 0; k < tile_count; k++) {
+        const unsigned char *entry = index + k * TILED_INDEX_ENTRY_SIZE;
+        header->tile_offsets[k] = read_u32_le(entry) | ((uint64_t)read_u32_le(entry + 4) << 32);
+        header->tile_lengths[k] = read_u32_le(entry + 8) | ((uint64_t)read_u32_le(entry + 12) << 32);
+    }
+    free(index);
+    return 0;
+}
+
+// Function to load a rectangle from a tiled container, reading only the intersecting tiles in parallel.
+// The region size is clamped to the image; region_width and region_height return the actual size.
+Pixel **load_tiled_region(const char *file_name, int x, int y, int *region_width, int *region_height) {
+    printf("Loading region of tiled container %s...\n", file_name);
+
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        printf("Error opening the file %s\n", file_name);
+        return NULL;
+    }
+
+    TiledHeader header;
+    int header_failed = read_tiled_header(file, &header);
+    fclose(file);
+    if (header_failed) {
+        return NULL;
+    }
+
+    x = max(0, x);
+    y = max(0, y);
+    int right = (int)min((long long)header.width, (long long)x + *region_width);
+    int bottom = (int)min((long long)header.height, (long long)y + *region_height);
+    if (x >= right || y >= bottom) {
+        printf("The requested region is outside the image.\n");
+        free(header.tile_offsets);
+        free(header.tile_lengths);
+        return NULL;
+    }
+    *region_width = right - x;
+    *region_height = bottom - y;
+
+    Pixel **region = allocate_image(*region_width, *region_height);
+    if (!region) {
+        free(header.tile_offsets);
+        free(header.tile_lengths);
+        return NULL;
+    }
+
+    int first_tx = x / header.tile_size, last_tx = (right - 1) / header.tile_size;
+    int first_ty = y / header.tile_size, last_ty = (bottom - 1) / header.tile_size;
+    int columns = last_tx - first_tx + 1;
+    int tile_count = columns * (last_ty - first_ty + 1);
+    int failed = 0;
+
+    #pragma omp parallel reduction(|:failed)
+    {
+        // Each thread keeps its own handle so the tile reads can proceed concurrently
+        FILE *tile_file = fopen(file_name, "rb");
+        unsigned char *stored = NULL;
+        size_t stored_capacity = 0;
+
+        #pragma omp for schedule(dynamic)
+        for (int k = 0; k < tile_count; k++) {
+            int tx = first_tx + k % columns;
+            int ty = first_ty + k / columns;
+            size_t tile_index = (size_t)ty * header.tiles_x + tx;
+            int tile_width = min(header.tile_size, header.width - tx * header.tile_size);
+            int tile_height = min(header.tile_size, header.height - ty * header.tile_size);
+            size_t length = (size_t)header.tile_lengths[tile_index];
+
+            if (!tile_file || failed) {
+                failed = 1;
+                continue;
+            }
+            if (length > stored_capacity) {
+                free(stored);
+                stored = malloc(length);
+                stored_capacity = stored ? length : 0;
+            }
+            if (!stored || _fseeki64(tile_file, (long long)header.tile_offsets[tile_index], SEEK_SET) != 0 ||
+                fread(stored, 1, length, tile_file) != length) {
+                failed = 1;
+                continue;
+            }
+
+            // Decode the tile, then copy the part that overlaps the region
+            Pixel **decoded = NULL;
+            const Pixel *tile_pixels;
+            if (header.compression == TILED_COMPRESSION_QOI) {
+                int decoded_width, decoded_height;
+                decoded = decode_qoi_buffer(stored, length, &decoded_width, &decoded_height);
+                if (!decoded || decoded_width != tile_width || decoded_height != tile_height) {
+                    free_image(decoded);
+                    failed = 1;
+                    continue;
+                }
+                tile_pixels = decoded[0];
+            } else if (length == (size_t)tile_width * tile_height * sizeof(Pixel)) {
+                tile_pixels = (const Pixel *)stored;
+            } else {
+                failed = 1;
+                continue;
+            }
+
+            int tile_x = tx * header.tile_size, tile_y = ty * header.tile_size;
+            int copy_left = max(x, tile_x), copy_right = min(right, tile_x + tile_width);
+            int copy_top = max(y, tile_y), copy_bottom = min(bottom, tile_y + tile_height);
+            for (int i = copy_top; i < copy_bottom; i++) {
+                memcpy(&region[i - y][copy_left - x], tile_pixels + (size_t)(i - tile_y) * tile_width + (copy_left - tile_x),
+                       (copy_right - copy_left) * sizeof(Pixel));
+            }
+            free_image(decoded);
+        }
+
+        free(stored);
+        if (tile_file) {
+            fclose(tile_file);
+        }
+    }
+
+    free(header.tile_offsets);
+    free(header.tile_lengths);
+    if (failed) {
+        printf("Error reading tiles from %s\n", file_name);
+        free_image(region);
+        return NULL;
+    }
+
+    printf("Loaded region %d x %d at (%d, %d) from %d tiles.\n", *region_width, *region_height, x, y, tile_count);
+    return region;
+}
+
+// Function to encode 8-bit gray (1 channel) or RGB (3 channels) pixels as a PNG held in memory.
+// The zlib stream uses stored deflate blocks: tiles are small and written once, so speed beats size.
+unsigned char *encode_png_buffer(const unsigned char *pixels, int channels, size_t row_step, int width, int height, size_t *size) {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    size_t line_size = (size_t)width * channels + 1; // Filter byte (0 = none) plus the row
+    size_t raw_size = line_size * height;
+    size_t blocks = (raw_size + PNG_MAX_STORED_BLOCK - 1) / PNG_MAX_STORED_BLOCK;
+    size_t zlib_size = 2 + raw_size + blocks * 5 + 4;
+    *size = sizeof(signature) + 25 + (12 + zlib_size) + 12;
+
+    unsigned char *buffer = malloc(*size);
+    if (!buffer) {
+        return NULL;
+    }
+
+    uint32_t crc_table[256];
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+
+    unsigned char *out = buffer;
+    memcpy(out, signature, sizeof(signature));
+    out += sizeof(signature);
+
+    // IHDR: size, 8 bits per sample, gray (0) or RGB (2), no interlace
+    unsigned char *chunk = out;
+    write_u32_be(out, 13);
+    memcpy(out + 4, "IHDR", 4);
+    write_u32_be(out + 8, width);
+    write_u32_be(out + 12, height);
+    out[16] = 8;
+    out[17] = channels == 3 ? 2 : 0;
+    out[18] = out[19] = out[20] = 0;
+    out += 21;
+    uint32_t crc = 0xffffffffu;
+    for (unsigned char *p = chunk + 4; p < out; p++) {
+        crc = crc_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    write_u32_be(out, crc ^ 0xffffffffu);
+    out += 4;
+
+    // IDAT: zlib header, stored blocks of the filtered rows, Adler-32 of the rows
+    chunk = out;
+    write_u32_be(out, (uint32_t)zlib_size);
+    memcpy(out + 4, "IDAT", 4);
+    out += 8;
+    *out++ = 0x78;
+    *out++ = 0x01;
+    uint32_t adler_a = 1, adler_b = 0;
+    size_t remaining = raw_size, block_left = 0;
+    for (int i = 0; i < height; i++) {
+        const unsigned char *row = pixels + (size_t)i * row_step;
+        for (size_t k = 0; k < line_size; k++) {
+            if (block_left == 0) {
+                block_left = min(remaining, (size_t)PNG_MAX_STORED_BLOCK);
+                remaining -= block_left;
+                *out++ = remaining == 0; // BFINAL on the last block, BTYPE 00
+                *out++ = (unsigned char)block_left;
+                *out++ = (unsigned char)(block_left >> 8);
+                *out++ = (unsigned char)~block_left;
+                *out++ = (unsigned char)(~block_left >> 8);
+            }
+            unsigned char value = k == 0 ? 0 : row[k - 1];
+            *out++ = value;
+            block_left--;
+            adler_a += value;
+            adler_b += adler_a;
+            if ((k & 4095) == 4095) { // Reduce well before the sums can overflow
+                adler_a %= 65521;
+                adler_b %= 65521;
+            }
+        }
+        adler_a %= 65521;
+        adler_b %= 65521;
+    }
+    write_u32_be(out, adler_b << 16 | adler_a);
+    out += 4;
+    crc = 0xffffffffu;
+    for (unsigned char *p = chunk + 4; p < out; p++) {
+        crc = crc_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    write_u32_be(out, crc ^ 0xffffffffu);
+    out += 4;
+
+    // IEND
+    write_u32_be(out, 0);
+    memcpy(out + 4, "IEND", 4);
+    write_u32_be(out + 8, 0xae426082u);
+    return buffer;
+}
+
+// Function to halve an image in both directions by averaging 2x2 blocks (edge blocks average what exists)
+static unsigned char *downsample_half(const unsigned char *source, int channels, size_t row_step, int width, int height,
+                                      int *half_width, int *half_height) {
+    *half_width = (width + 1) / 2;
+    *half_height = (height + 1) / 2;
+    unsigned char *half = malloc((size_t)*half_width * *half_height * channels);
+    if (!half) {
+        return NULL;
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < *half_height; i++) {
+        const unsigned char *top = source + (size_t)(2 * i) * row_step;
+        const unsigned char *bottom = 2 * i + 1 < height ? top + row_step : top;
+        unsigned char *target = half + (size_t)i * *half_width * channels;
+        for (int j = 0; j < *half_width; j++) {
+            int right = 2 * j + 1 < width ? channels : 0;
+            for (int c = 0; c < channels; c++) {
+                int left_index = 2 * j * channels + c;
+                int sum = top[left_index] + top[left_index + right] + bottom[left_index] + bottom[left_index + right];
+                target[j * channels + c] = (unsigned char)((sum + 2) >> 2);
+            }
+        }
+    }
+    return half;
+}
+
+// Function to export a chain image as a Deep Zoom pyramid under outputs/: output_name.dzi and
+// output_name_files/<level>/<column>_<row>.png. The pyramid is built from the in-memory result, each
+// level by halving the one above, and the tiles of a level are encoded and written by all threads.
+int export_deep_zoom(ChainImage *image, const char *output_name, int tile_size) {
+    if (resolve_chain_orientation(image) != 0) {
+        return -1;
+    }
+    int channels = image->gray ? 1 : 3;
+    int max_level = 0;
+    while ((1 << max_level) < max(image->width, image->height)) {
+        max_level++;
+    }
+    printf("Exporting %d x %d image as a Deep Zoom pyramid of %d levels...\n", image->width, image->height, max_level + 1);
+
+    char directory[MAX_PATH];
+    create_directory("outputs");
+    snprintf(directory, sizeof(directory), "outputs/%s_files", output_name);
+    create_directory(directory);
+
+    ImageView view = chain_image_view(image);
+    const unsigned char *level_pixels = view.base;
+    size_t row_step = view.stride;
+    unsigned char *owned = NULL; // Levels below the full resolution one, tightly packed
+    int level_width = image->width, level_height = image->height;
+    int failed = 0, tiles_written = 0;
+
+    for (int level = max_level; level >= 0 && !failed; level--) {
+        snprintf(directory, sizeof(directory), "outputs/%s_files/%d", output_name, level);
+        create_directory(directory);
+
+        int tiles_x = (level_width + tile_size - 1) / tile_size;
+        int tiles_y = (level_height + tile_size - 1) / tile_size;
+
+        #pragma omp parallel for schedule(dynamic) reduction(|:failed)
+        for (int k = 0; k < tiles_x * tiles_y; k++) {
+            int tx = k % tiles_x, ty = k / tiles_x;
+            int tile_width = min(tile_size, level_width - tx * tile_size);
+            int tile_height = min(tile_size, level_height - ty * tile_size);
+            const unsigned char *origin = level_pixels + (size_t)ty * tile_size * row_step + (size_t)tx * tile_size * channels;
+
+            size_t size;
+            unsigned char *png = encode_png_buffer(origin, channels, row_step, tile_width, tile_height, &size);
+            char tile_name[MAX_PATH];
+            snprintf(tile_name, sizeof(tile_name), "%s/%d_%d.png", directory, tx, ty);
+            FILE *file = png ? fopen(tile_name, "wb") : NULL;
+            if (!file || fwrite(png, 1, size, file) != size) {
+                printf("Error writing tile %s\n", tile_name);
+                failed = 1;
+            }
+            if (file) {
+                fclose(file);
+            }
+            free(png);
+        }
+        tiles_written += tiles_x * tiles_y;
+
+        if (level > 0 && !failed) {
+            int half_width, half_height;
+            unsigned char *half = downsample_half(level_pixels, channels, row_step, level_width, level_height, &half_width, &half_height);
+            free(owned);
+            owned = half;
+            level_pixels = half;
+            level_width = half_width;
+            level_height = half_height;
+            row_step = (size_t)half_width * channels;
+            failed = half == NULL;
+        }
+    }
+    free(owned);
+
+    char manifest_name[MAX_PATH];
+    snprintf(manifest_name, sizeof(manifest_name), "outputs/%s.dzi", output_name);
+    FILE *manifest = failed ? NULL : fopen(manifest_name, "w");
+    if (!manifest) {
+        printf("Deep Zoom export failed.\n");
+        return -1;
+    }
+    fprintf(manifest, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(manifest, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"png\" Overlap=\"0\" TileSize=\"%d\">\n", tile_size);
+    fprintf(manifest, "  <Size Width=\"%d\" Height=\"%d\"/>\n", image->width, image->height);
+    fprintf(manifest, "</Image>\n");
+    fclose(manifest);
+
+    printf("Deep Zoom pyramid saved as %s (%d tiles).\n", manifest_name, tiles_written);
+    return 0;
+}
+
+// Function to tabulate all curves needed by apply_point_operation
+void build_point_curves(PointCurves *curves) {
+    build_xray_curve(curves->xray);
+    build_aged_curves(curves->aged_red, curves->aged_green, curves->aged_blue);
+}
+
+// Function to apply one point operation to a single pixel, matching the whole-image kernels.
+// is_gray tracks whether the pixel already holds gray data, as the Gray8 path of the chains does.
+Pixel apply_point_operation(const Operation *operation, Pixel pixel, int *is_gray, const PointCurves *curves) {
+    OperationType type = operation->type;
+    switch (type) {
+        case OP_GRAYSCALE:
+        case OP_XRAY:
+            if (!*is_gray) {
+                pixel.r = pixel.g = pixel.b = (unsigned char)(pixel.r * GRAYSCALE_RED_WEIGHT +
+                                                              pixel.g * GRAYSCALE_GREEN_WEIGHT +
+                                                              pixel.b * GRAYSCALE_BLUE_WEIGHT);
+                *is_gray = 1;
+            }
+            if (type == OP_XRAY) {
+                pixel.r = pixel.g = pixel.b = curves->xray[pixel.r];
+            }
+            break;
+        case OP_NEGATIVE:
+            pixel.r = MAX_COLOR_VALUE - pixel.r;
+            pixel.g = MAX_COLOR_VALUE - pixel.g;
+            pixel.b = MAX_COLOR_VALUE - pixel.b;
+            break;
+        case OP_AGED:
+            pixel.r = curves->aged_red[pixel.r];
+            pixel.g = curves->aged_green[pixel.g];
+            pixel.b = curves->aged_blue[pixel.b];
+            *is_gray = 0;
+            break;
+        case OP_COLOR_MATRIX: {
+            const int (*fixed)[4] = operation->matrix.fixed;
+            int channels[3];
+            for (int c = 0; c < 3; c++) {
+                int value = (fixed[c][0] * pixel.r + fixed[c][1] * pixel.g + fixed[c][2] * pixel.b + fixed[c][3]) >> COLOR_MATRIX_SHIFT;
+                channels[c] = value < 0 ? 0 : value > MAX_COLOR_VALUE ? MAX_COLOR_VALUE : value;
+            }
+            pixel.r = (unsigned char)channels[0];
+            pixel.g = (unsigned char)channels[1];
+            pixel.b = (unsigned char)channels[2];
+            *is_gray = 0;
+            break;
+        }
+        case OP_LUMA_CURVE: {
+            int luma = luma_from_rgb(pixel.r, pixel.g, pixel.b);
+            set_pixel_luma(&pixel, luma, operation->curve[luma]);
+            break;
+        }
+        case OP_HUE_SATURATION: {
+            int h, s, v;
+            hsv_from_rgb(pixel.r, pixel.g, pixel.b, &h, &s, &v);
+            adjust_hue_saturation(&h, &s, operation->hue_shift, operation->saturation_scale);
+            rgb_from_hsv(h, s, v, &pixel);
+            break;
+        }
+        case OP_ROTATE:
+            break; // Geometric, handled by the caller
+        case OP_MEDIAN:
+        case OP_EDGES:
+        case OP_MORPHOLOGY:
+        case OP_CONVOLVE:
+        case OP_DITHER:
+            break; // Not point operations, rejected by lazy_record_operation
+        case OP_OVERLAY:
+            break; // Depends on the pixel position, blended by lazy_sample_pixel
+        case OP_CROP:
+        case OP_ORIENT:
+            break; // Geometric, rejected by lazy_record_operation
+    }
+    return pixel;
+}
+
+// Function to create an empty lazy chain over a copy of a source image
+LazyImage *create_lazy_image(Pixel **source, int width, int height) {
+    LazyImage *lazy = calloc(1, sizeof(LazyImage));
+    if (!lazy) {
+        printf("Memory allocation failed for lazy image.\n");
+        return NULL;
+    }
+    lazy->source = allocate_image(width, height);
+    if (!lazy->source) {
+        free(lazy);
+        return NULL;
+    }
+    for (int i = 0; i < height; i++) {
+        memcpy(lazy->source[i], source[i], width * sizeof(Pixel));
+    }
+    lazy->source_width = lazy->width = width;
+    lazy->source_height = lazy->height = height;
+    lazy->tiles_x = (width + LAZY_TILE_SIZE - 1) / LAZY_TILE_SIZE;
+    lazy->tiles_y = (height + LAZY_TILE_SIZE - 1) / LAZY_TILE_SIZE;
+    lazy->tiles = calloc((size_t)lazy->tiles_x * lazy->tiles_y, sizeof(Pixel *));
+    if (!lazy->tiles) {
+        free_image(lazy->source);
+        free(lazy);
+        return NULL;
+    }
+    build_point_curves(&lazy->curves);
+    return lazy;
+}
+
+// Function to drop every computed tile (after the chain changed)
+void lazy_discard_tiles(LazyImage *lazy) {
+    for (int k = 0; k < lazy->tiles_x * lazy->tiles_y; k++) {
+        free(lazy->tiles[k]);
+        lazy->tiles[k] = NULL;
+    }
+    lazy->tiles_computed = 0;
+}
+
+// Function to free a lazy chain, its source copy, its tiles and the masks of its operations
+void free_lazy_image(LazyImage *lazy) {
+    if (!lazy) {
+        return;
+    }
+    lazy_discard_tiles(lazy);
+    free_operation_chain(lazy->operations, lazy->count);
+    free(lazy->tiles);
+    free_image(lazy->source);
+    free(lazy);
+}
+
+// Function to append an operation to a lazy chain; nothing is computed until a consumer asks for pixels.
+// The chain takes ownership of the operation's mask.
+int lazy_record_operation(LazyImage *lazy, const Operation *operation) {
+    if (lazy->count == MAX_OPERATIONS) {
+        printf("Too many operations in chain (maximum %d).\n", MAX_OPERATIONS);
+        return -1;
+    }
+
+    if (!operation_is_pointwise(operation->type)) {
+        printf("Operation %d needs neighboring pixels or resizes the image and cannot be evaluated lazily.\n", operation->type);
+        return -1;
+    }
+
+    lazy_discard_tiles(lazy);
+
+    // A color matrix or luminance curve following one of its kind is folded into it at record time
+    if (lazy->count > 0 && lazy->stage_rotations[lazy->count - 1] == lazy->rotations &&
+        fuse_operations(&lazy->operations[lazy->count - 1], operation)) {
+        printf("Fused into operation %d of the lazy chain.\n", lazy->count);
+        return 0;
+    }
+
+    lazy->stage_rotations[lazy->count] = lazy->rotations;
+    lazy->operations[lazy->count++] = *operation;
+
+    if (operation->type == OP_ROTATE) {
+        // Rotations only change how result coordinates map back to the source
+        Pixel **tiles = calloc((size_t)lazy->tiles_y * lazy->tiles_x, sizeof(Pixel *));
+        if (!tiles) {
+            lazy->count--;
+            return -1;
+        }
+        free(lazy->tiles);
+        lazy->tiles = tiles;
+        lazy->rotations++;
+        int swap = lazy->width;
+        lazy->width = lazy->height;
+        lazy->height = swap;
+        swap = lazy->tiles_x;
+        lazy->tiles_x = lazy->tiles_y;
+        lazy->tiles_y = swap;
+    }
+    printf("Recorded operation %d in the lazy chain.\n", lazy->count);
+    return 0;
+}
+
+// Function to map result coordinates back to source coordinates by undoing the recorded rotations
+static void lazy_map_to_source(const LazyImage *lazy, int x, int y, int *source_x, int *source_y) {
+    int current_width = lazy->width, current_height = lazy->height;
+    for (int k = lazy->rotations % 4; k > 0; k--) {
+        // rotate_image moves (row i, column j) to (row j, column old_height - 1 - i)
+        int old_y = current_width - 1 - x;
+        x = y;
+        y = old_y;
+        int swap = current_width;
+        current_width = current_height;
+        current_height = swap;
+    }
+    *source_x = x;
+    *source_y = y;
+}
+
+// Function to check whether the source pixel at (x, y) lies in the region of a recorded operation;
+// (stage_x, stage_y) receives its coordinates in the image that operation sees
+static int lazy_in_region(const LazyImage *lazy, int k, int x, int y, int *stage_x, int *stage_y) {
+    int current_width = lazy->source_width, current_height = lazy->source_height;
+    for (int r = lazy->stage_rotations[k] % 4; r > 0; r--) {
+        int new_x = current_height - 1 - y;
+        y = x;
+        x = new_x;
+        int swap = current_width;
+        current_width = current_height;
+        current_height = swap;
+    }
+    *stage_x = x;
+    *stage_y = y;
+    const Region *region = &lazy->operations[k].region;
+    Rect area = clip_region(region, current_width, current_height);
+    if (x < area.x || y < area.y || x >= area.x + area.width || y >= area.y + area.height) {
+        return 0;
+    }
+    return !REGION_SKIPS(region, y, x);
+}
+
+// Function to evaluate the recorded chain for one result pixel without computing its tile
+Pixel lazy_sample_pixel(const LazyImage *lazy, int x, int y) {
+    int source_x, source_y;
+    lazy_map_to_source(lazy, x, y, &source_x, &source_y);
+
+    Pixel pixel = lazy->source[source_y][source_x];
+    int image_gray = 0; // Whether apply_operation_chain would hold the image as Gray8 at this step
+    for (int k = 0; k < lazy->count; k++) {
+        const Operation *operation = &lazy->operations[k];
+        if (operation->type == OP_ROTATE) {
+            continue;
+        }
+        int stage_x, stage_y;
+        if (operation->type == OP_OVERLAY) {
+            if (lazy_in_region(lazy, k, source_x, source_y, &stage_x, &stage_y)) {
+                const Rect *rect = &operation->region.rect;
+                Pixel over = operation->overlay[stage_y - rect->y][stage_x - rect->x];
+                int alpha = operation->overlay_alpha[stage_y - rect->y][stage_x - rect->x];
+                pixel.r = (unsigned char)blend_channel(pixel.r, over.r, alpha);
+                pixel.g = (unsigned char)blend_channel(pixel.g, over.g, alpha);
+                pixel.b = (unsigned char)blend_channel(pixel.b, over.b, alpha);
+            }
+        } else if (!operation->has_region || lazy_in_region(lazy, k, source_x, source_y, &stage_x, &stage_y)) {
+            int pixel_gray = image_gray;
+            pixel = apply_point_operation(operation, pixel, &pixel_gray, &lazy->curves);
+        }
+        if (operation->type == OP_AGED || operation->type == OP_COLOR_MATRIX || operation->type == OP_OVERLAY) {
+            image_gray = 0;
+        } else if (!operation->has_region && (operation->type == OP_GRAYSCALE || operation->type == OP_XRAY)) {
+            image_gray = 1;
+        }
+    }
+    return pixel;
+}
+
+// Function to compute one tile of the result
+static Pixel *lazy_compute_tile(const LazyImage *lazy, int tx, int ty) {
+    int tile_x = tx * LAZY_TILE_SIZE, tile_y = ty * LAZY_TILE_SIZE;
+    int tile_width = min(LAZY_TILE_SIZE, lazy->width - tile_x);
+    int tile_height = min(LAZY_TILE_SIZE, lazy->height - tile_y);
+
+    Pixel *tile = malloc((size_t)LAZY_TILE_SIZE * LAZY_TILE_SIZE * sizeof(Pixel));
+    if (!tile) {
+        return NULL;
+    }
+    for (int i = 0; i < tile_height; i++) {
+        for (int j = 0; j < tile_width; j++) {
+            tile[i * LAZY_TILE_SIZE + j] = lazy_sample_pixel(lazy, tile_x + j, tile_y + i);
+        }
+    }
+    return tile;
+}
+
+// Function to make sure every tile intersecting an area is computed, computing the missing ones in parallel
+void lazy_request_tiles(LazyImage *lazy, Rect area) {
+    Rect bounds = {0, 0, lazy->width, lazy->height};
+    Region clip = {area, NULL, 0, 0};
+    bounds = clip_region(&clip, bounds.width, bounds.height);
+    if (bounds.width == 0 || bounds.height == 0) {
+        return;
+    }
+
+    int first_tx = bounds.x / LAZY_TILE_SIZE, last_tx = (bounds.x + bounds.width - 1) / LAZY_TILE_SIZE;
+    int first_ty = bounds.y / LAZY_TILE_SIZE, last_ty = (bounds.y + bounds.height - 1) / LAZY_TILE_SIZE;
+    int columns = last_tx - first_tx + 1;
+    int count = columns * (last_ty - first_ty + 1);
+    int computed = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:computed)
+    for (int k = 0; k < count; k++) {
+        int tx = first_tx + k % columns, ty = first_ty + k / columns;
+        Pixel **slot = &lazy->tiles[(size_t)ty * lazy->tiles_x + tx];
+        if (!*slot) {
+            *slot = lazy_compute_tile(lazy, tx, ty);
+            computed += *slot != NULL;
+        }
+    }
+    lazy->tiles_computed += computed;
+}
+
+// Function to read one result pixel through the tile cache
+Pixel lazy_get_pixel(LazyImage *lazy, int x, int y) {
+    Pixel *tile = lazy->tiles[(size_t)(y / LAZY_TILE_SIZE) * lazy->tiles_x + x / LAZY_TILE_SIZE];
+    if (!tile) {
+        Rect area = {x, y, 1, 1};
+        lazy_request_tiles(lazy, area);
+        tile = lazy->tiles[(size_t)(y / LAZY_TILE_SIZE) * lazy->tiles_x + x / LAZY_TILE_SIZE];
+        if (!tile) {
+            return lazy_sample_pixel(lazy, x, y);
+        }
+    }
+    return tile[(y % LAZY_TILE_SIZE) * LAZY_TILE_SIZE + x % LAZY_TILE_SIZE];
+}
 
-    // Apply parallel processing to adjust each pixel for aging effect
-    #pragma omp parallel for collapse(2)
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            // Calculate new intensities with weighted adjustments to mimic aging
-            float red_intensity = image[i][j].r * (1 + factor * (MAX_COLOR_VALUE - image[i][j].r) / (float)MAX_COLOR_VALUE);
-            float green_intensity = image[i][j].g * (1 + factor * (MAX_COLOR_VALUE - image[i][j].g) / (float)MAX_COLOR_VALUE);
-            float blue_intensity = image[i][j].b * (1 - factor * image[i][j].b / (float)MAX_COLOR_VALUE);
+// Function to copy a rectangle of the result out of the tile cache, computing only the tiles it touches
+Pixel **lazy_export_region(LazyImage *lazy, int x, int y, int *region_width, int *region_height) {
+    Rect requested = {x, y, *region_width, *region_height};
+    Region clip = {requested, NULL, 0, 0};
+    Rect area = clip_region(&clip, lazy->width, lazy->height);
+    if (area.width == 0 || area.height == 0) {
+        printf("The requested region is outside the image.\n");
+        return NULL;
+    }
 
-            // Further refine intensities to add an aged look
-            red_intensity += 10 * (1 - image[i][j].r / (float)MAX_COLOR_VALUE);
-            green_intensity += 10 * (1 - image[i][j].g / (float)MAX_COLOR_VALUE);
-            blue_intensity -= 10 * (image[i][j].b / (float)MAX_COLOR_VALUE);
+    lazy_request_tiles(lazy, area);
+    Pixel **region = allocate_image(area.width, area.height);
+    if (!region) {
+        return NULL;
+    }
 
-            // Clamp intensities to the allowed color range and set new values
-            image[i][j].r = (unsigned char)fmin(fmax(red_intensity, 0), MAX_COLOR_VALUE);
-            image[i][j].g = (unsigned char)fmin(fmax(green_intensity, 0), MAX_COLOR_VALUE);
-            image[i][j].b = (unsigned char)fmin(fmax(blue_intensity, 0), MAX_COLOR_VALUE);
+    // The tiles were computed above, so the threads only read the tile table; a tile that could not be
+    // allocated is sampled pixel by pixel instead of being requested again from inside the loop
+    #pragma omp parallel for
+    for (int i = 0; i < area.height; i++) {
+        int y = area.y + i;
+        for (int j = 0; j < area.width; j++) {
+            int x = area.x + j;
+            const Pixel *tile = lazy->tiles[(size_t)(y / LAZY_TILE_SIZE) * lazy->tiles_x + x / LAZY_TILE_SIZE];
+            region[i][j] = tile ? tile[(y % LAZY_TILE_SIZE) * LAZY_TILE_SIZE + x % LAZY_TILE_SIZE] : lazy_sample_pixel(lazy, x, y);
         }
     }
 
-    printf("Aged image generated successfully.\n");
+    *region_width = area.width;
+    *region_height = area.height;
+    printf("Exported region %d x %d (%d tiles computed so far).\n", area.width, area.height, lazy->tiles_computed);
+    return region;
+}
+
+// Function to save the result of a lazy chain; PPM output is streamed one band of tiles at a time
+int lazy_save_image(const char *file_name, LazyImage *lazy) {
+    const char *extension = strrchr(file_name, '.');
+    if ((extension && strcmp(extension, ".ppm") != 0) || output_format == FORMAT_P3) {
+        // Other formats, and ASCII PPM, encode the whole image at once
+        int region_width = lazy->width, region_height = lazy->height;
+        Pixel **result = lazy_export_region(lazy, 0, 0, &region_width, &region_height);
+        if (!result) {
+            return -1;
+        }
+        save_image(file_name, result, region_width, region_height);
+        free_image(result);
+        return 0;
+    }
+
+    char full_path[200];
+    snprintf(full_path, sizeof(full_path), "outputs/%s", file_name);
+    printf("Trying to save the lazy result to: %s\n", full_path);
+
+    FILE *file = create_output_file(full_path);
+    Pixel *row = malloc(lazy->width * sizeof(Pixel));
+    if (!file || !row) {
+        printf("Error opening file %s for writing.\n", full_path);
+        if (file) {
+            fclose(file);
+        }
+        free(row);
+        return -1;
+    }
+
+    fprintf(file, "P6\n%d %d\n%d\n", lazy->width, lazy->height, MAX_COLOR_VALUE);
+    int failed = 0;
+    for (int ty = 0; ty < lazy->tiles_y && !failed; ty++) {
+        Rect band = {0, ty * LAZY_TILE_SIZE, lazy->width, LAZY_TILE_SIZE};
+        lazy_request_tiles(lazy, band);
+        for (int tx = 0; tx < lazy->tiles_x; tx++) {
+            failed |= !lazy->tiles[(size_t)ty * lazy->tiles_x + tx];
+        }
+        if (failed) {
+            printf("Memory allocation failed for the tiles of row %d.\n", ty);
+            break;
+        }
+
+        int band_height = min(LAZY_TILE_SIZE, lazy->height - band.y);
+        for (int i = 0; i < band_height; i++) {
+            for (int tx = 0; tx < lazy->tiles_x; tx++) {
+                const Pixel *tile = lazy->tiles[(size_t)ty * lazy->tiles_x + tx];
+                int tile_width = min(LAZY_TILE_SIZE, lazy->width - tx * LAZY_TILE_SIZE);
+                memcpy(row + tx * LAZY_TILE_SIZE, tile + i * LAZY_TILE_SIZE, tile_width * sizeof(Pixel));
+            }
+            fwrite(row, sizeof(Pixel), lazy->width, file);
+        }
+    }
+
+    free(row);
+    fclose(file);
+    if (failed) {
+        DeleteFile(full_path); // Do not leave a truncated image behind
+        return -1;
+    }
+    printf("Image saved as %s\n", full_path);
+    return 0;
+}
+
+// Function to record a GUI operation in the lazy chain instead of executing it
+void record_lazy_operation(HWND hwnd, int operation) {
+    static const OperationType button_operations[] = {OP_GRAYSCALE, OP_NEGATIVE, OP_XRAY, OP_ROTATE, OP_AGED};
+
+    if (!lazy_image) {
+        lazy_image = create_lazy_image(image, width, height);
+        if (!lazy_image) {
+            MessageBox(hwnd, "Failed to start a lazy chain.", "Error", MB_OK | MB_ICONERROR);
+            return;
+        }
+    }
+
+    Operation recorded = {0};
+    recorded.type = button_operations[operation - 2];
+    if (lazy_record_operation(lazy_image, &recorded) != 0) {
+        MessageBox(hwnd, "The lazy chain is full.", "Error", MB_OK | MB_ICONERROR);
+    }
+}
+
+// Function to name an output after an input file, without its directories and extension, plus a suffix
+void build_name_from_input(char *output_name, size_t size, const char *input_name, const char *suffix) {
+    const char *base = input_name;
+    for (const char *c = input_name; *c; c++) {
+        if (*c == '/' || *c == '\\' || *c == ':') {
+            base = c + 1;
+        }
+    }
+    const char *extension = strrchr(base, '.');
+    snprintf(output_name, size, "%.*s%s", (int)(extension ? extension - base : (ptrdiff_t)strlen(base)), base, suffix);
+}
+
+// Function to start reading a whole batch file. With a completion port the read is queued and completes
+// later; without one the file is read at once.
+static int batch_start_read(BatchFile *item, HANDLE port) {
+    item->file = CreateFileA(item->input_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                             port ? FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (item->file == INVALID_HANDLE_VALUE) {
+        printf("Error opening the file %s\n", item->input_name);
+        return -1;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(item->file, &file_size) || file_size.QuadPart <= 0 || file_size.QuadPart > BATCH_MAX_FILE_SIZE) {
+        printf("The file %s is empty or too large for batch mode.\n", item->input_name);
+        CloseHandle(item->file);
+        return -1;
+    }
+    item->size = (size_t)file_size.QuadPart;
+    item->data = malloc(item->size);
+    item->writing = 0;
+    memset(&item->overlapped, 0, sizeof(item->overlapped));
+    DWORD done = 0;
+    if (!item->data || (port && !CreateIoCompletionPort(item->file, port, 0, 0)) ||
+        (!ReadFile(item->file, item->data, (DWORD)item->size, port ? NULL : &done, port ? &item->overlapped : NULL) &&
+         (!port || GetLastError() != ERROR_IO_PENDING)) ||
+        (!port && done != item->size)) {
+        printf("Error reading the file %s\n", item->input_name);
+        CloseHandle(item->file);
+        free(item->data);
+        item->data = NULL;
+        return -1;
+    }
+    if (!port) {
+        CloseHandle(item->file);
+    }
+    return 0;
+}
+
+// Function to start writing the encoded result of a batch file under outputs/, queued like the reads
+static int batch_start_write(BatchFile *item, HANDLE port) {
+    // A previous output may be a hard link to a cache entry, so it is replaced rather than overwritten
+    DeleteFileA(item->output_name);
+    item->file = CreateFileA(item->output_name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                             port ? FILE_FLAG_OVERLAPPED : FILE_ATTRIBUTE_NORMAL, NULL);
+    item->writing = 1;
+    memset(&item->overlapped, 0, sizeof(item->overlapped));
+    DWORD done = 0;
+    if (item->file == INVALID_HANDLE_VALUE || (port && !CreateIoCompletionPort(item->file, port, 0, 0)) ||
+        (!WriteFile(item->file, item->data, (DWORD)item->size, port ? NULL : &done, port ? &item->overlapped : NULL) &&
+         (!port || GetLastError() != ERROR_IO_PENDING)) ||
+        (!port && done != item->size)) {
+        printf("Error writing the file %s\n", item->output_name);
+        if (item->file != INVALID_HANDLE_VALUE) {
+            CloseHandle(item->file);
+        }
+        free(item->data);
+        item->data = NULL;
+        return -1;
+    }
+    if (!port) {
+        CloseHandle(item->file);
+        free(item->data);
+        item->data = NULL;
+    }
+    return 0;
+}
+
+// Function to decode a batch file from memory, run the chain on it and replace its data with the encoded result
+static int batch_process(BatchFile *item, const Operation *chain, int count) {
+    ChainImage image = {0};
+    unsigned char *result = NULL;
+    size_t result_size = 0;
+    if (decode_chain_image(item->data, item->size, &image) == 0 && apply_operation_chain(&image, chain, count) == 0) {
+        result = encode_chain_image(&image, &result_size);
+    }
+
+    size_t directory_length = strlen("outputs/");
+    memcpy(item->output_name, "outputs/", directory_length);
+    build_name_from_input(item->output_name + directory_length, sizeof(item->output_name) - directory_length,
+                          item->input_name, image.gray ? ".pgm" : ".ppm");
+    free_chain_image(&image);
+    free(item->data);
+    item->data = result;
+    item->size = result_size;
+    return result ? 0 : -1;
+}
+
+// Function to hash an operation chain together with the file contents it loaded (masks, kernels, overlays)
+static uint64_t hash_operation_chain(const char *operations, const Operation *chain, int count) {
+    uint64_t hash = hash_bytes(operations, strlen(operations), RESULT_CACHE_VERSION);
+    for (int k = 0; k < count; k++) {
+        const Operation *operation = &chain[k];
+        if (operation->has_region && operation->region.mask) {
+            hash = hash_bytes(operation->region.mask[0], (size_t)operation->region.mask_width * operation->region.mask_height, hash);
+        }
+        if (operation->kernel) {
+            hash = hash_bytes(operation->kernel, (size_t)operation->kernel_width * operation->kernel_height * sizeof(float), hash);
+        }
+        if (operation->overlay) {
+            size_t pixels = (size_t)operation->region.rect.width * operation->region.rect.height;
+            hash = hash_bytes(operation->overlay[0], pixels * sizeof(Pixel), hash);
+            hash = hash_bytes(operation->overlay_alpha[0], pixels, hash);
+        }
+    }
+    return hash;
+}
+
+// Function to compare result cache entries by path, for sorting and searching
+static int compare_cache_entries(const void *a, const void *b) {
+    return strcmp(((const ResultCacheEntry *)a)->path, ((const ResultCacheEntry *)b)->path);
+}
+
+// Function to load the result cache index (a missing index is an empty cache)
+static void load_result_cache(ResultCache *cache, uint64_t chain_hash) {
+    cache->entries = NULL;
+    cache->count = 0;
+    cache->chain_hash = chain_hash;
+    create_directory(RESULT_CACHE_DIRECTORY);
+
+    FILE *file = fopen(RESULT_CACHE_INDEX, "r");
+    if (!file) {
+        return;
+    }
+    int capacity = 0;
+    unsigned long long size, modified, content_hash;
+    char path[MAX_PATH];
+    while (fscanf(file, "%llu %llu %llx %259[^\n]", &size, &modified, &content_hash, path) == 4) {
+        if (cache->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            ResultCacheEntry *grown = realloc(cache->entries, capacity * sizeof(ResultCacheEntry));
+            if (!grown) {
+                break;
+            }
+            cache->entries = grown;
+        }
+        ResultCacheEntry *entry = &cache->entries[cache->count];
+        entry->path = strdup(path);
+        if (!entry->path) {
+            break;
+        }
+        entry->size = size;
+        entry->modified = modified;
+        entry->content_hash = content_hash;
+        entry->replaced = 0;
+        cache->count++;
+    }
+    fclose(file);
+    qsort(cache->entries, cache->count, sizeof(ResultCacheEntry), compare_cache_entries);
+    printf("Result cache index has %d entries.\n", cache->count);
+}
+
+// Function to find the index entry of an input file
+static ResultCacheEntry *find_cache_entry(const ResultCache *cache, const char *path) {
+    ResultCacheEntry key = {(char *)path, 0, 0, 0, 0};
+    return cache->count ? bsearch(&key, cache->entries, cache->count, sizeof(ResultCacheEntry), compare_cache_entries) : NULL;
+}
+
+// Function to name the cache entry of a batch file's result
+static void build_cache_name(char *cache_name, size_t size, const ResultCache *cache, const BatchFile *item, const char *extension) {
+    uint64_t key[2] = {item->content_hash, cache->chain_hash};
+    snprintf(cache_name, size, "%s/%016llx%s", RESULT_CACHE_DIRECTORY,
+             (unsigned long long)hash_bytes(key, sizeof(key), RESULT_CACHE_VERSION), extension);
+}
+
+// Function to check that a cache entry still holds a whole P6 or P5 image: its size must match its header.
+// Entries are hard-linked into outputs/, so anything that truncated or rewrote an output in place shows up here.
+static int cached_result_intact(const char *cache_name) {
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    FILE *file = fopen(cache_name, "rb");
+    if (!file || !GetFileAttributesExA(cache_name, GetFileExInfoStandard, &attributes)) {
+        if (file) {
+            fclose(file);
+        }
+        return 0;
+    }
+    char header[64];
+    size_t length = fread(header, 1, sizeof(header) - 1, file);
+    fclose(file);
+    header[length] = '\0';
+
+    char format;
+    int width, height, max_value, header_length = 0;
+    if (sscanf(header, "P%c %d %d %d%n", &format, &width, &height, &max_value, &header_length) != 4 ||
+        (format != '6' && format != '5') || width <= 0 || height <= 0 || header_length == 0) {
+        return 0;
+    }
+    uint64_t expected = (uint64_t)header_length + 1 + (uint64_t)width * height * (format == '6' ? 3 : 1);
+    uint64_t size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+    return size == expected;
+}
+
+// Function to put a cached result in place of a batch output by hard-linking it (copying where links fail).
+// Returns 0 on a hit, 1 when the result is not cached. A damaged entry is deleted and counts as a miss.
+static int result_cache_fetch(const ResultCache *cache, BatchFile *item) {
+    static const char *extensions[] = {".ppm", ".pgm"};
+    for (int e = 0; e < 2; e++) {
+        char cache_name[MAX_PATH];
+        build_cache_name(cache_name, sizeof(cache_name), cache, item, extensions[e]);
+        if (GetFileAttributesA(cache_name) == INVALID_FILE_ATTRIBUTES) {
+            continue;
+        }
+        if (!cached_result_intact(cache_name)) {
+            printf("Dropping the damaged cache entry %s\n", cache_name);
+            DeleteFileA(cache_name);
+            continue;
+        }
+        size_t directory_length = strlen("outputs/");
+        memcpy(item->output_name, "outputs/", directory_length);
+        build_name_from_input(item->output_name + directory_length, sizeof(item->output_name) - directory_length,
+                              item->input_name, extensions[e]);
+        DeleteFileA(item->output_name);
+        if (CreateHardLinkA(item->output_name, cache_name, NULL) || CopyFileA(cache_name, item->output_name, FALSE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to keep a freshly written batch output in the cache, as a hard link to it (or a copy)
+static void result_cache_store(const ResultCache *cache, const BatchFile *item) {
+    char cache_name[MAX_PATH];
+    build_cache_name(cache_name, sizeof(cache_name), cache, item, strrchr(item->output_name, '.'));
+    DeleteFileA(cache_name);
+    if (!CreateHardLinkA(cache_name, item->output_name, NULL)) {
+        CopyFileA(item->output_name, cache_name, FALSE);
+    }
+}
+
+// Function to look up an input in the cache index without reading it: a matching size and modification time
+// give its hash, and a cached result then stands in for the whole load, transform and save
+static int result_cache_precheck(const ResultCache *cache, BatchFile *item) {
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(item->input_name, GetFileExInfoStandard, &attributes)) {
+        return 1;
+    }
+    item->file_size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+    item->modified = ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+    ResultCacheEntry *entry = find_cache_entry(cache, item->input_name);
+    if (!entry || entry->size != item->file_size || entry->modified != item->modified) {
+        return 1;
+    }
+    item->content_hash = entry->content_hash;
+    item->hashed = 1;
+    return result_cache_fetch(cache, item);
+}
+
+// Function to write the result cache index back: the inputs of this batch plus the older entries for other files.
+// The index is written to a temporary file first so an interrupted run never leaves it half written.
+static void save_result_cache(ResultCache *cache, const BatchFile *items, int count) {
+    FILE *file = fopen(RESULT_CACHE_INDEX ".tmp", "w");
+    if (file) {
+        for (int k = 0; k < count; k++) {
+            if (!items[k].hashed) {
+                continue;
+            }
+            ResultCacheEntry *entry = find_cache_entry(cache, items[k].input_name);
+            if (entry) {
+                entry->replaced = 1;
+            }
+            fprintf(file, "%llu %llu %016llx %s\n", (unsigned long long)items[k].file_size,
+                    (unsigned long long)items[k].modified, (unsigned long long)items[k].content_hash, items[k].input_name);
+        }
+        for (int k = 0; k < cache->count; k++) {
+            if (!cache->entries[k].replaced) {
+                fprintf(file, "%llu %llu %016llx %s\n", (unsigned long long)cache->entries[k].size,
+                        (unsigned long long)cache->entries[k].modified, (unsigned long long)cache->entries[k].content_hash,
+                        cache->entries[k].path);
+            }
+        }
+        fclose(file);
+        if (!MoveFileExA(RESULT_CACHE_INDEX ".tmp", RESULT_CACHE_INDEX, MOVEFILE_REPLACE_EXISTING)) {
+            printf("Error updating the result cache index.\n");
+        }
+    }
+
+    for (int k = 0; k < cache->count; k++) {
+        free(cache->entries[k].path);
+    }
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->count = 0;
+}
+
+// Function to run an operation chain over many files, saving each result under outputs/ with the input's name.
+// Reads of upcoming files and writes of finished ones stay queued on an I/O completion port, up to
+// BATCH_QUEUE_DEPTH at a time, and completions are collected in groups; each group of files that has
+// arrived is decoded, processed and encoded in parallel. Without a completion port the files are read
+// and written with blocking calls, a group at a time. Results found in the result cache are linked into
+// place instead of being computed again.
+int run_batch(const char *operations, char **inputs, int count) {
+    Operation chain[MAX_OPERATIONS];
+    int chain_count = parse_operation_chain(operations, chain, MAX_OPERATIONS);
+    BatchFile *items = chain_count >= 0 ? calloc(count, sizeof(BatchFile)) : NULL;
+    if (!items) {
+        if (chain_count >= 0) {
+            free_operation_chain(chain, chain_count);
+        }
+        return -1;
+    }
+    create_directory("outputs"); // Checked once for the whole batch
+    ResultCache cache;
+    load_result_cache(&cache, hash_operation_chain(operations, chain, chain_count));
+
+    HANDLE port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+    if (!port) {
+        printf("No I/O completion port, using blocking reads and writes.\n");
+    }
+
+    int next = 0, in_flight = 0, finished = 0, failed = 0, cached = 0;
+    while (finished < count) {
+        BatchFile *ready[BATCH_QUEUE_DEPTH];
+        int ready_count = 0;
+
+        // Keep the queue filled with reads of upcoming files
+        while (next < count && in_flight + ready_count < BATCH_QUEUE_DEPTH) {
+            BatchFile *item = &items[next];
+            item->input_name = inputs[next++];
+            if (result_cache_precheck(&cache, item) == 0) {
+                cached++;
+                finished++;
+            } else if (batch_start_read(item, port) != 0) {
+                failed++;
+                finished++;
+            } else if (port) {
+                in_flight++;
+            } else {
+                ready[ready_count++] = item;
+            }
+        }
+
+        // Collect a group of completions: finished reads are ready to process, finished writes are done
+        if (port && in_flight > 0) {
+            OVERLAPPED_ENTRY entries[BATCH_QUEUE_DEPTH];
+            ULONG removed = 0;
+            if (!GetQueuedCompletionStatusEx(port, entries, BATCH_QUEUE_DEPTH, &removed, INFINITE, FALSE)) {
+                printf("Waiting for batch I/O failed.\n");
+                break;
+            }
+            for (ULONG e = 0; e < removed; e++) {
+                BatchFile *item = (BatchFile *)entries[e].lpOverlapped;
+                in_flight--;
+                CloseHandle(item->file);
+                if (entries[e].dwNumberOfBytesTransferred != item->size) {
+                    printf("Error %s the file %s\n", item->writing ? "writing" : "reading",
+                           item->writing ? item->output_name : item->input_name);
+                    failed++;
+                }
+                if (item->writing && entries[e].dwNumberOfBytesTransferred == item->size) {
+                    result_cache_store(&cache, item);
+                }
+                if (item->writing || entries[e].dwNumberOfBytesTransferred != item->size) {
+                    free(item->data);
+                    item->data = NULL;
+                    finished++;
+                } else {
+                    ready[ready_count++] = item;
+                }
+            }
+        }
+
+        // Hash the files that have arrived; the ones whose result is not cached are decoded, processed and encoded
+        int group_failed = 0, group_cached = 0;
+        #pragma omp parallel for schedule(dynamic) reduction(+ : group_failed, group_cached)
+        for (int r = 0; r < ready_count; r++) {
+            BatchFile *item = ready[r];
+            item->content_hash = hash_bytes(item->data, item->size, 0);
+            item->hashed = 1;
+            if (result_cache_fetch(&cache, item) == 0) {
+                free(item->data);
+                item->data = NULL;
+                group_cached++;
+            } else if (batch_process(item, chain, chain_count) != 0) {
+                group_failed++;
+            }
+        }
+        failed += group_failed;
+        cached += group_cached;
+
+        // Queue the writes of the results
+        for (int r = 0; r < ready_count; r++) {
+            if (!ready[r]->data) {
+                finished++;
+            } else if (batch_start_write(ready[r], port) != 0) {
+                failed++;
+                finished++;
+            } else if (port) {
+                in_flight++;
+            } else {
+                result_cache_store(&cache, ready[r]);
+                finished++;
+            }
+        }
+    }
+
+    if (port) {
+        CloseHandle(port);
+    }
+    save_result_cache(&cache, items, count);
+    free(items);
+    free_operation_chain(chain, chain_count);
+    printf("Batch finished: %d of %d files processed, %d from the result cache.\n", count - failed, count, cached);
+    return failed ? -1 : 0;
+}
+
+// Function to read the next frame of a stream into a slot, reusing the slot's buffer when the frame size matches;
+// returns 1 at the end of the input and -1 on a malformed frame
+static int stream_read_frame(FILE *input, StreamFrame *frame) {
+    int c;
+    while ((c = fgetc(input)) != EOF && isspace(c)); // Whitespace after the last frame is not another frame
+    if (c == EOF) {
+        return 1;
+    }
+    ungetc(c, input);
+
+    char format[3];
+    int frame_width, frame_height, max_color;
+    if (read_pnm_header(input, format, &frame_width, &frame_height, &max_color) != 0) {
+        return -1;
+    }
+    if (strcmp(format, "P3") == 0 || max_color != MAX_COLOR_VALUE || frame_width <= 0 || frame_height <= 0) {
+        printf("Stream frames must be binary PPM (P6) or PGM (P5) with a max color of %d.\n", MAX_COLOR_VALUE);
+        return -1;
+    }
+
+    int gray = format[1] == '5';
+    if (!frame->buffer || frame->buffer_width != frame_width || frame->buffer_height != frame_height ||
+        frame->buffer_gray != gray) {
+        free(frame->buffer);
+        frame->buffer = gray ? (void *)allocate_gray_image(frame_width, frame_height)
+                             : (void *)allocate_image(frame_width, frame_height);
+        if (!frame->buffer) {
+            return -1;
+        }
+        frame->buffer_width = frame_width;
+        frame->buffer_height = frame_height;
+        frame->buffer_gray = gray;
+    }
+
+    ChainImage image = {frame_width, frame_height, gray ? NULL : frame->buffer, gray ? frame->buffer : NULL, NULL, 0};
+    ImageView view = chain_image_view(&image);
+    size_t pixel_bytes = view.stride * frame_height;
+    if (fread(view.base, 1, pixel_bytes, input) != pixel_bytes) {
+        printf("The stream ended inside a %d x %d frame.\n", frame_width, frame_height);
+        return -1;
+    }
+    frame->image = image;
+    return 0;
+}
+
+// Function to write a processed frame to the output of a stream. Packed rows go out as they are;
+// a pending orientation is applied by the encoder while it copies.
+static int stream_write_frame(FILE *output, const ChainImage *image) {
+    if (image->orientation) {
+        size_t size;
+        unsigned char *encoded = encode_chain_image(image, &size);
+        int status = encoded && fwrite(encoded, 1, size, output) == size ? 0 : -1;
+        free(encoded);
+        return status;
+    }
+
+    ImageView view = chain_image_view(image);
+    size_t row_bytes = (size_t)view.width * view.channels;
+    if (fprintf(output, "P%c\n%d %d\n%d\n", image->gray ? '5' : '6', view.width, view.height, MAX_COLOR_VALUE) < 0) {
+        return -1;
+    }
+    if (view.stride == row_bytes) {
+        return fwrite(view.base, 1, row_bytes * view.height, output) == row_bytes * view.height ? 0 : -1;
+    }
+    for (int i = 0; i < view.height; i++) { // A cropped view, one row at a time
+        if (fwrite(view.base + (size_t)i * view.stride, 1, row_bytes, output) != row_bytes) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to release what the chain left in a frame slot. The frame buffer stays in the slot when the chain
+// worked on it in place (point operations do); otherwise the chain replaced or took it and it goes too.
+static void stream_recycle_frame(StreamFrame *frame) {
+    ChainImage *image = &frame->image;
+    void *pixels = image->gray ? (void *)image->gray : (void *)image->rgb;
+    if (pixels == frame->buffer && !image->parent && image->width == frame->buffer_width &&
+        image->height == frame->buffer_height && (image->gray != NULL) == frame->buffer_gray) {
+        image->rgb = NULL;
+        image->gray = NULL;
+    } else {
+        frame->buffer = NULL;
+    }
+    free_chain_image(image);
+}
+
+// Function to read the frames of a stream into free slots until the input ends or a stage fails
+DWORD WINAPI stream_reader_thread(LPVOID parameter) {
+    FrameStream *stream = parameter;
+    for (int k = 0;; k = (k + 1) % STREAM_FRAME_SLOTS) {
+        WaitForSingleObject(stream->free_slots, INFINITE);
+        StreamFrame *frame = &stream->frames[k];
+        int status = stream->failed ? 1 : stream_read_frame(stream->input, frame);
+        if (status < 0) {
+            stream->failed = 1;
+        }
+        frame->end = status != 0;
+        ReleaseSemaphore(stream->read_slots, 1, NULL);
+        if (frame->end) {
+            return 0;
+        }
+    }
+}
+
+// Function to write the processed frames of a stream in order and hand their slots back to the reader
+DWORD WINAPI stream_writer_thread(LPVOID parameter) {
+    FrameStream *stream = parameter;
+    int write_failed = 0;
+    for (int k = 0;; k = (k + 1) % STREAM_FRAME_SLOTS) {
+        WaitForSingleObject(stream->processed_slots, INFINITE);
+        StreamFrame *frame = &stream->frames[k];
+        if (frame->end) {
+            fflush(stream->output);
+            return 0;
+        }
+        if (!frame->skip && !write_failed) {
+            if (stream_write_frame(stream->output, &frame->image) == 0) {
+                stream->frames_written++;
+            } else {
+                printf("Failed to write frame %d to the output stream.\n", stream->frames_written + 1);
+                write_failed = 1;
+                stream->failed = 1;
+            }
+        }
+        stream_recycle_frame(frame);
+        ReleaseSemaphore(stream->free_slots, 1, NULL);
+    }
+}
+
+// Function to run stream mode: PPM/PGM frames are read from stdin, run through the chain and written to stdout.
+// Reading the next frame and writing the previous one overlap the chain running on the current one.
+int run_stream(const char *operations) {
+    // The frames own the real stdout; messages printed from here on, the operations' included, go to stderr
+    fflush(stdout);
+    int frame_descriptor = _dup(_fileno(stdout));
+    FILE *output = frame_descriptor >= 0 ? _fdopen(frame_descriptor, "wb") : NULL;
+    if (!output || _dup2(_fileno(stderr), _fileno(stdout)) < 0) {
+        fprintf(stderr, "Failed to take over stdout for the frame stream.\n");
+        return -1;
+    }
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(frame_descriptor, _O_BINARY);
+    setvbuf(stdin, NULL, _IOFBF, STREAM_IO_BUFFER_SIZE);
+    setvbuf(output, NULL, _IOFBF, STREAM_IO_BUFFER_SIZE);
+
+    Operation chain[MAX_OPERATIONS];
+    int count = parse_operation_chain(operations, chain, MAX_OPERATIONS);
+    if (count < 0) {
+        fclose(output);
+        return -1;
+    }
+
+    FrameStream *stream = calloc(1, sizeof(FrameStream));
+    HANDLE reader = NULL, writer = NULL;
+    if (stream) {
+        stream->input = stdin;
+        stream->output = output;
+        stream->free_slots = CreateSemaphore(NULL, STREAM_FRAME_SLOTS, STREAM_FRAME_SLOTS, NULL);
+        stream->read_slots = CreateSemaphore(NULL, 0, STREAM_FRAME_SLOTS, NULL);
+        stream->processed_slots = CreateSemaphore(NULL, 0, STREAM_FRAME_SLOTS, NULL);
+        // The writer starts first: without it the reader would fill every slot and wait forever
+        if (stream->free_slots && stream->read_slots && stream->processed_slots) {
+            writer = CreateThread(NULL, 0, stream_writer_thread, stream, 0, NULL);
+            reader = writer ? CreateThread(NULL, 0, stream_reader_thread, stream, 0, NULL) : NULL;
+        }
+    }
+
+    if (reader) {
+        // Frames read before a failure are still processed and written; the ones after it are only recycled
+        int chain_failed = 0, frames_read = 0;
+        for (int k = 0;; k = (k + 1) % STREAM_FRAME_SLOTS) {
+            WaitForSingleObject(stream->read_slots, INFINITE);
+            StreamFrame *frame = &stream->frames[k];
+            int end = frame->end;
+            if (!end) {
+                frames_read++;
+                frame->skip = chain_failed || apply_operation_chain(&frame->image, chain, count) != 0;
+                if (frame->skip && !chain_failed) {
+                    printf("The chain failed on frame %d; the stream stops.\n", frames_read);
+                }
+                chain_failed |= frame->skip;
+                stream->failed |= frame->skip;
+            }
+            ReleaseSemaphore(stream->processed_slots, 1, NULL);
+            if (end) {
+                break;
+            }
+        }
+        WaitForSingleObject(reader, INFINITE);
+        CloseHandle(reader);
+    } else {
+        printf("Failed to start the stream threads.\n");
+        if (writer) { // Let the writer see the end of an empty stream
+            stream->frames[0].end = 1;
+            ReleaseSemaphore(stream->processed_slots, 1, NULL);
+        }
+    }
+    if (writer) {
+        WaitForSingleObject(writer, INFINITE);
+        CloseHandle(writer);
+    }
+
+    int status = reader && !stream->failed ? 0 : -1;
+    if (stream) {
+        if (reader) {
+            printf("Stream finished: %d frames written.\n", stream->frames_written);
+        }
+        for (int k = 0; k < STREAM_FRAME_SLOTS; k++) {
+            free(stream->frames[k].buffer);
+        }
+        HANDLE semaphores[3] = {stream->free_slots, stream->read_slots, stream->processed_slots};
+        for (int k = 0; k < 3; k++) {
+            if (semaphores[k]) {
+                CloseHandle(semaphores[k]);
+            }
+        }
+        free(stream);
+    }
+    free_operation_chain(chain, count);
+    fclose(output);
+    return status;
 }
 
+// Function to dispatch the command-line modes; returns the process exit code
+int run_command_line(int argc, char **argv) {
+    if (strcmp(argv[1], "--batch") == 0 && argc >= 4) {
+        // T1 --batch operations input...: each result saved as outputs/<name>.ppm (or .pgm when gray)
+        return run_batch(argv[2], argv + 3, argc - 3) == 0 ? 0 : 1;
+    }
+
+    if (strcmp(argv[1], "--stream") == 0 && argc >= 3) {
+        // T1 --stream operations < frames.ppm > result.ppm: consecutive P6/P5 frames from stdin to stdout
+        return run_stream(argv[2]) == 0 ? 0 : 1;
+    }
+
+    if (strcmp(argv[1], "--thumbnails") == 0 && argc >= 4) {
+        // T1 --thumbnails scale input...: each input decoded at 1/scale into outputs/<name>_1of<scale>.ppm
+        int scale = atoi(argv[2]);
+        int failed = 0;
+        create_directory("outputs");
+        #pragma omp parallel for schedule(dynamic) reduction(+ : failed)
+        for (int k = 3; k < argc; k++) {
+            int thumbnail_width, thumbnail_height;
+            Pixel **thumbnail = load_image_scaled(argv[k], scale, &thumbnail_width, &thumbnail_height);
+            if (!thumbnail) {
+                failed++;
+                continue;
+            }
+            char suffix[16], output_name[MAX_PATH];
+            snprintf(suffix, sizeof(suffix), "_1of%d.ppm", scale);
+            build_name_from_input(output_name, sizeof(output_name), argv[k], suffix);
+            save_image(output_name, thumbnail, thumbnail_width, thumbnail_height);
+            free_image(thumbnail);
+        }
+        return failed ? 1 : 0;
+    }
+
+    if (strcmp(argv[1], "--ascii") == 0 && argc > 2) {
+        // T1 --ascii <mode> ...: images written with save_image are ASCII PPM (P3)
+        if (strcmp(argv[2], "--tiled-region") != 0 && strcmp(argv[2], "--lazy-region") != 0 &&
+            strcmp(argv[2], "--thumbnails") != 0) {
+            printf("--ascii applies to --tiled-region, --lazy-region and --thumbnails only.\n");
+            return 1;
+        }
+        output_format = FORMAT_P3;
+        return run_command_line(argc - 1, argv + 1);
+    }
+
+    if (strcmp(argv[1], "--low-memory") == 0 && argc > 2) {
+        // T1 --low-memory <mode> ...: rotations and flips reorder the pixels in place instead of copying them
+        low_memory_mode = 1;
+        return run_command_line(argc - 1, argv + 1);
+    }
+
+    if (strcmp(argv[1], "--server") == 0) {
+        // T1 --server [socket_path]
+        return run_image_service(argc > 2 ? argv[2] : SERVICE_DEFAULT_SOCKET);
+    }
+
+    if (strcmp(argv[1], "--to-tiled") == 0 && argc >= 4) {
+        // T1 --to-tiled input.ppm output.itl [tile_size] [--qoi]
+        int tile_size = argc > 4 && argv[4][0] != '-' ? atoi(argv[4]) : TILED_DEFAULT_TILE_SIZE;
+        int compression = strcmp(argv[argc - 1], "--qoi") == 0 ? TILED_COMPRESSION_QOI : TILED_COMPRESSION_NONE;
+        if (tile_size <= 0) {
+            printf("Tile size must be positive.\n");
+            return 1;
+        }
+        return convert_to_tiled(argv[2], argv[3], tile_size, compression) == 0 ? 0 : 1;
+    }
+
+    if (strcmp(argv[1], "--tiled-region") == 0 && argc >= 8) {
+        // T1 --tiled-region input.itl x y width height output_name (saved under outputs/)
+        int region_width = atoi(argv[5]), region_height = atoi(argv[6]);
+        Pixel **region = load_tiled_region(argv[2], atoi(argv[3]), atoi(argv[4]), &region_width, &region_height);
+        if (!region) {
+            return 1;
+        }
+        create_directory("outputs");
+        save_image(argv[7], region, region_width, region_height);
+        free_image(region);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "--lazy-region") == 0 && argc >= 9) {
+        // T1 --lazy-region input operations x y width height output_name: only the tiles under the region are computed
+        int image_width, image_height;
+        Pixel **source = load_image(argv[2], &image_width, &image_height);
+        Operation chain[MAX_OPERATIONS];
+        int count = source ? parse_operation_chain(argv[3], chain, MAX_OPERATIONS) : -1;
+        LazyImage *lazy = count >= 0 ? create_lazy_image(source, image_width, image_height) : NULL;
+        if (!lazy) {
+            free_image(source);
+            return 1;
+        }
+        for (int k = 0; k < count; k++) {
+            if (lazy_record_operation(lazy, &chain[k]) != 0) {
+                free_lazy_image(lazy);
+                free_image(source);
+                return 1;
+            }
+        }
+
+        int region_width = atoi(argv[6]), region_height = atoi(argv[7]);
+        Pixel **region = lazy_export_region(lazy, atoi(argv[4]), atoi(argv[5]), &region_width, &region_height);
+        if (region) {
+            create_directory("outputs");
+            save_image(argv[8], region, region_width, region_height);
+            free_image(region);
+        }
+        free_lazy_image(lazy);
+        free_image(source);
+        return region ? 0 : 1;
+    }
+
+    if (strcmp(argv[1], "--deep-zoom") == 0 && argc >= 5) {
+        // T1 --deep-zoom input operations output_name [tile_size]: tile pyramid of the chain result under outputs/
+        int tile_size = argc > 5 ? atoi(argv[5]) : DEEP_ZOOM_DEFAULT_TILE_SIZE;
+        if (tile_size <= 0) {
+            printf("Tile size must be positive.\n");
+            return 1;
+        }
+        ChainImage result = {0};
+        result.rgb = load_image(argv[2], &result.width, &result.height);
+        Operation chain[MAX_OPERATIONS];
+        int count = result.rgb ? parse_operation_chain(argv[3], chain, MAX_OPERATIONS) : -1;
+        int status = count >= 0 && apply_operation_chain(&result, chain, count) == 0 &&
+                     export_deep_zoom(&result, argv[4], tile_size) == 0 ? 0 : 1;
+        if (count >= 0) {
+            free_operation_chain(chain, count);
+        }
+        free_chain_image(&result);
+        return status;
+    }
+
+    printf("Usage:\n");
+    printf("  %s --server [socket_path]\n", argv[0]);
+    printf("  %s --to-tiled input.ppm output.itl [tile_size] [--qoi]\n", argv[0]);
+    printf("  %s --tiled-region input.itl x y width height output_name\n", argv[0]);
+    printf("  %s --lazy-region input operations x y width height output_name\n", argv[0]);
+    printf("  %s --deep-zoom input operations output_name [tile_size]\n", argv[0]);
+    printf("  %s --batch operations input...\n", argv[0]);
+    printf("  %s --thumbnails scale input...\n", argv[0]);
+    printf("  %s --stream operations < frames > frames\n", argv[0]);
+    printf("  %s --low-memory <any of the modes above>\n", argv[0]);
+    printf("  %s --ascii <--tiled-region|--lazy-region|--thumbnails> ...\n", argv[0]);
+    return 1;
+}
 
 // Function to display a window comparing the original and modified images
 void show_comparison_window(Pixel **original, Pixel **modified, int width, int height) {
@@ -593,8 +7004,15 @@ LRESULT CALLBACK ComparisonWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARA
                     // Draw original image on the left
                     SetPixel(hdc, x, y, RGB(original_image[src_y][src_x].r, original_image[src_y][src_x].g, original_image[src_y][src_x].b));
 
-                    // Draw modified image on the right
-                    SetPixel(hdc, x + scaled_width + 10, y, RGB(modified[src_y][src_x].r, modified[src_y][src_x].g, modified[src_y][src_x].b));
+                    // Draw modified image on the right; a lazy chain is evaluated only for the pixels shown
+                    Pixel shown;
+                    if (lazy_mode && lazy_image) {
+                        int lazy_x = min(src_x, lazy_image->width - 1), lazy_y = min(src_y, lazy_image->height - 1);
+                        shown = scale < 1 ? lazy_sample_pixel(lazy_image, lazy_x, lazy_y) : lazy_get_pixel(lazy_image, lazy_x, lazy_y);
+                    } else {
+                        shown = modified[src_y][src_x];
+                    }
+                    SetPixel(hdc, x + scaled_width + 10, y, RGB(shown.r, shown.g, shown.b));
                 }
             }
 